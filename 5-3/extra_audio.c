@@ -4,6 +4,8 @@
 #include <libavutil/avutil.h>
 #include <libavformat/avformat.h>
 
+#include "../common/async_writer.h"
+#include "../common/mmap_io.h"
 
 // 执行方式   直接终端  运行任务 
     // 然后  调试   配置 launch.json
@@ -34,8 +36,8 @@ int main(int argc, char* argv[]){
     }
     src = argv[1];
     dst = argv[2];
-    // 2. 打开多媒体文件
-    ret = avformat_open_input(&pFmtCtx, src, NULL, NULL);
+    // 2. 打开多媒体文件 (本地文件走 mmap)
+    ret = mmap_io_open_input(&pFmtCtx, src, NULL, NULL);
     if (ret < 0 )
     {
         av_log(NULL, AV_LOG_ERROR,"%s\n" ,av_err2str(ret));
@@ -74,8 +76,8 @@ int main(int argc, char* argv[]){
     avcodec_parameters_copy(outStream->codecpar, inStream->codecpar);
     outStream->codecpar->codec_tag = 0;
 
-    //  绑定
-    ret = avio_open2(&oFmtCtx->pb,dst,AVIO_FLAG_WRITE, NULL, NULL);
+    //  绑定 (写线程落盘, 读包写包的线程不等磁盘)
+    ret = async_writer_avio_open(&oFmtCtx->pb, dst, ASYNC_WRITER_PREALLOC);
     if (ret < 0 )
     {
         av_log(oFmtCtx, AV_LOG_ERROR,"%s\n" ,av_err2str(ret));
@@ -112,12 +114,12 @@ int main(int argc, char* argv[]){
 _ERROR:
     if (pFmtCtx)
     {
-        avformat_close_input(&pFmtCtx);
+        mmap_io_close_input(&pFmtCtx);
         pFmtCtx = NULL;
     }
     if (oFmtCtx->pb)
     {
-        avio_close(oFmtCtx->pb);
+        async_writer_avio_close(&oFmtCtx->pb);
     }
     
      if (oFmtCtx)
@@ -4,6 +4,8 @@
 #include <libavutil/avutil.h>
 #include <libavformat/avformat.h>
 
+#include "../common/async_writer.h"
+
 
 // ./extra_video /Users/mesay/Downloads/kyrie_Irving.mp4 1.flv
 
@@ -75,8 +77,8 @@ int main(int argc, char* argv[]){
     avcodec_parameters_copy(outStream->codecpar, inStream->codecpar);
     outStream->codecpar->codec_tag = 0;
 
-    //  绑定
-    ret = avio_open2(&oFmtCtx->pb,dst,AVIO_FLAG_WRITE, NULL, NULL);
+    //  绑定 (写线程落盘, 读包写包的线程不等磁盘)
+    ret = async_writer_avio_open(&oFmtCtx->pb, dst, ASYNC_WRITER_PREALLOC);
     if (ret < 0 )
     {
         av_log(oFmtCtx, AV_LOG_ERROR,"%s\n" ,av_err2str(ret));
@@ -117,7 +119,7 @@ _ERROR:
     }
     if (oFmtCtx->pb)
     {
-        avio_close(oFmtCtx->pb);
+        async_writer_avio_close(&oFmtCtx->pb);
     }
     
      if (oFmtCtx)
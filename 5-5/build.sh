@@ -0,0 +1,3 @@
+#!/bin/bash
+
+clang -g -o remux remux.c ../common/async_writer.c ../common/interleaver.c ../common/mmap_io.c `pkg-config --libs --cflags libavutil libavformat libavcodec` -lpthread -lm
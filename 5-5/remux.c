@@ -1,75 +1,167 @@
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
 
 #include <libavutil/log.h>
 #include <libavutil/avutil.h>
+#include <libavutil/cpu.h>
+#include <libavutil/avstring.h>
+#include <libavutil/fifo.h>
+#include <libavutil/mem.h>
+#include <libavutil/opt.h>
+#include <libavutil/time.h>
 #include <libavformat/avformat.h>
 
-// 重新封装格式     
-//  ./remux /Users/mesay/Downloads/kyrie_Irving.mp4 1.mp4/1.mov
+#include "../common/async_writer.h"
+#include "../common/interleaver.h"
+#include "../common/mmap_io.h"
 
-int main(int argc, char* argv[]){
+// 重新封装格式
+//  ./remux /Users/mesay/Downloads/kyrie_Irving.mp4 1.mp4/1.mov
+//
+// 交错写入限内存: 交错队列超过上限就回退输入重读, 不让 libavformat 无限缓存
+// 主要看交错队列自己的峰值; 要和不加参数的默认路径比峰值 RSS, 两边都加 -io file,
+// mmap 读进来的输入页会算进 RSS, 这时不打印
+//  ./remux [-io file|mmap] [-max_interleave MB] [-max_interleave_sec s] in.mkv out.mp4
+//
+// 切片模式: 按关键帧切成定长的 ts 或 fmp4 段, 写 prefix.m3u8
+//  ./remux -segment [-seg_time 6] [-seg_format ts|fmp4] [-seg_writers 4] in.mp4 out/seg
+//
+// 批量模式: 清单每行一对 "输入<Tab>输出" (没有 Tab 就按第一个空白分), # 开头是注释
+// N 个任务并发跑在线程池上, 并发数再受内存和文件描述符上限约束, 每个任务完成输出一行 JSON
+// 批量模式的输入不走 mmap: 映射的页会一直算在 RSS 里, 输入被截断还会 SIGBUS 把整批任务带走
+//  ./remux -batch list.txt [-jobs n] [-max_mem MB] [-max_fds n] > stats.jsonl
 
-    // 1. 处理一些参数, 
-    char* src;
-    char* dst;
+#define REMUX_JOB_MEM       (32 << 20)     ///< bytes one job is budgeted: I/O buffers and write-behind blocks, demuxer state, interleaving queue (inputs are not mapped)
+#define REMUX_JOB_FDS       2              ///< input and output
+#define REMUX_RESERVED_FDS  16             ///< stdio and whatever else the process keeps open
+#define REMUX_BATCH_DELTA   AV_TIME_BASE   ///< max_interleave_delta in batch mode, bounds the interleaving queue
+#define REMUX_SEG_IO_SIZE   (64 * 1024)    ///< AVIOContext buffer of the segmenting muxer
 
-    int *stream_map = NULL; 
+typedef struct RemuxStats {
+    int64_t packets;
+    int64_t bytes;
+} RemuxStats;
 
-    int i = 0;
-    int ret = -1;
-    int idx = -1;
-    int stream_idx = 0;
+typedef struct RemuxJob {
+    char *src;
+    char *dst;
+} RemuxJob;
 
+typedef struct RemuxBatch {
+    RemuxJob *jobs;
+    int nb_jobs;
+    int next_job;
+    int failed;
+    pthread_mutex_t mutex;
+} RemuxBatch;
 
-    AVFormatContext *pFmtCtx = NULL;
-    AVFormatContext *oFmtCtx = NULL;
+typedef struct RemuxWorker {
+    RemuxBatch *batch;
+    int id;
+    pthread_t thread;
+} RemuxWorker;
 
-    const AVOutputFormat *outFmt = NULL;
+static int input_mmap = 1;                ///< remux_file() reads local inputs through mmap_io
+static int64_t max_interleave_delta = -1; ///< -1: the muxer's default
+static int64_t interleave_max_bytes;      ///< our own interleaving queue's caps, both 0: libavformat interleaves
+static int64_t interleave_max_duration;
 
+static int64_t peak_rss_kb(void)
+{
+    struct rusage ru;
 
-    AVPacket pkt;
+    getrusage(RUSAGE_SELF, &ru);
+#ifdef __APPLE__
+    return ru.ru_maxrss / 1024;    // macOS: bytes
+#else
+    return ru.ru_maxrss;           // Linux: KB
+#endif
+}
 
+/*
+ * copy every packet of ic whose stream is mapped (stream_map[i] >= 0) to oc;
+ * hook, if set, sees each packet mapped and rescaled right before it is written.
+ * With il the packets go through it instead of av_interleaved_write_frame(),
+ * which may seek ic back, so reading only ends when il says so
+ */
+static int remux_packets(AVFormatContext *ic, AVFormatContext *oc,
+                         const int *stream_map, int nb_map, RemuxStats *stats,
+                         int (*hook)(void *opaque, AVPacket *pkt), void *opaque,
+                         Interleaver *il)
+{
+    AVStream *inStream, *outStream;
+    AVPacket *pkt;
+    int64_t pos;
+    int ret;
 
+    pkt = av_packet_alloc();
+    if (!pkt)
+        return AVERROR(ENOMEM);
 
+    for (;;) {
+        ret = av_read_frame(ic, pkt);
+        if (ret == AVERROR_EOF && il) {
+            // 跳过的流还没写完的话, 已经回退了输入, 接着读
+            if ((ret = interleaver_eof(il)) > 0)
+                continue;
+            break;
+        }
+        if (ret < 0)
+            break;
+        if (pkt->stream_index >= nb_map || stream_map[pkt->stream_index] < 0) {
+            av_packet_unref(pkt);
+            continue;
+        }
+        inStream = ic->streams[pkt->stream_index];
+        outStream = oc->streams[stream_map[pkt->stream_index]];
+        pkt->stream_index = stream_map[pkt->stream_index];
+        av_packet_rescale_ts(pkt, inStream->time_base, outStream->time_base);
+        pos = pkt->pos;
+        pkt->pos = -1;
 
-    if(argc < 3){  //argv[0], extra_audio  
-        av_log(NULL, AV_LOG_INFO ,"arguments must be more than 3");
-        return -1;
-    }
-    src = argv[1];
-    dst = argv[2];
-    // 2. 打开多媒体文件
-    ret = avformat_open_input(&pFmtCtx, src, NULL, NULL);
-    if (ret < 0 )
-    {
-        av_log(NULL, AV_LOG_ERROR,"%s\n" ,av_err2str(ret));
-        exit(-1);
+        stats->packets++;
+        stats->bytes += pkt->size;
+        if (hook && (ret = hook(opaque, pkt)) < 0) {
+            av_packet_unref(pkt);
+            break;
+        }
+        if (il) {
+            if ((ret = interleaver_write(il, pkt, pos)) < 0)
+                break;
+            continue;
+        }
+        // 交错写入会接管 pkt 的引用
+        if ((ret = av_interleaved_write_frame(oc, pkt)) < 0)
+            break;
     }
-    
-
+    av_packet_free(&pkt);
+    return ret == AVERROR_EOF ? 0 : ret;
+}
 
-    // 4. 打开目的文件的上下文avformat_free_context
-    avformat_alloc_output_context2(&oFmtCtx, NULL, NULL, dst);
-    if (!oFmtCtx)
-    {
-         av_log(oFmtCtx, AV_LOG_ERROR,"NO MEMORY!\n");
-        goto _ERROR;
-    }
-    
+/* keep the audio, video and subtitle streams of ic: create them in oc, stream_map[i] is -1 for the others */
+static int remux_map_streams(AVFormatContext *ic, AVFormatContext *oc, int **pstream_map)
+{
+    int *stream_map;
+    int i = 0;
+    int stream_idx = 0;
 
-    stream_map = av_calloc(pFmtCtx->nb_streams, sizeof(int));
+    stream_map = av_calloc(ic->nb_streams, sizeof(int));
     if (!stream_map)
-    {
-        av_log(oFmtCtx, AV_LOG_ERROR,"NO MEMORY!\n");
-        goto _ERROR;
+        return AVERROR(ENOMEM);
+    *pstream_map = stream_map;
 
-    }
-    
-    for(i=0; i < pFmtCtx->nb_streams; i++){
+    for(i=0; i < ic->nb_streams; i++){
         AVStream *outStream = NULL;
-        AVStream *inStream = pFmtCtx->streams[i];
+        AVStream *inStream = ic->streams[i];
         AVCodecParameters *inCodercPar = inStream->codecpar;
-        if (inCodercPar->codec_type != AVMEDIA_TYPE_AUDIO && 
+        if (inCodercPar->codec_type != AVMEDIA_TYPE_AUDIO &&
         inCodercPar->codec_type != AVMEDIA_TYPE_VIDEO  &&
         inCodercPar->codec_type != AVMEDIA_TYPE_SUBTITLE)
         {
@@ -79,22 +171,63 @@ int main(int argc, char* argv[]){
         stream_map[i] = stream_idx++;
          // 5. 为目的文件,创建一个新的流
 
-        outStream = avformat_new_stream(oFmtCtx, NULL);
+        outStream = avformat_new_stream(oc, NULL);
 
-        if (!outStream){
-             av_log(oFmtCtx, AV_LOG_ERROR,"NO MEMORY!\n");
-            goto _ERROR;
-        }
+        if (!outStream)
+            return AVERROR(ENOMEM);
         avcodec_parameters_copy(outStream->codecpar, inStream->codecpar);
         outStream->codecpar->codec_tag = 0;
     }
+    return 0;
+}
+
+/* remux src into dst, keeping its audio, video and subtitle streams */
+static int remux_file(const char *src, const char *dst, RemuxStats *stats)
+{
+    int *stream_map = NULL;
+    int nb_map = 0;
+    int ret = -1;
+
+    AVFormatContext *pFmtCtx = NULL;
+    AVFormatContext *oFmtCtx = NULL;
+    Interleaver *il = NULL;
+    InterleaverStats ist;
+
+    // 2. 打开多媒体文件 (本地文件走 mmap)
+    if (input_mmap)
+        ret = mmap_io_open_input(&pFmtCtx, src, NULL, NULL);
+    else
+        ret = avformat_open_input(&pFmtCtx, src, NULL, NULL);
+    if (ret < 0 )
+    {
+        av_log(NULL, AV_LOG_ERROR,"%s: %s\n", src, av_err2str(ret));
+        return ret;
+    }
+
+    // 4. 打开目的文件的上下文avformat_free_context
+    ret = avformat_alloc_output_context2(&oFmtCtx, NULL, NULL, dst);
+    if (!oFmtCtx)
+    {
+        av_log(NULL, AV_LOG_ERROR,"%s: %s\n", dst, av_err2str(ret));
+        goto _ERROR;
+    }
+    if (max_interleave_delta >= 0)
+        oFmtCtx->max_interleave_delta = max_interleave_delta;
+
+    nb_map = pFmtCtx->nb_streams;
+    ret = remux_map_streams(pFmtCtx, oFmtCtx, &stream_map);
+    if (ret < 0)
+    {
+        av_log(oFmtCtx, AV_LOG_ERROR,"NO MEMORY!\n");
+        goto _ERROR;
+    }
 
-    //  绑定
-    ret = avio_open2(&oFmtCtx->pb,dst,AVIO_FLAG_WRITE, NULL, NULL);
+    //  绑定 (写线程落盘, 读包写包的线程不等磁盘)
+    ret = async_writer_avio_open(&oFmtCtx->pb, dst, ASYNC_WRITER_PREALLOC);
     if (ret < 0 )
     {
-        av_log(oFmtCtx, AV_LOG_ERROR,"%s\n" ,av_err2str(ret));
-         goto _ERROR;
+        av_log(oFmtCtx, AV_LOG_ERROR,"%s: %s\n", dst, av_err2str(ret));
+        goto _ERROR;
     }
 
     // 7. 写多媒体文件头到目的文件
@@ -102,44 +235,50 @@ int main(int argc, char* argv[]){
     ret = avformat_write_header(oFmtCtx, NULL);
     if (ret < 0 )
     {
-        av_log(oFmtCtx, AV_LOG_ERROR,"%s\n" ,av_err2str(ret));
-         goto _ERROR;
+        av_log(oFmtCtx, AV_LOG_ERROR,"%s: %s\n", dst, av_err2str(ret));
+        goto _ERROR;
+    }
+    if (interleave_max_bytes > 0 || interleave_max_duration > 0) {
+        ret = interleaver_alloc(&il, oFmtCtx, pFmtCtx, interleave_max_bytes, interleave_max_duration);
+        if (ret < 0)
+            goto _ERROR;
     }
     // 8. 从源多媒体文件中读到数据到目的文件中
-    while (av_read_frame(pFmtCtx, &pkt) >= 0)
-    
-    {
-        AVStream *inStream,*outStream;
-        inStream = pFmtCtx->streams[pkt.stream_index];
-        if (stream_map[pkt.stream_index] < 0 ){
-            av_packet_unref(&pkt);
-            continue;
-        }
-        pkt.stream_index = stream_map[pkt.stream_index];
-
-        
-        outStream = pFmtCtx->streams[pkt.stream_index];
-        av_packet_rescale_ts(&pkt,inStream->time_base,outStream->time_base);   
-        pkt.pos = -1;
-        av_interleaved_write_frame(oFmtCtx, &pkt);
-        av_packet_unref(&pkt);
-
+    ret = remux_packets(pFmtCtx, oFmtCtx, stream_map, nb_map, stats, NULL, NULL, il);
+    if (ret < 0)
+        av_log(oFmtCtx, AV_LOG_ERROR,"%s: %s\n", dst, av_err2str(ret));
+    if (il) {
+        interleaver_get_stats(il, &ist);
+        av_log(NULL, AV_LOG_INFO, "interleave: peak %.1f MB / %d packets queued, %d rewinds, %"PRId64" packets re-read, %d early flushes, %"PRId64" past max_interleave_delta\n",
+               ist.peak_bytes / (1024.0 * 1024.0), ist.peak_packets, ist.rewinds,
+               ist.reread_packets, ist.flushes, ist.delta_writes);
     }
-    
+
     // 9. 写多媒体文件尾到文件中
-    av_write_trailer(oFmtCtx);
+    if (ret >= 0)
+        ret = av_write_trailer(oFmtCtx);
     // 10. 将申请的资源释放掉
 _ERROR:
+    interleaver_free(&il);
     if (pFmtCtx)
     {
-        avformat_close_input(&pFmtCtx);
+        if (input_mmap)
+            mmap_io_close_input(&pFmtCtx);
+        else
+            avformat_close_input(&pFmtCtx);
         pFmtCtx = NULL;
     }
-    if (oFmtCtx->pb)
+    if (oFmtCtx && oFmtCtx->pb)
     {
-        avio_close(oFmtCtx->pb);
+        // 写线程上积压的块到这里才全部落盘, 写失败也在这里报出来
+        int err = async_writer_avio_close(&oFmtCtx->pb);
+        if (err < 0 && ret >= 0)
+        {
+            av_log(NULL, AV_LOG_ERROR,"%s: %s\n", dst, av_err2str(err));
+            ret = err;
+        }
     }
-    
+
     if (oFmtCtx)
     {
         avformat_free_context(oFmtCtx);
@@ -149,6 +288,647 @@ _ERROR:
     {
        av_free(stream_map);
     }
+    return ret;
+}
+
+/*
+ * 切片模式: 一个 mpegts / 分片 mp4 muxer 写进内存, 到了时长后在下一个视频关键帧切开,
+ * 切下来的一段交给写线程池去写文件 (write + fsync + rename), 解复用不会被某一段的 fsync 卡住.
+ * 最后写 m3u8 播放列表; fmp4 的初始化段 (ftyp + moov) 单独一个文件.
+ */
+
+#define SEG_QUEUE_SIZE 8 ///< finished segments waiting for a writer, at most
+
+typedef struct SegmentJob {
+    char *filename;
+    uint8_t *data;
+    int size;
+} SegmentJob;
+
+typedef struct Segmenter {
+    AVFormatContext *oc;
+    int fmp4;
+    const char *prefix;
+    int video_index;        ///< output stream segments are cut on, -1 to cut on any packet
+    int64_t seg_time;       ///< AV_TIME_BASE
+    int64_t seg_start;      ///< AV_TIME_BASE, AV_NOPTS_VALUE before the first packet
+    int64_t last_end;
+
+    uint8_t *buf;           ///< current segment, filled by the muxer
+    int buf_size;
+    unsigned buf_alloc;
+
+    double *durations;
+    int nb_segments;
+
+    AVFifo *queue;          ///< SegmentJob, a NULL filename stops a writer
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    pthread_t *writers;
+    int nb_writers;
+    int error;
+    int64_t bytes_written;
+    int64_t queue_waits;    ///< times the demuxer waited for a writer
+    int64_t sync_time;      ///< us spent in fsync, all writers
+} Segmenter;
+
+static int seg_write(void *opaque,
+#if LIBAVFORMAT_VERSION_MAJOR < 61
+                     uint8_t *buf,
+#else
+                     const uint8_t *buf,
+#endif
+                     int buf_size)
+{
+    Segmenter *seg = opaque;
+    uint8_t *p;
+
+    if (seg->buf_size + buf_size > seg->buf_alloc) {
+        p = av_fast_realloc(seg->buf, &seg->buf_alloc, seg->buf_size + buf_size);
+        if (!p)
+            return AVERROR(ENOMEM);
+        seg->buf = p;
+    }
+    memcpy(seg->buf + seg->buf_size, buf, buf_size);
+    seg->buf_size += buf_size;
+    return buf_size;
+}
+
+static int write_segment_file(Segmenter *seg, const SegmentJob *job)
+{
+    char tmp[4096];
+    int64_t start;
+    FILE *f;
+    int ret = 0;
+
+    // 先写临时文件, fsync 完再改名, 播放器看不到写了一半的段
+    snprintf(tmp, sizeof(tmp), "%s.tmp", job->filename);
+    f = fopen(tmp, "wb");
+    if (!f)
+        return AVERROR(errno);
+    if (fwrite(job->data, 1, job->size, f) != job->size || fflush(f))
+        ret = AVERROR(errno);
+    start = av_gettime_relative();
+    if (!ret && fsync(fileno(f)))
+        ret = AVERROR(errno);
+    pthread_mutex_lock(&seg->mutex);
+    seg->sync_time += av_gettime_relative() - start;
+    pthread_mutex_unlock(&seg->mutex);
+    if (fclose(f) && !ret)
+        ret = AVERROR(errno);
+    if (!ret && rename(tmp, job->filename))
+        ret = AVERROR(errno);
+    if (ret < 0)
+        unlink(tmp);
+    return ret;
+}
+
+static void *segment_writer(void *arg)
+{
+    Segmenter *seg = arg;
+    SegmentJob job;
+    int ret;
+
+    for (;;) {
+        pthread_mutex_lock(&seg->mutex);
+        while (!av_fifo_can_read(seg->queue))
+            pthread_cond_wait(&seg->cond, &seg->mutex);
+        av_fifo_read(seg->queue, &job, 1);
+        pthread_cond_broadcast(&seg->cond);
+        pthread_mutex_unlock(&seg->mutex);
+        if (!job.filename)
+            break;
+
+        ret = write_segment_file(seg, &job);
+        pthread_mutex_lock(&seg->mutex);
+        if (ret < 0) {
+            av_log(NULL, AV_LOG_ERROR, "%s: %s\n", job.filename, av_err2str(ret));
+            seg->error = ret;
+        } else {
+            seg->bytes_written += job.size;
+        }
+        pthread_mutex_unlock(&seg->mutex);
+        av_free(job.filename);
+        av_free(job.data);
+    }
+    return NULL;
+}
+
+/* hand filename and the buffered bytes to the writers, blocks while they are all busy */
+static int segment_submit(Segmenter *seg, char *filename)
+{
+    SegmentJob job = { filename, seg->buf, seg->buf_size };
+    int ret;
+
+    seg->buf = NULL;
+    seg->buf_size = seg->buf_alloc = 0;
+    if (!filename) {
+        av_free(job.data);
+        return AVERROR(ENOMEM);
+    }
+
+    pthread_mutex_lock(&seg->mutex);
+    if (!av_fifo_can_write(seg->queue))
+        seg->queue_waits++;
+    while (!av_fifo_can_write(seg->queue))
+        pthread_cond_wait(&seg->cond, &seg->mutex);
+    av_fifo_write(seg->queue, &job, 1);
+    pthread_cond_broadcast(&seg->cond);
+    ret = seg->error;
+    pthread_mutex_unlock(&seg->mutex);
+    return ret;
+}
+
+/* flush everything muxed so far into the current segment and submit it */
+static int segment_close(Segmenter *seg, int64_t end)
+{
+    double *durations;
+    char *filename;
+
+    if (!seg->buf_size)
+        return 0;
+    durations = av_realloc_array(seg->durations, seg->nb_segments + 1, sizeof(*durations));
+    if (!durations)
+        return AVERROR(ENOMEM);
+    seg->durations = durations;
+    seg->durations[seg->nb_segments] = (end - seg->seg_start) / (double)AV_TIME_BASE;
+
+    filename = av_asprintf("%s_%05d.%s", seg->prefix, seg->nb_segments, seg->fmp4 ? "m4s" : "ts");
+    seg->nb_segments++;
+    return segment_submit(seg, filename);
+}
+
+/* remux_packets() hook: cut before a keyframe once the segment is long enough */
+static int segment_packet(void *opaque, AVPacket *pkt)
+{
+    Segmenter *seg = opaque;
+    AVStream *st = seg->oc->streams[pkt->stream_index];
+    int64_t ts = pkt->pts != AV_NOPTS_VALUE ? pkt->pts : pkt->dts;
+    int ret;
+
+    if (ts == AV_NOPTS_VALUE)
+        return 0;
+    ts = av_rescale_q(ts, st->time_base, AV_TIME_BASE_Q);
+    if (seg->seg_start == AV_NOPTS_VALUE)
+        seg->seg_start = ts;
+    seg->last_end = FFMAX(seg->last_end, ts + av_rescale_q(pkt->duration, st->time_base, AV_TIME_BASE_Q));
+
+    if ((seg->video_index < 0 || (pkt->stream_index == seg->video_index && (pkt->flags & AV_PKT_FLAG_KEY))) &&
+        ts - seg->seg_start >= seg->seg_time) {
+        // 交错队列里的包都写进当前段, 再让封装器冲出缓存的内容:
+        // fmp4 是当前分片, ts 是每条流还没写完的 PES (音频会攒好几帧), 不冲就落到下一段
+        if ((ret = av_interleaved_write_frame(seg->oc, NULL)) < 0)
+            return ret;
+        if ((ret = av_write_frame(seg->oc, NULL)) < 0)
+            return ret;
+        avio_flush(seg->oc->pb);
+        if ((ret = segment_close(seg, ts)) < 0)
+            return ret;
+        seg->seg_start = ts;
+        // ts 每段开头重发 PAT/PMT, 每段都能单独解
+        if (!seg->fmp4)
+            av_opt_set(seg->oc->priv_data, "mpegts_flags", "+resend_headers", 0);
+    }
+    return 0;
+}
+
+static int write_playlist(Segmenter *seg)
+{
+    char *filename;
+    double target = 0;
+    FILE *f;
+    int i;
+
+    filename = av_asprintf("%s.m3u8", seg->prefix);
+    if (!filename)
+        return AVERROR(ENOMEM);
+    f = fopen(filename, "w");
+    if (!f) {
+        av_log(NULL, AV_LOG_ERROR, "Could not open %s\n", filename);
+        av_free(filename);
+        return AVERROR(errno);
+    }
+    for (i = 0; i < seg->nb_segments; i++)
+        target = FFMAX(target, seg->durations[i]);
+
+    fprintf(f, "#EXTM3U\n#EXT-X-VERSION:%d\n", seg->fmp4 ? 7 : 3);
+    fprintf(f, "#EXT-X-TARGETDURATION:%d\n", (int)ceil(target));
+    fprintf(f, "#EXT-X-MEDIA-SEQUENCE:0\n#EXT-X-PLAYLIST-TYPE:VOD\n");
+    if (seg->fmp4)
+        fprintf(f, "#EXT-X-MAP:URI=\"%s_init.mp4\"\n", av_basename(seg->prefix));
+    for (i = 0; i < seg->nb_segments; i++)
+        fprintf(f, "#EXTINF:%.3f,\n%s_%05d.%s\n", seg->durations[i],
+                av_basename(seg->prefix), i, seg->fmp4 ? "m4s" : "ts");
+    fprintf(f, "#EXT-X-ENDLIST\n");
+    fclose(f);
+    av_free(filename);
+    return 0;
+}
+
+/* split src into seg_time second segments named prefix_NNNNN.ts/.m4s, plus prefix.m3u8 */
+static int remux_segment(const char *src, const char *prefix, int fmp4,
+                         double seg_time, int nb_writers)
+{
+    Segmenter seg = { 0 };
+    RemuxStats stats = { 0 };
+    AVFormatContext *ic = NULL;
+    AVDictionary *opts = NULL;
+    AVIOContext *pb = NULL;
+    uint8_t *iobuf = NULL;
+    int *stream_map = NULL;
+    int64_t start;
+    double sec;
+    int i, ret;
+
+    seg.fmp4 = fmp4;
+    seg.prefix = prefix;
+    seg.seg_time = seg_time * AV_TIME_BASE;
+    seg.seg_start = AV_NOPTS_VALUE;
+    pthread_mutex_init(&seg.mutex, NULL);
+    pthread_cond_init(&seg.cond, NULL);
+
+    start = av_gettime_relative();
+    if ((ret = mmap_io_open_input(&ic, src, NULL, NULL)) < 0) {
+        av_log(NULL, AV_LOG_ERROR, "%s: %s\n", src, av_err2str(ret));
+        goto end;
+    }
+    if ((ret = avformat_alloc_output_context2(&seg.oc, NULL, fmp4 ? "mp4" : "mpegts", NULL)) < 0)
+        goto end;
+    if ((ret = remux_map_streams(ic, seg.oc, &stream_map)) < 0)
+        goto end;
+    seg.video_index = -1;
+    for (i = 0; i < seg.oc->nb_streams; i++) {
+        if (seg.oc->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO) {
+            seg.video_index = i;
+            break;
+        }
+    }
+
+    // muxer 写进内存, 不落盘
+    iobuf = av_malloc(REMUX_SEG_IO_SIZE);
+    pb = iobuf ? avio_alloc_context(iobuf, REMUX_SEG_IO_SIZE, 1, &seg, NULL, seg_write, NULL) : NULL;
+    if (!pb) {
+        av_free(iobuf);
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    seg.oc->pb = pb;
+
+    seg.queue = av_fifo_alloc2(SEG_QUEUE_SIZE, sizeof(SegmentJob), 0);
+    seg.writers = av_calloc(nb_writers, sizeof(*seg.writers));
+    if (!seg.queue || !seg.writers) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    for (i = 0; i < nb_writers; i++) {
+        if (pthread_create(&seg.writers[i], NULL, segment_writer, &seg))
+            break;
+        seg.nb_writers++;
+    }
+    if (!seg.nb_writers) {
+        ret = AVERROR(EAGAIN);
+        goto end;
+    }
+
+    // 分片 mp4: 只写空 moov, 分片由我们在段边界手动冲, 结尾不要 mfra
+    if (fmp4)
+        av_dict_set(&opts, "movflags", "frag_custom+empty_moov+default_base_moof+skip_trailer", 0);
+    ret = avformat_write_header(seg.oc, &opts);
+    av_dict_free(&opts);
+    if (ret < 0) {
+        av_log(NULL, AV_LOG_ERROR, "%s: %s\n", prefix, av_err2str(ret));
+        goto end;
+    }
+    if (fmp4) {
+        avio_flush(pb);
+        if ((ret = segment_submit(&seg, av_asprintf("%s_init.mp4", prefix))) < 0)
+            goto end;
+    }
+
+    ret = remux_packets(ic, seg.oc, stream_map, ic->nb_streams, &stats, segment_packet, &seg, NULL);
+    if (ret >= 0)
+        ret = av_write_trailer(seg.oc);
+    if (ret >= 0) {
+        avio_flush(pb);
+        ret = segment_close(&seg, seg.last_end);
+    }
+
+end:
+    // 停掉写线程: 每个线程一个空任务
+    for (i = 0; i < seg.nb_writers; i++) {
+        SegmentJob stop = { 0 };
+        pthread_mutex_lock(&seg.mutex);
+        while (!av_fifo_can_write(seg.queue))
+            pthread_cond_wait(&seg.cond, &seg.mutex);
+        av_fifo_write(seg.queue, &stop, 1);
+        pthread_cond_broadcast(&seg.cond);
+        pthread_mutex_unlock(&seg.mutex);
+    }
+    for (i = 0; i < seg.nb_writers; i++)
+        pthread_join(seg.writers[i], NULL);
+    if (ret >= 0 && seg.error < 0)
+        ret = seg.error;
+    if (ret >= 0)
+        ret = write_playlist(&seg);
+
+    sec = FFMAX(av_gettime_relative() - start, 1) / 1000000.0;
+    if (ret >= 0)
+        av_log(NULL, AV_LOG_INFO,
+               "segment: %.1f MB in %.3f s (%.1f MB/s), %d segments, %d writers, "
+               "waited on writers %"PRId64" times, %.1f ms in fsync\n",
+               stats.bytes / (1024.0 * 1024.0), sec, stats.bytes / (1024.0 * 1024.0) / sec,
+               seg.nb_segments, seg.nb_writers, seg.queue_waits, seg.sync_time / 1000.0);
+
+    if (seg.queue) {
+        SegmentJob job;
+        while (av_fifo_read(seg.queue, &job, 1) >= 0) {
+            av_free(job.filename);
+            av_free(job.data);
+        }
+        av_fifo_freep2(&seg.queue);
+    }
+    if (pb) {
+        av_freep(&pb->buffer);
+        avio_context_free(&pb);
+    }
+    if (seg.oc)
+        seg.oc->pb = NULL;
+    avformat_free_context(seg.oc);
+    mmap_io_close_input(&ic);
+    av_free(stream_map);
+    av_free(seg.buf);
+    av_free(seg.durations);
+    av_free(seg.writers);
+    pthread_cond_destroy(&seg.cond);
+    pthread_mutex_destroy(&seg.mutex);
+    return ret;
+}
+
+static void json_string(FILE *f, const char *s)
+{
+    fputc('"', f);
+    for (; *s; s++) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\')
+            fprintf(f, "\\%c", c);
+        else if (c < 0x20)
+            fprintf(f, "\\u%04x", c);
+        else
+            fputc(c, f);
+    }
+    fputc('"', f);
+}
+
+/* one JSON line per finished job on stdout, the logs stay on stderr */
+static void report_job(int id, int worker, const RemuxJob *job, int ret,
+                       const RemuxStats *stats, int64_t usec)
+{
+    double sec = FFMAX(usec, 1) / 1000000.0;
+
+    flockfile(stdout);
+    printf("{\"job\":%d,\"worker\":%d,\"input\":", id, worker);
+    json_string(stdout, job->src);
+    printf(",\"output\":");
+    json_string(stdout, job->dst);
+    printf(",\"status\":\"%s\"", ret < 0 ? "error" : "ok");
+    if (ret < 0) {
+        printf(",\"error\":");
+        json_string(stdout, av_err2str(ret));
+    }
+    printf(",\"packets\":%"PRId64",\"bytes\":%"PRId64",\"seconds\":%.3f,\"mb_per_s\":%.1f,\"packets_per_s\":%.0f}\n",
+           stats->packets, stats->bytes, sec, stats->bytes / (1024.0 * 1024.0) / sec, stats->packets / sec);
+    fflush(stdout);
+    funlockfile(stdout);
+}
+
+static void *remux_worker(void *arg)
+{
+    RemuxWorker *w = arg;
+    RemuxBatch *b = w->batch;
+    RemuxStats stats;
+    int64_t start;
+    int id, ret;
+
+    for (;;) {
+        pthread_mutex_lock(&b->mutex);
+        id = b->next_job < b->nb_jobs ? b->next_job++ : -1;
+        pthread_mutex_unlock(&b->mutex);
+        if (id < 0)
+            break;
+
+        memset(&stats, 0, sizeof(stats));
+        start = av_gettime_relative();
+        ret = remux_file(b->jobs[id].src, b->jobs[id].dst, &stats);
+        report_job(id, w->id, &b->jobs[id], ret, &stats, av_gettime_relative() - start);
+        if (ret < 0) {
+            pthread_mutex_lock(&b->mutex);
+            b->failed++;
+            pthread_mutex_unlock(&b->mutex);
+        }
+    }
+    return NULL;
+}
+
+/* input/output pairs, one per line */
+static int load_manifest(const char *filename, RemuxBatch *b)
+{
+    char line[4096];
+    char *src, *dst, *end;
+    RemuxJob *jobs;
+    int nb_alloc = 0;
+    FILE *f;
+
+    f = fopen(filename, "r");
+    if (!f) {
+        av_log(NULL, AV_LOG_ERROR, "Could not open manifest %s\n", filename);
+        return AVERROR(errno);
+    }
+    while (fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\r\n")] = 0;
+        src = line + strspn(line, " \t");
+        if (!*src || *src == '#')
+            continue;
+        end = strchr(src, '\t');
+        if (!end)
+            end = src + strcspn(src, " ");
+        if (!*end) {
+            av_log(NULL, AV_LOG_WARNING, "No output for %s, skipped\n", src);
+            continue;
+        }
+        *end = 0;
+        dst = end + 1 + strspn(end + 1, " \t");
+
+        if (b->nb_jobs == nb_alloc) {
+            nb_alloc = nb_alloc ? nb_alloc * 2 : 64;
+            jobs = av_realloc_array(b->jobs, nb_alloc, sizeof(*jobs));
+            if (!jobs)
+                goto fail;
+            b->jobs = jobs;
+        }
+        b->jobs[b->nb_jobs].src = av_strdup(src);
+        b->jobs[b->nb_jobs].dst = av_strdup(dst);
+        if (!b->jobs[b->nb_jobs].src || !b->jobs[b->nb_jobs].dst) {
+            b->nb_jobs++;
+            goto fail;
+        }
+        b->nb_jobs++;
+    }
+    fclose(f);
+    return 0;
+fail:
+    fclose(f);
+    return AVERROR(ENOMEM);
+}
+
+static int remux_batch(int argc, char *argv[])
+{
+    RemuxBatch batch = { 0 };
+    RemuxWorker *workers = NULL;
+    const char *manifest = NULL;
+    int nb_workers = av_cpu_count();
+    int64_t max_mem = 1024;        // MB
+    int max_fds = 0;
+    int nb_started = 0;
+    int64_t start;
+    struct rlimit rl;
+    int64_t peak_rss;
+    int i, limit, ret;
+
+    for (i = 1; i + 1 < argc; i += 2) {
+        if (!strcmp(argv[i], "-batch"))
+            manifest = argv[i + 1];
+        else if (!strcmp(argv[i], "-jobs"))
+            nb_workers = atoi(argv[i + 1]);
+        else if (!strcmp(argv[i], "-max_mem"))
+            max_mem = atoll(argv[i + 1]);
+        else if (!strcmp(argv[i], "-max_fds"))
+            max_fds = atoi(argv[i + 1]);
+        else
+            break;
+    }
+    if (!manifest || i < argc || nb_workers <= 0 || max_mem <= 0) {
+        av_log(NULL, AV_LOG_ERROR, "Usage: %s -batch <manifest> [-jobs n] [-max_mem MB] [-max_fds n]\n", argv[0]);
+        return AVERROR(EINVAL);
+    }
+    if (!max_fds && !getrlimit(RLIMIT_NOFILE, &rl))
+        max_fds = rl.rlim_cur == RLIM_INFINITY ? INT_MAX : FFMIN(rl.rlim_cur, INT_MAX);
+
+    // 并发数受内存预算和文件描述符约束
+    limit = FFMAX(FFMIN(max_mem * 1024 * 1024 / REMUX_JOB_MEM, INT_MAX), 1);
+    if (max_fds > 0)
+        limit = FFMIN(limit, FFMAX((max_fds - REMUX_RESERVED_FDS) / REMUX_JOB_FDS, 1));
+    if (nb_workers > limit) {
+        av_log(NULL, AV_LOG_INFO, "%d jobs requested, running %d within %"PRId64" MB and %d fds\n",
+               nb_workers, limit, max_mem, max_fds);
+        nb_workers = limit;
+    }
+    max_interleave_delta = REMUX_BATCH_DELTA;
+    /*
+     * Regular reads: every mapped page a job touches would stay in RSS, past
+     * REMUX_JOB_MEM, and an input truncated while mapped raises SIGBUS, which
+     * takes down every other job with it.
+     */
+    input_mmap = 0;
+
+    if ((ret = load_manifest(manifest, &batch)) < 0)
+        goto end;
+    nb_workers = FFMIN(nb_workers, FFMAX(batch.nb_jobs, 1));
+
+    workers = av_calloc(nb_workers, sizeof(*workers));
+    if (!workers) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    pthread_mutex_init(&batch.mutex, NULL);
+    start = av_gettime_relative();
+    for (i = 0; i < nb_workers; i++) {
+        workers[i].batch = &batch;
+        workers[i].id = i;
+        if (pthread_create(&workers[i].thread, NULL, remux_worker, &workers[i]))
+            break;
+        nb_started++;
+    }
+    if (!nb_started) {
+        // 一个线程都起不来就在当前线程跑
+        workers[0].batch = &batch;
+        remux_worker(&workers[0]);
+    }
+    for (i = 0; i < nb_started; i++)
+        pthread_join(workers[i].thread, NULL);
+    pthread_mutex_destroy(&batch.mutex);
+
+    peak_rss = peak_rss_kb();
+    printf("{\"summary\":true,\"jobs\":%d,\"failed\":%d,\"workers\":%d,\"seconds\":%.3f,\"peak_rss_kb\":%"PRId64"}\n",
+           batch.nb_jobs, batch.failed, FFMAX(nb_started, 1),
+           (av_gettime_relative() - start) / 1000000.0, peak_rss);
+    ret = batch.failed ? AVERROR_EXTERNAL : 0;
+
+end:
+    for (i = 0; i < batch.nb_jobs; i++) {
+        av_free(batch.jobs[i].src);
+        av_free(batch.jobs[i].dst);
+    }
+    av_free(batch.jobs);
+    av_free(workers);
+    return ret;
+}
+
+int main(int argc, char* argv[]){
+
+    // 1. 处理一些参数,
+    RemuxStats stats = { 0 };
+    int64_t start;
+    double sec;
+    int ret, i;
+
+    if (argc > 2 && !strcmp(argv[1], "-batch"))
+        return remux_batch(argc, argv) < 0 ? -1 : 0;
+
+    if (argc > 1 && !strcmp(argv[1], "-segment")) {
+        double seg_time = 6;
+        int fmp4 = 0, nb_writers = 4;
+
+        for (i = 2; i + 2 < argc && argv[i][0] == '-'; i += 2) {
+            if (!strcmp(argv[i], "-seg_time"))
+                seg_time = atof(argv[i + 1]);
+            else if (!strcmp(argv[i], "-seg_format"))
+                fmp4 = !strcmp(argv[i + 1], "fmp4");
+            else if (!strcmp(argv[i], "-seg_writers"))
+                nb_writers = atoi(argv[i + 1]);
+            else
+                break;
+        }
+        if (i + 2 != argc || seg_time <= 0 || nb_writers <= 0) {
+            av_log(NULL, AV_LOG_ERROR, "Usage: %s -segment [-seg_time s] [-seg_format ts|fmp4] [-seg_writers n] <input> <prefix>\n", argv[0]);
+            return -1;
+        }
+        return remux_segment(argv[i], argv[i + 1], fmp4, seg_time, nb_writers) < 0 ? -1 : 0;
+    }
+
+    for (i = 1; i + 2 < argc && argv[i][0] == '-'; i += 2) {
+        if (!strcmp(argv[i], "-io") && (!strcmp(argv[i + 1], "file") || !strcmp(argv[i + 1], "mmap")))
+            input_mmap = !strcmp(argv[i + 1], "mmap");
+        else if (!strcmp(argv[i], "-max_interleave"))
+            interleave_max_bytes = (int64_t)(atof(argv[i + 1]) * 1024 * 1024);
+        else if (!strcmp(argv[i], "-max_interleave_sec"))
+            interleave_max_duration = (int64_t)(atof(argv[i + 1]) * AV_TIME_BASE);
+        else
+            break;
+    }
+    if(argc - i < 2){  //argv[0], extra_audio
+        av_log(NULL, AV_LOG_INFO ,"arguments must be more than 3");
+        return -1;
+    }
+    start = av_gettime_relative();
+    ret = remux_file(argv[i], argv[i + 1], &stats);
+    if (ret < 0)
+        return -1;
+    // 和 -segment 同样格式的吞吐, 方便对比; 峰值 RSS 只在输入不是 mmap 时才反映交错的内存
+    sec = FFMAX(av_gettime_relative() - start, 1) / 1000000.0;
+    av_log(NULL, AV_LOG_INFO, "remux: %.1f MB in %.3f s (%.1f MB/s)\n",
+           stats.bytes / (1024.0 * 1024.0), sec, stats.bytes / (1024.0 * 1024.0) / sec);
+    if (!input_mmap)
+        av_log(NULL, AV_LOG_INFO, "remux: peak RSS %"PRId64" KB\n", peak_rss_kb());
 
     printf("hello world!\n");
     return 0;
@@ -0,0 +1,3 @@
+#!/bin/bash
+
+clang -g -o cut cut.c ../common/async_writer.c ../common/interleaver.c ../common/keyframe_index.c `pkg-config --libs --cflags libavutil libavformat libavcodec` -lpthread
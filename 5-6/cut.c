@@ -1,229 +1,1147 @@
+#include <errno.h>
 #include <stdio.h>
 
 #include <stdlib.h>
+#include <string.h>
 #include <libavutil/log.h>
 #include <libavutil/avutil.h>
+#include <libavutil/avstring.h>
+#include <libavutil/intreadwrite.h>
+#include <libavutil/opt.h>
+#include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
 
+#include "../common/async_writer.h"
+#include "../common/interleaver.h"
+#include "../common/keyframe_index.h"
+
 //  截取 视频  2 秒到五秒
 //  ./cut /Users/mesay/Downloads/kyrie_Irving.mp4 2.mp4 2 5
-int main(int argc, char* argv[]){
+//
+//  -smart: 帧精确的剪切. 只有首尾两个不完整的 GOP 解码重编码, 中间完整的 GOP 直接拷贝
+//  (开头的 GOP 连同下一个 GOP 的 open GOP 前导帧一起重编码)
+//  重编码的 GOP 带着编码器自己的 SPS/PPS, 编码器按源的 profile/level 配, mp4/mov 输出写成 avc3/hev1
+//  (参数集可以在码流里); 其它容器要求解码器认带内参数集, 只看 extradata 的硬件解码器会花屏
+//  ./cut -smart /Users/mesay/Downloads/kyrie_Irving.mp4 2.mp4 2 5
+//
+//  -build_index: 先建(或补全)关键帧索引 src.kfidx 再剪, 以后的剪切直接用. 不加只用已经有的索引
+//
+//  -max_interleave MB / -max_interleave_sec s: 交错队列限内存. 输入被各段共用, 超限时提前写出领先的流
 
-    // 1. 处理一些参数, 
-    char* src;
-    char* dst;
+#define SMART_CUT_CRF "18" ///< quality of the re-encoded boundary GOPs, for encoders with a crf option
+#define CUT_SEEK_GAP  10.0 ///< seconds; with no range open, seek instead of reading up to the next one
 
-    int *stream_map = NULL; 
+static int64_t interleave_max_bytes;     ///< caps of each range's interleaving queue, both 0: libavformat's
+static int64_t interleave_max_duration;
 
-    int64_t *dts_start_time = NULL;
-    int64_t *pts_start_time = NULL;
+typedef struct CutGop {
+    AVPacket **pkts;
+    int nb_pkts;
+    int nb_alloc;
+    int held;            ///< leading packets of a head GOP waiting to be re-encoded with this GOP's leading pictures
+    int64_t kf_pts;      ///< pts of the opening keyframe, AV_NOPTS_VALUE before the first one
+    int64_t max_pts;
+} CutGop;
 
-    int i = 0;
-    int ret = -1;
-    int idx = -1;
-    int stream_idx = 0;
+typedef struct SmartCut {
+    AVFormatContext *ic;
+    AVFormatContext *oc;
+    Interleaver *il;     ///< NULL: av_interleaved_write_frame()
+    const int *stream_map;
+    int video_index;
+    int64_t start_us;    ///< cut range, AV_TIME_BASE; the output starts at 0
+    int64_t end_us;
+    int64_t start_pts;   ///< cut range in the video time base
+    int64_t end_pts;
+    int64_t dts_delay;   ///< pts - dts of the source keyframes, kept by the re-encoded frames
 
-    double starttime;
-    double endtime;
+    AVCodecContext *dec;
+    const AVCodec *enc_codec;
+    int nal_length_size; ///< the source is length-prefixed H.264/HEVC, 0 otherwise
+    uint8_t *param_sets; ///< the source's SPS/PPS (and VPS) from extradata, in the packets' format
+    int param_sets_size;
+    AVFrame *frame;
+    AVPacket *enc_pkt;
 
+    CutGop gop;
+    int prev_reencoded;
+    int gops_copied;
+    int gops_reencoded;
+    int frames_reencoded;
+} SmartCut;
 
+/* shift to the cut start, map and rescale to the output stream, write */
+static int cut_write(SmartCut *sc, AVPacket *pkt, int in_index)
+{
+    AVStream *inStream = sc->ic->streams[in_index];
+    AVStream *outStream = sc->oc->streams[sc->stream_map[in_index]];
+    int64_t offset = av_rescale_q(sc->start_us, AV_TIME_BASE_Q, inStream->time_base);
 
-    AVFormatContext *pFmtCtx = NULL;
-    AVFormatContext *oFmtCtx = NULL;
+    if (pkt->pts != AV_NOPTS_VALUE)
+        pkt->pts -= offset;
+    if (pkt->dts != AV_NOPTS_VALUE)
+        pkt->dts -= offset;
+    pkt->stream_index = sc->stream_map[in_index];
+    av_packet_rescale_ts(pkt, inStream->time_base, outStream->time_base);
+    pkt->pos = -1;
+    if (sc->il)
+        return interleaver_write(sc->il, pkt, -1);
+    return av_interleaved_write_frame(sc->oc, pkt);
+}
 
-    const AVOutputFormat *outFmt = NULL;
+static void gop_clear(CutGop *g)
+{
+    int i;
 
+    for (i = 0; i < g->nb_pkts; i++)
+        av_packet_free(&g->pkts[i]);
+    g->nb_pkts = 0;
+    g->held = 0;
+}
 
-    AVPacket pkt;
+static int gop_add(CutGop *g, AVPacket *pkt)
+{
+    AVPacket **pkts;
 
+    if (g->nb_pkts == g->nb_alloc) {
+        pkts = av_realloc_array(g->pkts, FFMAX(2 * g->nb_alloc, 64), sizeof(*pkts));
+        if (!pkts)
+            return AVERROR(ENOMEM);
+        g->pkts = pkts;
+        g->nb_alloc = FFMAX(2 * g->nb_alloc, 64);
+    }
+    if (!(g->pkts[g->nb_pkts] = av_packet_alloc()))
+        return AVERROR(ENOMEM);
+    av_packet_move_ref(g->pkts[g->nb_pkts++], pkt);
+    if (g->pkts[g->nb_pkts - 1]->pts != AV_NOPTS_VALUE)
+        g->max_pts = FFMAX(g->max_pts, g->pkts[g->nb_pkts - 1]->pts);
+    return 0;
+}
 
+static const uint8_t *find_start_code(const uint8_t *p, const uint8_t *end)
+{
+    for (; p + 3 <= end; p++) {
+        if (!p[0] && !p[1] && p[2] == 1)
+            return p;
+    }
+    return end;
+}
 
-    // cut src  dst  start  end 
+/*
+ * The encoders emit Annex B; mp4/mov tracks copied from an avcC/hvcC source
+ * carry length-prefixed NAL units, so the re-encoded packets must match.
+ */
+static int annexb_to_length_prefixed(AVPacket *pkt, int nal_length_size)
+{
+    const uint8_t *end = pkt->data + pkt->size;
+    const uint8_t *nal, *next, *nal_end;
+    AVPacket *out;
+    uint8_t *dst;
+    int size = 0, i, ret;
 
-    if(argc < 5){  //argv[0], extra_audio  
-        av_log(NULL, AV_LOG_INFO ,"arguments must be more than 3");
-        return -1;
+    for (nal = find_start_code(pkt->data, end); nal < end; nal = next) {
+        nal += 3;
+        next = find_start_code(nal, end);
+        for (nal_end = next; nal_end > nal && !nal_end[-1]; nal_end--);
+        size += nal_length_size + (nal_end - nal);
     }
-    src = argv[1];
-    dst = argv[2];
-    starttime = atof(argv[3]);
-    endtime = atof(argv[4]);
+    if (!size)
+        return 0;
 
-    // 2. 打开多媒体文件
-    ret = avformat_open_input(&pFmtCtx, src, NULL, NULL);
-    if (ret < 0 )
-    {
-        av_log(NULL, AV_LOG_ERROR,"%s\n" ,av_err2str(ret));
-        exit(-1);
+    out = av_packet_alloc();
+    if (!out)
+        return AVERROR(ENOMEM);
+    if ((ret = av_new_packet(out, size)) < 0 ||
+        (ret = av_packet_copy_props(out, pkt)) < 0) {
+        av_packet_free(&out);
+        return ret;
+    }
+    dst = out->data;
+    for (nal = find_start_code(pkt->data, end); nal < end; nal = next) {
+        nal += 3;
+        next = find_start_code(nal, end);
+        for (nal_end = next; nal_end > nal && !nal_end[-1]; nal_end--);
+        for (i = nal_length_size - 1; i >= 0; i--)
+            *dst++ = (nal_end - nal) >> (8 * i);
+        memcpy(dst, nal, nal_end - nal);
+        dst += nal_end - nal;
+    }
+    av_packet_unref(pkt);
+    av_packet_move_ref(pkt, out);
+    av_packet_free(&out);
+    return 0;
+}
+
+static int put_param_set(SmartCut *sc, uint8_t **dst, const uint8_t **p, const uint8_t *end)
+{
+    int len, i;
+
+    if (end - *p < 2 || end - *p - 2 < (len = AV_RB16(*p)))
+        return AVERROR_INVALIDDATA;
+    for (i = sc->nal_length_size - 1; i >= 0; i--)
+        *(*dst)++ = len >> (8 * i);
+    memcpy(*dst, *p + 2, len);
+    *dst += len;
+    *p += 2 + len;
+    return 0;
+}
+
+/*
+ * The encoder puts its own SPS/PPS in-band, under the same ids as the
+ * source's, so they stay in force past a re-encoded GOP. The first keyframe
+ * copied after one gets the source's back from extradata: avcC/hvcC arrays
+ * turned into length-prefixed NAL units, Annex B extradata as it is.
+ */
+static int extract_param_sets(SmartCut *sc, const AVCodecParameters *par)
+{
+    const uint8_t *p = par->extradata, *end = p + par->extradata_size;
+    uint8_t *dst;
+    int nb_arrays, nb_nals, i, j, ret = 0;
+
+    if (!p || par->extradata_size < 4)
+        return 0;
+    // 2 字节的长度换成最多 4 字节, 最多大一倍
+    sc->param_sets = av_malloc(2 * par->extradata_size + AV_INPUT_BUFFER_PADDING_SIZE);
+    if (!sc->param_sets)
+        return AVERROR(ENOMEM);
+    dst = sc->param_sets;
+
+    if (!sc->nal_length_size) {
+        if (AV_RB24(p) == 1 || AV_RB32(p) == 1) {
+            memcpy(dst, p, par->extradata_size);
+            dst += par->extradata_size;
+        }
+    } else if (par->codec_id == AV_CODEC_ID_H264) {
+        // avcC: SPS 个数和 SPS, 然后 PPS 个数和 PPS
+        nb_nals = p[5] & 0x1f;
+        p += 6;
+        for (i = 0; i < nb_nals && ret >= 0; i++)
+            ret = put_param_set(sc, &dst, &p, end);
+        if (ret >= 0 && p < end) {
+            nb_nals = *p++;
+            for (i = 0; i < nb_nals && ret >= 0; i++)
+                ret = put_param_set(sc, &dst, &p, end);
+        }
+    } else {
+        // hvcC: 每个数组是 NAL 类型, 个数, 然后每个 NAL
+        nb_arrays = p[22];
+        p += 23;
+        for (i = 0; i < nb_arrays && ret >= 0; i++) {
+            if (end - p < 3) {
+                ret = AVERROR_INVALIDDATA;
+                break;
+            }
+            nb_nals = AV_RB16(p + 1);
+            p += 3;
+            for (j = 0; j < nb_nals && ret >= 0; j++)
+                ret = put_param_set(sc, &dst, &p, end);
+        }
+    }
+    if (ret < 0) {
+        av_log(NULL, AV_LOG_WARNING, "Could not parse the parameter sets in extradata\n");
+        dst = sc->param_sets;
+    }
+    sc->param_sets_size = dst - sc->param_sets;
+    return 0;
+}
+
+static int prepend_param_sets(SmartCut *sc, AVPacket *pkt)
+{
+    AVPacket *out;
+    int ret;
+
+    if (!sc->param_sets_size)
+        return 0;
+    out = av_packet_alloc();
+    if (!out)
+        return AVERROR(ENOMEM);
+    if ((ret = av_new_packet(out, sc->param_sets_size + pkt->size)) < 0 ||
+        (ret = av_packet_copy_props(out, pkt)) < 0) {
+        av_packet_free(&out);
+        return ret;
+    }
+    memcpy(out->data, sc->param_sets, sc->param_sets_size);
+    memcpy(out->data + sc->param_sets_size, pkt->data, pkt->size);
+    av_packet_unref(pkt);
+    av_packet_move_ref(pkt, out);
+    av_packet_free(&out);
+    return 0;
+}
+
+static AVCodecContext *open_encoder(SmartCut *sc, const AVFrame *frame)
+{
+    AVStream *st = sc->ic->streams[sc->video_index];
+    const enum AVPixelFormat *p;
+    AVCodecContext *enc;
+
+    if (sc->enc_codec->pix_fmts) {
+        for (p = sc->enc_codec->pix_fmts; *p != AV_PIX_FMT_NONE && *p != frame->format; p++);
+        if (*p == AV_PIX_FMT_NONE) {
+            av_log(NULL, AV_LOG_ERROR, "%s can't encode the source pixel format\n", sc->enc_codec->name);
+            return NULL;
+        }
+    }
+    enc = avcodec_alloc_context3(sc->enc_codec);
+    if (!enc)
+        return NULL;
+    enc->width = frame->width;
+    enc->height = frame->height;
+    enc->pix_fmt = frame->format;
+    enc->sample_aspect_ratio = frame->sample_aspect_ratio;
+    enc->color_range = frame->color_range;
+    enc->color_primaries = frame->color_primaries;
+    enc->color_trc = frame->color_trc;
+    enc->colorspace = frame->colorspace;
+    enc->time_base = st->time_base;
+    // 和源一样的 profile/level, 只认 sample entry 里那份参数集的解码器也不至于超出能力
+    enc->profile = st->codecpar->profile;
+    enc->level = st->codecpar->level;
+    if (st->avg_frame_rate.num)
+        enc->framerate = st->avg_frame_rate;
+    // 不要 B 帧: 重编码的包 dts 直接由 pts 推出来, 接缝处才能单调
+    enc->max_b_frames = 0;
+    enc->thread_count = 0;
+    if (!enc->priv_data || av_opt_set(enc->priv_data, "crf", SMART_CUT_CRF, 0) < 0)
+        enc->bit_rate = st->codecpar->bit_rate;
+
+    if (avcodec_open2(enc, sc->enc_codec, NULL) < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Could not open the %s encoder\n", sc->enc_codec->name);
+        avcodec_free_context(&enc);
+    }
+    return enc;
+}
+
+static int encode_write(SmartCut *sc, AVCodecContext *enc, AVFrame *frame)
+{
+    AVPacket *pkt = sc->enc_pkt;
+    int ret;
+
+    if ((ret = avcodec_send_frame(enc, frame)) < 0)
+        return ret;
+    while ((ret = avcodec_receive_packet(enc, pkt)) >= 0) {
+        if (sc->nal_length_size && (ret = annexb_to_length_prefixed(pkt, sc->nal_length_size)) < 0)
+            return ret;
+        // 和拷贝的 GOP 保持同样的 pts - dts 间隔
+        pkt->dts = pkt->pts - sc->dts_delay;
+        if ((ret = cut_write(sc, pkt, sc->video_index)) < 0)
+            return ret;
+    }
+    return ret == AVERROR(EAGAIN) || ret == AVERROR_EOF ? 0 : ret;
+}
+
+/* decode the buffered packets and re-encode the frames from the cut start up to end_pts */
+static int reencode_gop(SmartCut *sc, int64_t end_pts)
+{
+    AVCodecContext *enc = NULL;
+    AVFrame *frame = sc->frame;
+    int64_t pts;
+    int i, nb_pkts, ret = 0;
+
+    // 只解到最后一个要用的帧: 它参考的帧解码顺序都在它前面
+    for (nb_pkts = sc->gop.nb_pkts; nb_pkts > 0; nb_pkts--) {
+        pts = sc->gop.pkts[nb_pkts - 1]->pts;
+        if (pts == AV_NOPTS_VALUE || pts < end_pts)
+            break;
+    }
+    for (i = 0; i <= nb_pkts && ret >= 0; i++) {
+        // 最后送一个 NULL 把解码器里的帧都冲出来
+        ret = avcodec_send_packet(sc->dec, i < nb_pkts ? sc->gop.pkts[i] : NULL);
+        if (ret < 0)
+            break;
+        while ((ret = avcodec_receive_frame(sc->dec, frame)) >= 0) {
+            pts = frame->best_effort_timestamp;
+            if (pts == AV_NOPTS_VALUE || pts < sc->start_pts || pts >= end_pts) {
+                av_frame_unref(frame);
+                continue;
+            }
+            if (!enc && !(enc = open_encoder(sc, frame))) {
+                av_frame_unref(frame);
+                ret = AVERROR(EINVAL);
+                break;
+            }
+            frame->pts = pts;
+            frame->pict_type = AV_PICTURE_TYPE_NONE;
+            ret = encode_write(sc, enc, frame);
+            av_frame_unref(frame);
+            if (ret < 0)
+                break;
+            sc->frames_reencoded++;
+        }
+        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
+            ret = 0;
+    }
+    if (enc) {
+        if (ret >= 0)
+            ret = encode_write(sc, enc, NULL);
+        avcodec_free_context(&enc);
     }
-    
+    avcodec_flush_buffers(sc->dec);
+    return ret;
+}
+
+/*
+ * The GOP is complete: drop it, copy it whole or re-encode the part inside
+ * the cut. A GOP straddling the start is held until the next one is complete:
+ * that one's open-GOP leading pictures reference it, so they are re-encoded
+ * with it and the copy starts at the keyframe.
+ */
+static int flush_gop(SmartCut *sc)
+{
+    CutGop *g = &sc->gop;
+    int i, ret = 0;
+
+    if (!g->nb_pkts)
+        return 0;
+    if (g->held == g->nb_pkts) {
+        // 等不到下一个 GOP 了 (文件尾或者下一个关键帧已经过了终点)
+        ret = reencode_gop(sc, sc->end_pts);
+        sc->gops_reencoded++;
+        sc->prev_reencoded = 1;
+    } else if (g->kf_pts == AV_NOPTS_VALUE || g->max_pts < sc->start_pts) {
+        // 在剪切起点之前
+    } else if (g->kf_pts >= sc->start_pts && g->max_pts < sc->end_pts) {
+        if (g->held) {
+            if ((ret = reencode_gop(sc, g->kf_pts)) < 0)
+                return ret;
+            sc->gops_reencoded++;
+            sc->prev_reencoded = 1;
+        }
+        for (i = g->held; i < g->nb_pkts && ret >= 0; i++) {
+            // open GOP 的前导帧参考的是上一个 GOP, 上面已经跟着它一起重编码了
+            if (sc->prev_reencoded && g->pkts[i]->pts < g->kf_pts)
+                continue;
+            // 重编码的帧带着编码器自己的 SPS/PPS, id 和源的一样, 关键帧前面把源的换回来
+            if (sc->prev_reencoded && i == g->held && (ret = prepend_param_sets(sc, g->pkts[i])) < 0)
+                break;
+            ret = cut_write(sc, g->pkts[i], sc->video_index);
+        }
+        sc->gops_copied++;
+        sc->prev_reencoded = 0;
+    } else if (!g->held && g->kf_pts < sc->start_pts && g->max_pts < sc->end_pts) {
+        g->held = g->nb_pkts;
+        return 0;
+    } else {
+        ret = reencode_gop(sc, sc->end_pts);
+        sc->gops_reencoded += 1 + !!g->held;
+        sc->prev_reencoded = 1;
+    }
+    gop_clear(g);
+    return ret;
+}
+
+/* buffer video packets GOP by GOP, returns 1 once past the end of the cut */
+static int smart_cut_video(SmartCut *sc, AVPacket *pkt)
+{
+    int ret;
+
+    if ((pkt->flags & AV_PKT_FLAG_KEY) && pkt->pts != AV_NOPTS_VALUE) {
+        if (pkt->dts != AV_NOPTS_VALUE)
+            sc->dts_delay = FFMAX(sc->dts_delay, pkt->pts - pkt->dts);
+        if ((ret = flush_gop(sc)) < 0)
+            return ret;
+        if (pkt->pts >= sc->end_pts)
+            return 1;
+        sc->gop.kf_pts = pkt->pts;
+        sc->gop.max_pts = pkt->pts;
+    }
+    return gop_add(&sc->gop, pkt);
+}
+
+static int smart_cut(AVFormatContext *ic, AVFormatContext *oc, Interleaver *il,
+                     const int *stream_map, double starttime, double endtime)
+{
+    SmartCut sc = { 0 };
+    AVStream *st;
+    AVPacket *pkt = NULL;
+    const AVCodec *dec;
+    uint8_t *extradata;
+    int *done = NULL;
+    int nb_done = 0, nb_mapped = 0;
+    int64_t ts;
+    int i, ret;
 
+    sc.ic = ic;
+    sc.oc = oc;
+    sc.il = il;
+    sc.stream_map = stream_map;
+    sc.start_us = starttime * AV_TIME_BASE;
+    sc.end_us = endtime * AV_TIME_BASE;
+    sc.gop.kf_pts = AV_NOPTS_VALUE;
+
+    sc.video_index = av_find_best_stream(ic, AVMEDIA_TYPE_VIDEO, -1, -1, &dec, 0);
+    if (sc.video_index < 0 || stream_map[sc.video_index] < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Smart cut needs a video stream\n");
+        return AVERROR_STREAM_NOT_FOUND;
+    }
+    st = ic->streams[sc.video_index];
+    sc.start_pts = av_rescale_q(sc.start_us, AV_TIME_BASE_Q, st->time_base);
+    sc.end_pts = av_rescale_q(sc.end_us, AV_TIME_BASE_Q, st->time_base);
 
-    // 4. 打开目的文件的上下文avformat_free_context
-    avformat_alloc_output_context2(&oFmtCtx, NULL, NULL, dst);
+    // 边界 GOP 用同一个 codec 重编码, 码流和拷贝的部分接得上
+    sc.enc_codec = avcodec_find_encoder(st->codecpar->codec_id);
+    if (!sc.enc_codec) {
+        av_log(NULL, AV_LOG_ERROR, "No %s encoder for the boundary GOPs\n", avcodec_get_name(st->codecpar->codec_id));
+        return AVERROR_ENCODER_NOT_FOUND;
+    }
+    extradata = st->codecpar->extradata;
+    if (extradata && extradata[0] == 1) {
+        if (st->codecpar->codec_id == AV_CODEC_ID_H264 && st->codecpar->extradata_size >= 7)
+            sc.nal_length_size = (extradata[4] & 3) + 1;
+        else if (st->codecpar->codec_id == AV_CODEC_ID_HEVC && st->codecpar->extradata_size >= 23)
+            sc.nal_length_size = (extradata[21] & 3) + 1;
+    }
+    if ((st->codecpar->codec_id == AV_CODEC_ID_H264 || st->codecpar->codec_id == AV_CODEC_ID_HEVC) &&
+        (ret = extract_param_sets(&sc, st->codecpar)) < 0)
+        return ret;
+
+    sc.dec = avcodec_alloc_context3(dec);
+    sc.frame = av_frame_alloc();
+    sc.enc_pkt = av_packet_alloc();
+    pkt = av_packet_alloc();
+    done = av_calloc(ic->nb_streams, sizeof(*done));
+    if (!sc.dec || !sc.frame || !sc.enc_pkt || !pkt || !done) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    if ((ret = avcodec_parameters_to_context(sc.dec, st->codecpar)) < 0)
+        goto end;
+    sc.dec->pkt_timebase = st->time_base;
+    sc.dec->thread_count = 0;
+    if ((ret = avcodec_open2(sc.dec, dec, NULL)) < 0)
+        goto end;
+
+    for (i = 0; i < ic->nb_streams; i++)
+        nb_mapped += stream_map[i] >= 0;
+
+    while (nb_done < nb_mapped && (ret = av_read_frame(ic, pkt)) >= 0) {
+        i = pkt->stream_index;
+        if (i >= ic->nb_streams || stream_map[i] < 0 || done[i]) {
+            av_packet_unref(pkt);
+            continue;
+        }
+        if (i == sc.video_index) {
+            if ((ret = smart_cut_video(&sc, pkt)) < 0)
+                break;
+            if (ret == 1) {
+                done[i] = 1;
+                nb_done++;
+            }
+        } else {
+            // 音频等其它流每个包都是关键帧, 按包裁剪就够了
+            ts = pkt->pts != AV_NOPTS_VALUE ? pkt->pts : pkt->dts;
+            ts = av_rescale_q(ts, ic->streams[i]->time_base, AV_TIME_BASE_Q);
+            if (ts >= sc.end_us) {
+                done[i] = 1;
+                nb_done++;
+            } else if (ts >= sc.start_us && (ret = cut_write(&sc, pkt, i)) < 0) {
+                break;
+            }
+        }
+        av_packet_unref(pkt);
+    }
+    if (ret == AVERROR_EOF || ret >= 0)
+        ret = flush_gop(&sc);
+
+    av_log(NULL, AV_LOG_INFO, "smart cut: %d GOPs copied, %d re-encoded (%d frames)\n",
+           sc.gops_copied, sc.gops_reencoded, sc.frames_reencoded);
+end:
+    gop_clear(&sc.gop);
+    av_free(sc.gop.pkts);
+    av_free(sc.param_sets);
+    avcodec_free_context(&sc.dec);
+    av_frame_free(&sc.frame);
+    av_packet_free(&sc.enc_pkt);
+    av_packet_free(&pkt);
+    av_free(done);
+    return ret;
+}
+
+enum { RANGE_PENDING, RANGE_OPEN, RANGE_DONE };
+
+typedef struct CutRange {
+    double starttime;
+    double endtime;
+    char *filename;
+    AVFormatContext *oFmtCtx;
+    Interleaver *il;
+    int64_t *dts_start_time; ///< per input stream, -1 until its first packet in the range
+    int64_t *pts_start_time;
+    int state;
+    int64_t packets;
+} CutRange;
+
+static int cmp_range(const void *a, const void *b)
+{
+    const CutRange *ra = a, *rb = b;
+    return (ra->starttime > rb->starttime) - (ra->starttime < rb->starttime);
+}
+
+/* dst for a single range, dst with %d replaced or _n before the extension otherwise */
+static char *range_filename(const char *dst, int n, int nb_ranges)
+{
+    const char *ext, *p;
+    int nb_d = 0, other = 0;
+
+    if (nb_ranges == 1)
+        return av_strdup(dst);
+    // dst 会当格式串用: 只允许一个 %d, 其余的 % 只能是 %%
+    for (p = strchr(dst, '%'); p; p = strchr(p + 1, '%')) {
+        if (p[1] == '%')
+            p++;
+        else if (p[1] == 'd')
+            nb_d++;
+        else
+            other++;
+    }
+    if (nb_d == 1 && !other)
+        return av_asprintf(dst, n);
+    if (nb_d || other) {
+        av_log(NULL, AV_LOG_ERROR, "Output name %s: a pattern needs exactly one %%d and %%%% for a literal %%\n", dst);
+        return NULL;
+    }
+    ext = strrchr(dst, '.');
+    if (!ext || strchr(ext, '/'))
+        return av_asprintf("%s_%d", dst, n);
+    return av_asprintf("%.*s_%d%s", (int)(ext - dst), dst, n, ext);
+}
+
+/* "start end [output]" per line */
+static int load_ranges(const char *filename, CutRange **ranges, int *nb_ranges)
+{
+    char line[4096], out[4096];
+    CutRange *r;
+    double start, end;
+    int n;
+    FILE *f;
+
+    f = fopen(filename, "r");
+    if (!f) {
+        av_log(NULL, AV_LOG_ERROR, "Could not open %s\n", filename);
+        return AVERROR(errno);
+    }
+    while (fgets(line, sizeof(line), f)) {
+        if (line[strspn(line, " \t")] == '#')
+            continue;
+        n = sscanf(line, "%lf %lf %4095s", &start, &end, out);
+        if (n < 2)
+            continue;
+        r = av_realloc_array(*ranges, *nb_ranges + 1, sizeof(**ranges));
+        if (!r) {
+            fclose(f);
+            return AVERROR(ENOMEM);
+        }
+        *ranges = r;
+        r = &r[(*nb_ranges)++];
+        memset(r, 0, sizeof(*r));
+        r->starttime = start;
+        r->endtime = end;
+        if (n == 3 && !(r->filename = av_strdup(out))) {
+            fclose(f);
+            return AVERROR(ENOMEM);
+        }
+    }
+    fclose(f);
+    return 0;
+}
+
+/* open the range's muxer with every mapped stream of the input */
+/*
+ * ISO-BMFF: smart cut's re-encoded GOPs carry their own SPS/PPS, so the
+ * sample entry must say parameter sets also come in-band (avc3/hev1), or
+ * decoders that only read avcC/hvcC apply the source's to them.
+ */
+static void set_inband_tag(AVFormatContext *oFmtCtx, AVCodecParameters *par)
+{
+    unsigned int tag = par->codec_id == AV_CODEC_ID_H264 ? MKTAG('a','v','c','3') :
+                       par->codec_id == AV_CODEC_ID_HEVC ? MKTAG('h','e','v','1') : 0;
+
+    if (tag && oFmtCtx->oformat->codec_tag &&
+        av_codec_get_id(oFmtCtx->oformat->codec_tag, tag) == par->codec_id)
+        par->codec_tag = tag;
+}
+
+static int range_open(CutRange *r, AVFormatContext *pFmtCtx, const int *stream_map, int smart)
+{
+    AVFormatContext *oFmtCtx = NULL;
+    int video_index = smart ? av_find_best_stream(pFmtCtx, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0) : -1;
+    int i, ret;
+
+    // 4. 打开目的文件的上下文
+    ret = avformat_alloc_output_context2(&oFmtCtx, NULL, NULL, r->filename);
     if (!oFmtCtx)
     {
-        av_log(oFmtCtx, AV_LOG_ERROR,"NO MEMORY!\n");
-        goto _ERROR;
+        av_log(NULL, AV_LOG_ERROR,"%s: %s\n", r->filename, av_err2str(ret));
+        return ret;
     }
-    
-    stream_map = av_calloc(pFmtCtx->nb_streams, sizeof(int));
-    if (!stream_map)
-    {
-        av_log(oFmtCtx, AV_LOG_ERROR,"NO MEMORY!\n");
-        goto _ERROR;
+    r->oFmtCtx = oFmtCtx;
+
+    r->dts_start_time = av_malloc_array(pFmtCtx->nb_streams, sizeof(int64_t));
+    r->pts_start_time = av_malloc_array(pFmtCtx->nb_streams, sizeof(int64_t));
+    if (!r->dts_start_time || !r->pts_start_time)
+        return AVERROR(ENOMEM);
 
-    }
-    
     for(i=0; i < pFmtCtx->nb_streams; i++){
         AVStream *outStream = NULL;
-        AVStream *inStream = pFmtCtx->streams[i];
-        AVCodecParameters *inCodercPar = inStream->codecpar;
-        if (inCodercPar->codec_type != AVMEDIA_TYPE_AUDIO && 
-        inCodercPar->codec_type != AVMEDIA_TYPE_VIDEO  &&
-        inCodercPar->codec_type != AVMEDIA_TYPE_SUBTITLE)
-        {
-            stream_map[i] = -1;
+
+        r->dts_start_time[i] = -1;
+        r->pts_start_time[i] = -1;
+        if (stream_map[i] < 0)
             continue;
-        }
-        stream_map[i] = stream_idx++;
          // 5. 为目的文件,创建一个新的流
-
         outStream = avformat_new_stream(oFmtCtx, NULL);
-
         if (!outStream){
-             av_log(oFmtCtx, AV_LOG_ERROR,"NO MEMORY!\n");
-            goto _ERROR;
+            av_log(oFmtCtx, AV_LOG_ERROR,"NO MEMORY!\n");
+            return AVERROR(ENOMEM);
         }
-        avcodec_parameters_copy(outStream->codecpar, inStream->codecpar);
+        avcodec_parameters_copy(outStream->codecpar, pFmtCtx->streams[i]->codecpar);
         outStream->codecpar->codec_tag = 0;
+        if (i == video_index)
+            set_inband_tag(oFmtCtx, outStream->codecpar);
     }
 
     //  绑定
-    ret = avio_open2(&oFmtCtx->pb,dst,AVIO_FLAG_WRITE, NULL, NULL);
+    ret = async_writer_avio_open(&oFmtCtx->pb, r->filename, ASYNC_WRITER_PREALLOC);
     if (ret < 0 )
     {
-        av_log(oFmtCtx, AV_LOG_ERROR,"%s\n" ,av_err2str(ret));
-         goto _ERROR;
+        av_log(oFmtCtx, AV_LOG_ERROR,"%s: %s\n", r->filename, av_err2str(ret));
+        return ret;
     }
 
     // 7. 写多媒体文件头到目的文件
-
     ret = avformat_write_header(oFmtCtx, NULL);
     if (ret < 0 )
     {
-        av_log(oFmtCtx, AV_LOG_ERROR,"%s\n" ,av_err2str(ret));
-         goto _ERROR;
+        av_log(oFmtCtx, AV_LOG_ERROR,"%s: %s\n", r->filename, av_err2str(ret));
+        return ret;
+    }
+    // 输入是各段共用的, 也由 multi_cut 自己 seek, 交错队列不能回退它
+    if (interleave_max_bytes > 0 || interleave_max_duration > 0)
+    {
+        ret = interleaver_alloc(&r->il, oFmtCtx, NULL, interleave_max_bytes, interleave_max_duration);
+        if (ret < 0)
+            return ret;
     }
+    r->state = RANGE_OPEN;
+    return 0;
+}
 
-    // seek 
-    ret = av_seek_frame(pFmtCtx, -1, starttime*AV_TIME_BASE, AVSEEK_FLAG_BACKWARD);
-    if (ret < 0 )
+/* 9. 写文件尾, 释放这一段的输出 */
+static int range_close(CutRange *r)
+{
+    InterleaverStats ist;
+    int ret = 0;
+
+    if (r->state == RANGE_OPEN && r->il)
     {
-        av_log(oFmtCtx, AV_LOG_ERROR,"%s\n" ,av_err2str(ret));
-        goto _ERROR;
+        ret = interleaver_eof(r->il);
+        interleaver_get_stats(r->il, &ist);
+        av_log(NULL, AV_LOG_INFO, "%s: interleave peak %.1f MB / %d packets queued, %d early flushes, %"PRId64" past max_interleave_delta\n",
+               r->filename, ist.peak_bytes / (1024.0 * 1024.0), ist.peak_packets, ist.flushes, ist.delta_writes);
+    }
+    if (r->state == RANGE_OPEN && ret >= 0)
+        ret = av_write_trailer(r->oFmtCtx);
+    interleaver_free(&r->il);
+    if (r->oFmtCtx)
+    {
+        // 写线程积压的块到这里才全部落盘
+        int err = async_writer_avio_close(&r->oFmtCtx->pb);
+        if (err < 0 && ret >= 0)
+        {
+            ret = err;
+        }
+        avformat_free_context(r->oFmtCtx);
+        r->oFmtCtx = NULL;
     }
+    av_freep(&r->dts_start_time);
+    av_freep(&r->pts_start_time);
+    r->state = RANGE_DONE;
+    return ret;
+}
+
+/* rebase pkt (a reference owned by the caller) on the range's first packets and write it */
+static int range_write(CutRange *r, AVFormatContext *pFmtCtx, const int *stream_map, AVPacket *pkt)
+{
+    AVStream *inStream = pFmtCtx->streams[pkt->stream_index];
+    AVStream *outStream = r->oFmtCtx->streams[stream_map[pkt->stream_index]];
+    int i = pkt->stream_index;
 
-    dts_start_time = av_calloc(pFmtCtx->nb_streams, sizeof(int64_t));
-    for (int t = 0; t < pFmtCtx->nb_streams; t++)
+    if (r->dts_start_time[i] == -1  && pkt->dts > 0)
+    {
+        r->dts_start_time[i] = pkt->dts;
+    }
+    if (r->pts_start_time[i] == -1  && pkt->pts > 0)
     {
-        dts_start_time[t] = -1;
+        r->pts_start_time[i] = pkt->pts;
     }
-    
-    pts_start_time = av_calloc(pFmtCtx->nb_streams, sizeof(int64_t));
-    for (int t = 0; t < pFmtCtx->nb_streams; t++)
+    pkt->pts = pkt->pts - r->pts_start_time[i];
+    pkt->dts = pkt->dts - r->dts_start_time[i];
+    if (pkt->dts > pkt->pts)
     {
-        pts_start_time[t] = -1;
+        pkt->pts = pkt->dts;
     }
-    
 
+    pkt->stream_index = stream_map[i];
+    av_packet_rescale_ts(pkt, inStream->time_base, outStream->time_base);
+    pkt->pos = -1;
+    r->packets++;
+    if (r->il)
+        return interleaver_write(r->il, pkt, -1);
+    return av_interleaved_write_frame(r->oFmtCtx, pkt);
+}
+
+/* seek: 有关键帧索引(src.kfidx)就直接跳到关键帧的位置, 否则 av_seek_frame */
+static int cut_seek(AVFormatContext *pFmtCtx, KeyframeIndex *kfidx, double time)
+{
+    int ret = -1;
+
+    if (kfidx)
+        ret = kfidx_seek(pFmtCtx, kfidx, INT64_MIN, time*AV_TIME_BASE);
+    if (ret < 0)
+        ret = av_seek_frame(pFmtCtx, -1, time*AV_TIME_BASE, AVSEEK_FLAG_BACKWARD);
+    return ret;
+}
 
-    // 8. 从源多媒体文件中读到数据到目的文件中
-    while (av_read_frame(pFmtCtx, &pkt) >= 0)
-    
+/*
+ * All ranges in one forward pass. Every packet goes to each open range, so
+ * overlapping and neighbouring ranges share the reads; the packets since the
+ * last video keyframe are kept so a range opening mid-GOP starts, like a
+ * single cut, at that keyframe. Gaps longer than CUT_SEEK_GAP are seeked over,
+ * once per range.
+ */
+static int multi_cut(AVFormatContext *pFmtCtx, KeyframeIndex *kfidx, const int *stream_map,
+                     CutRange *ranges, int nb_ranges)
+{
+    AVPacket **gop = NULL;
+    AVPacket *pkt, *ref;
+    int nb_gop = 0, nb_gop_alloc = 0;
+    int next = 0, nb_open = 0, nb_done = 0;
+    int seeked = 0;   ///< range last seeked to; its keyframe may be more than CUT_SEEK_GAP before it
+    int video_index;
+    double t;
+    int i, j, ret;
+
+    video_index = av_find_best_stream(pFmtCtx, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+    pkt = av_packet_alloc();
+    if (!pkt)
+        return AVERROR(ENOMEM);
+
+    if ((ret = cut_seek(pFmtCtx, kfidx, ranges[0].starttime)) < 0)
+        goto end;
+
+    // 8. 从源多媒体文件中读到数据到各段的目的文件中
+    while (nb_done < nb_ranges && (ret = av_read_frame(pFmtCtx, pkt)) >= 0)
     {
-        AVStream *inStream,*outStream;
+        i = pkt->stream_index;
+        if (i >= pFmtCtx->nb_streams || stream_map[i] < 0 ||
+            (pkt->pts == AV_NOPTS_VALUE && pkt->dts == AV_NOPTS_VALUE))
+        {
+            av_packet_unref(pkt);
+            continue;
+        }
+        t = av_q2d(pFmtCtx->streams[i]->time_base) *
+            (pkt->pts != AV_NOPTS_VALUE ? pkt->pts : pkt->dts);
 
+        // 已经打开的段: 过了结束时间就收尾, 否则写进去
+        for (j = 0; j < next; j++)
+        {
+            if (ranges[j].state != RANGE_OPEN)
+                continue;
+            if (t > ranges[j].endtime)
+            {
+                av_log(NULL, AV_LOG_INFO, "%s: %"PRId64" packets\n", ranges[j].filename, ranges[j].packets);
+                ret = range_close(&ranges[j]);
+                nb_open--;
+                nb_done++;
+            }
+            else if (!(ref = av_packet_clone(pkt)))
+            {
+                ret = AVERROR(ENOMEM);
+            }
+            else
+            {
+                ret = range_write(&ranges[j], pFmtCtx, stream_map, ref);
+                av_packet_free(&ref);
+            }
+            if (ret < 0)
+                goto end;
+        }
 
-        if (dts_start_time[pkt.stream_index] == -1  && pkt.dts > 0)
+        // 从最近的视频关键帧开始缓存
+        if (video_index < 0 || (i == video_index && (pkt->flags & AV_PKT_FLAG_KEY)))
         {
-            dts_start_time[pkt.stream_index] = pkt.dts;
+            for (j = 0; j < nb_gop; j++)
+                av_packet_free(&gop[j]);
+            nb_gop = 0;
         }
-        if (pts_start_time[pkt.stream_index] == -1  && pkt.pts > 0)
+        if (nb_gop == nb_gop_alloc)
         {
-            pts_start_time[pkt.stream_index] = pkt.pts;
+            AVPacket **tmp = av_realloc_array(gop, FFMAX(2 * nb_gop_alloc, 64), sizeof(*gop));
+            if (!tmp)
+            {
+                ret = AVERROR(ENOMEM);
+                goto end;
+            }
+            gop = tmp;
+            nb_gop_alloc = FFMAX(2 * nb_gop_alloc, 64);
+        }
+        gop[nb_gop++] = pkt;
+        pkt = av_packet_alloc();
+        if (!pkt)
+        {
+            ret = AVERROR(ENOMEM);
+            goto end;
         }
-        
-        inStream = pFmtCtx->streams[pkt.stream_index];
 
+        // 到了起点的段: 打开, 把缓存的这个 GOP 补进去
+        while (next < nb_ranges && t >= ranges[next].starttime)
+        {
+            CutRange *r = &ranges[next++];
 
-        if (av_q2d(inStream->time_base) * pkt.pts > endtime)
+            if (t > r->endtime)
+            {
+                // 整段落在一个包里, 什么都不写
+                av_log(NULL, AV_LOG_WARNING, "%s: range %g-%g is empty\n", r->filename, r->starttime, r->endtime);
+                r->state = RANGE_DONE;
+                nb_done++;
+                continue;
+            }
+            if ((ret = range_open(r, pFmtCtx, stream_map, 0)) < 0)
+                goto end;
+            nb_open++;
+            for (j = 0; j < nb_gop; j++)
+            {
+                if (!(ref = av_packet_clone(gop[j])))
+                {
+                    ret = AVERROR(ENOMEM);
+                    goto end;
+                }
+                ret = range_write(r, pFmtCtx, stream_map, ref);
+                av_packet_free(&ref);
+                if (ret < 0)
+                    goto end;
+            }
+        }
+
+        // 没有打开的段, 下一段又离得远: 直接 seek 过去
+        // 每段只 seek 一次: 关键帧稀疏时落点本来就会离起点超过 CUT_SEEK_GAP, 再 seek 会原地打转
+        if (!nb_open && next < nb_ranges && next != seeked && ranges[next].starttime - t > CUT_SEEK_GAP)
         {
-            av_log(oFmtCtx, AV_LOG_INFO,"success\n");
-            break;
+            seeked = next;
+            if ((ret = cut_seek(pFmtCtx, kfidx, ranges[next].starttime)) < 0)
+                goto end;
+            for (j = 0; j < nb_gop; j++)
+                av_packet_free(&gop[j]);
+            nb_gop = 0;
         }
-        
+    }
+    if (ret == AVERROR_EOF || ret >= 0)
+        ret = 0;
 
+end:
+    // 读到文件尾还开着的段也要写完
+    for (j = 0; j < nb_ranges; j++)
+    {
+        if (ranges[j].state == RANGE_OPEN)
+        {
+            av_log(NULL, AV_LOG_INFO, "%s: %"PRId64" packets\n", ranges[j].filename, ranges[j].packets);
+            i = range_close(&ranges[j]);
+            ret = ret < 0 ? ret : i;
+        }
+        else
+        {
+            range_close(&ranges[j]);
+        }
+    }
+    for (j = 0; j < nb_gop; j++)
+        av_packet_free(&gop[j]);
+    av_free(gop);
+    av_packet_free(&pkt);
+    return ret;
+}
 
-        if (stream_map[pkt.stream_index] < 0 ){
-            av_packet_unref(&pkt);
-            continue;
+int main(int argc, char* argv[]){
+
+    // 1. 处理一些参数, 
+    char* src;
+    char* dst;
+    const char *range_file = NULL;
+
+    int *stream_map = NULL; 
+
+    int i = 0;
+    int ret = -1;
+    int stream_idx = 0;
+
+    AVFormatContext *pFmtCtx = NULL;
+
+    KeyframeIndex *kfidx = NULL;
+
+    CutRange *ranges = NULL;
+    int nb_ranges = 0;
+
+    int smart = 0;
+    int build_index = 0;
+
+    // cut [-smart] [-build_index] [-ranges list] [-max_interleave MB] [-max_interleave_sec s] src  dst  [start  end]...
+
+    while (argc > 1 && argv[1][0] == '-')
+    {
+        if (!strcmp(argv[1], "-smart"))
+        {
+            smart = 1;
+        }
+        else if (!strcmp(argv[1], "-build_index"))
+        {
+            build_index = 1;
+        }
+        else if (!strcmp(argv[1], "-ranges") && argc > 2)
+        {
+            range_file = argv[2];
+            argc--;
+            argv++;
+        }
+        else if (!strcmp(argv[1], "-max_interleave") && argc > 2)
+        {
+            interleave_max_bytes = (int64_t)(atof(argv[2]) * 1024 * 1024);
+            argc--;
+            argv++;
+        }
+        else if (!strcmp(argv[1], "-max_interleave_sec") && argc > 2)
+        {
+            interleave_max_duration = (int64_t)(atof(argv[2]) * AV_TIME_BASE);
+            argc--;
+            argv++;
         }
+        else
+        {
+            break;
+        }
+        argc--;
+        argv++;
+    }
+    if(argc < 3 || (argc < 5 && !range_file) || (argc - 3) % 2){  //argv[0], extra_audio  
+        av_log(NULL, AV_LOG_INFO ,"usage: cut [-smart] [-build_index] [-ranges list] [-max_interleave MB] [-max_interleave_sec s] src dst [start end]...\n");
+        return -1;
+    }
+    src = argv[1];
+    dst = argv[2];
 
-        pkt.pts =pkt.pts - pts_start_time[pkt.stream_index];
-        pkt.dts =pkt.dts - dts_start_time[pkt.stream_index];
-        if (pkt.dts > pkt.pts)
+    // 时间段: 命令行上成对给出, 或者 -ranges 文件里每行 "start end [output]"
+    if (range_file && load_ranges(range_file, &ranges, &nb_ranges) < 0)
+    {
+        goto _ERROR;
+    }
+    for (i = 3; i + 1 < argc; i += 2)
+    {
+        CutRange *r = av_realloc_array(ranges, nb_ranges + 1, sizeof(*ranges));
+        if (!r)
         {
-            pkt.pts = pkt.dts;
+            goto _ERROR;
         }
-        
+        ranges = r;
+        memset(&ranges[nb_ranges], 0, sizeof(*ranges));
+        ranges[nb_ranges].starttime = atof(argv[i]);
+        ranges[nb_ranges].endtime = atof(argv[i + 1]);
+        nb_ranges++;
+    }
+    if (!nb_ranges)
+    {
+        av_log(NULL, AV_LOG_ERROR, "No time range given\n");
+        goto _ERROR;
+    }
+    for (i = 0; i < nb_ranges; i++)
+    {
+        if (!ranges[i].filename && !(ranges[i].filename = range_filename(dst, i + 1, nb_ranges)))
+        {
+            goto _ERROR;
+        }
+    }
+    qsort(ranges, nb_ranges, sizeof(*ranges), cmp_range);
 
-    
-        pkt.stream_index = stream_map[pkt.stream_index];
-        outStream = pFmtCtx->streams[pkt.stream_index];
-        av_packet_rescale_ts(&pkt,inStream->time_base,outStream->time_base); 
+    // 2. 打开多媒体文件
+    ret = avformat_open_input(&pFmtCtx, src, NULL, NULL);
+    if (ret < 0 )
+    {
+        av_log(NULL, AV_LOG_ERROR,"%s\n" ,av_err2str(ret));
+        goto _ERROR;
+    }
 
+    stream_map = av_calloc(pFmtCtx->nb_streams, sizeof(int));
+    if (!stream_map)
+    {
+        av_log(NULL, AV_LOG_ERROR,"NO MEMORY!\n");
+        goto _ERROR;
+    }
+    for(i=0; i < pFmtCtx->nb_streams; i++){
+        AVCodecParameters *inCodercPar = pFmtCtx->streams[i]->codecpar;
+        if (inCodercPar->codec_type != AVMEDIA_TYPE_AUDIO && 
+        inCodercPar->codec_type != AVMEDIA_TYPE_VIDEO  &&
+        inCodercPar->codec_type != AVMEDIA_TYPE_SUBTITLE)
+        {
+            stream_map[i] = -1;
+            continue;
+        }
+        stream_map[i] = stream_idx++;
+    }
 
-        pkt.pos = -1;
-        av_interleaved_write_frame(oFmtCtx, &pkt);
-        av_packet_unref(&pkt);
+    // 建索引要把整个文件读一遍, 只在要求时做; 平时有现成的就用
+    if (build_index)
+    {
+        kfidx_build(src, NULL);
+    }
+    if (kfidx_open(&kfidx, src) < 0)
+    {
+        kfidx = NULL;
+    }
 
+    if (smart)
+    {
+        // 重编码的边界 GOP 没法在段之间共享, 每段自己 seek 一次
+        for (i = 0; i < nb_ranges; i++)
+        {
+            ret = range_open(&ranges[i], pFmtCtx, stream_map, 1);
+            if (ret >= 0)
+                ret = cut_seek(pFmtCtx, kfidx, ranges[i].starttime);
+            if (ret >= 0)
+                ret = smart_cut(pFmtCtx, ranges[i].oFmtCtx, ranges[i].il, stream_map,
+                                ranges[i].starttime, ranges[i].endtime);
+            if (ret < 0)
+            {
+                av_log(NULL, AV_LOG_ERROR,"%s: %s\n", ranges[i].filename, av_err2str(ret));
+                ranges[i].state = RANGE_DONE;
+            }
+            range_close(&ranges[i]);
+        }
     }
-    
-    // 9. 写多媒体文件尾到文件中
-    av_write_trailer(oFmtCtx);
+    else
+    {
+        ret = multi_cut(pFmtCtx, kfidx, stream_map, ranges, nb_ranges);
+        if (ret < 0)
+        {
+            av_log(NULL, AV_LOG_ERROR,"%s\n" ,av_err2str(ret));
+        }
+    }
+
     // 10. 将申请的资源释放掉
 _ERROR:
     if (pFmtCtx)
     {
         avformat_close_input(&pFmtCtx);
         pFmtCtx = NULL;
-    }
-    if (oFmtCtx->pb)
-    {
-        avio_close(oFmtCtx->pb);
-    }
-    
-    if (oFmtCtx)
-    {
-        avformat_free_context(oFmtCtx);
-        oFmtCtx = NULL;
     }
      if (stream_map)
     {
        av_free(stream_map);
     }
+    kfidx_close(&kfidx);
 
-
-    if (dts_start_time)
-    {
-        av_free(dts_start_time);
-    }
-     if (pts_start_time)
+    for (i = 0; i < nb_ranges; i++)
     {
-        av_free(pts_start_time);
+        range_close(&ranges[i]);
+        av_free(ranges[i].filename);
     }
-    
+    av_free(ranges);
+
     printf("hello world!\n");
     return 0;
 }
@@ -0,0 +1,3 @@
+#!/bin/bash
+
+clang -g -o fanout fanout.c ../common/async_writer.c ../common/mmap_io.c `pkg-config --libs --cflags libavutil libavformat libavcodec` -lpthread
@@ -0,0 +1,338 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libavutil/log.h>
+#include <libavutil/avutil.h>
+#include <libavutil/fifo.h>
+#include <libavutil/mem.h>
+#include <libavformat/avformat.h>
+
+#include "../common/async_writer.h"
+#include "../common/mmap_io.h"
+
+// 一次解复用, 多路输出
+// extra_audio / extra_video / remux 各自把整个输入读一遍, 同一个源要出三个文件就读三遍
+// 这里只读一遍, 每个包按引用 (av_packet_clone, 不拷数据) 分给所有要它的输出,
+// 每个输出有自己的流映射和时间基换算, 自己一个写线程, 前面挡一个有界队列
+//
+//  ./fanout /Users/mesay/Downloads/kyrie_Irving.mp4 1.aac 1.h264 1.mp4
+//  ./fanout in.mp4 -map a 1.aac -map v 1.h264 -map 0,1 1.mov
+//
+// -map 只管紧跟着的那个输出: v 最佳视频流, a 最佳音频流, all 全部, 或者 0,2 这样的流序号
+// 不给 -map 时取最佳的音视频流里输出格式支持的那些 (所以 .aac 只要音频, .h264 只要视频)
+
+#define FANOUT_QUEUE_SIZE 256 ///< packets waiting for one writer, at most
+
+typedef struct FanoutStream {
+    int index;           ///< output stream, -1 if the input stream is not written
+    AVRational in_tb;
+    AVRational out_tb;   ///< known once the header is written
+} FanoutStream;
+
+typedef struct FanoutOutput {
+    const char *filename;
+    const char *map;
+    AVFormatContext *oc;
+    FanoutStream *streams; ///< indexed by input stream
+
+    AVFifo *queue;       ///< AVPacket *, a NULL packet ends the output
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    pthread_t thread;
+    int started;
+
+    int error;
+    int64_t packets;
+    int64_t bytes;
+    int64_t full_waits;  ///< times the demuxer waited on this queue
+} FanoutOutput;
+
+static void fanout_push(FanoutOutput *out, AVPacket *pkt)
+{
+    pthread_mutex_lock(&out->mutex);
+    if (!av_fifo_can_write(out->queue))
+        out->full_waits++;
+    while (!av_fifo_can_write(out->queue))
+        pthread_cond_wait(&out->cond, &out->mutex);
+    av_fifo_write(out->queue, &pkt, 1);
+    pthread_cond_signal(&out->cond);
+    pthread_mutex_unlock(&out->mutex);
+}
+
+static AVPacket *fanout_pop(FanoutOutput *out)
+{
+    AVPacket *pkt;
+
+    pthread_mutex_lock(&out->mutex);
+    while (!av_fifo_can_read(out->queue))
+        pthread_cond_wait(&out->cond, &out->mutex);
+    av_fifo_read(out->queue, &pkt, 1);
+    pthread_cond_signal(&out->cond);
+    pthread_mutex_unlock(&out->mutex);
+    return pkt;
+}
+
+static void *writer_thread(void *arg)
+{
+    FanoutOutput *out = arg;
+    FanoutStream *fs;
+    AVPacket *pkt;
+    int ret;
+
+    while ((pkt = fanout_pop(out))) {
+        // 出错之后继续把队列取空, 别把解复用卡住
+        if (!out->error) {
+            fs = &out->streams[pkt->stream_index];
+            av_packet_rescale_ts(pkt, fs->in_tb, fs->out_tb);
+            pkt->stream_index = fs->index;
+            pkt->pos = -1;
+            out->packets++;
+            out->bytes += pkt->size;
+            if ((ret = av_interleaved_write_frame(out->oc, pkt)) < 0) {
+                av_log(out->oc, AV_LOG_ERROR, "%s: %s\n", out->filename, av_err2str(ret));
+                out->error = ret;
+            }
+        }
+        av_packet_free(&pkt);
+    }
+    if (!out->error && (ret = av_write_trailer(out->oc)) < 0)
+        out->error = ret;
+    return NULL;
+}
+
+/* which input streams go to out, from its -map or from what its muxer takes */
+static int fanout_map_streams(FanoutOutput *out, AVFormatContext *ic)
+{
+    int best[2], i, nb = 0;
+    char *spec, *tok, *saveptr;
+
+    for (i = 0; i < ic->nb_streams; i++)
+        out->streams[i].index = -1;
+
+    best[0] = av_find_best_stream(ic, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+    best[1] = av_find_best_stream(ic, AVMEDIA_TYPE_AUDIO, -1, -1, NULL, 0);
+
+    if (!out->map) {
+        for (i = 0; i < 2; i++) {
+            if (best[i] >= 0 &&
+                avformat_query_codec(out->oc->oformat, ic->streams[best[i]]->codecpar->codec_id,
+                                     FF_COMPLIANCE_NORMAL) == 1)
+                out->streams[best[i]].index = 0;
+        }
+    } else if (!strcmp(out->map, "v") || !strcmp(out->map, "a")) {
+        i = out->map[0] == 'v' ? best[0] : best[1];
+        if (i >= 0)
+            out->streams[i].index = 0;
+    } else if (!strcmp(out->map, "all")) {
+        for (i = 0; i < ic->nb_streams; i++)
+            out->streams[i].index = 0;
+    } else {
+        if (!(spec = av_strdup(out->map)))
+            return AVERROR(ENOMEM);
+        for (tok = strtok_r(spec, ",", &saveptr); tok; tok = strtok_r(NULL, ",", &saveptr)) {
+            i = atoi(tok);
+            if (i < 0 || i >= ic->nb_streams) {
+                av_log(NULL, AV_LOG_ERROR, "%s: no input stream %s\n", out->filename, tok);
+                av_free(spec);
+                return AVERROR(EINVAL);
+            }
+            out->streams[i].index = 0;
+        }
+        av_free(spec);
+    }
+
+    // 按输入顺序编号
+    for (i = 0; i < ic->nb_streams; i++) {
+        if (out->streams[i].index >= 0) {
+            out->streams[i].index = nb++;
+            out->streams[i].in_tb = ic->streams[i]->time_base;
+        }
+    }
+    if (!nb) {
+        av_log(NULL, AV_LOG_ERROR, "%s: no stream to write\n", out->filename);
+        return AVERROR_STREAM_NOT_FOUND;
+    }
+    return 0;
+}
+
+static int fanout_open(FanoutOutput *out, AVFormatContext *ic)
+{
+    AVStream *st;
+    int i, ret;
+
+    ret = avformat_alloc_output_context2(&out->oc, NULL, NULL, out->filename);
+    if (ret < 0) {
+        av_log(NULL, AV_LOG_ERROR, "%s: %s\n", out->filename, av_err2str(ret));
+        return ret;
+    }
+    out->streams = av_calloc(ic->nb_streams, sizeof(*out->streams));
+    if (!out->streams)
+        return AVERROR(ENOMEM);
+    if ((ret = fanout_map_streams(out, ic)) < 0)
+        return ret;
+
+    for (i = 0; i < ic->nb_streams; i++) {
+        if (out->streams[i].index < 0)
+            continue;
+        if (!(st = avformat_new_stream(out->oc, NULL)))
+            return AVERROR(ENOMEM);
+        if ((ret = avcodec_parameters_copy(st->codecpar, ic->streams[i]->codecpar)) < 0)
+            return ret;
+        st->codecpar->codec_tag = 0;
+        st->time_base = ic->streams[i]->time_base;
+    }
+
+    if (!(out->oc->oformat->flags & AVFMT_NOFILE) &&
+        (ret = async_writer_avio_open(&out->oc->pb, out->filename, ASYNC_WRITER_PREALLOC)) < 0) {
+        av_log(NULL, AV_LOG_ERROR, "%s: %s\n", out->filename, av_err2str(ret));
+        return ret;
+    }
+    if ((ret = avformat_write_header(out->oc, NULL)) < 0) {
+        av_log(out->oc, AV_LOG_ERROR, "%s: %s\n", out->filename, av_err2str(ret));
+        return ret;
+    }
+    // 写完头输出流的时间基才定下来
+    for (i = 0; i < ic->nb_streams; i++) {
+        if (out->streams[i].index >= 0)
+            out->streams[i].out_tb = out->oc->streams[out->streams[i].index]->time_base;
+    }
+
+    out->queue = av_fifo_alloc2(FANOUT_QUEUE_SIZE, sizeof(AVPacket *), 0);
+    if (!out->queue)
+        return AVERROR(ENOMEM);
+    pthread_mutex_init(&out->mutex, NULL);
+    pthread_cond_init(&out->cond, NULL);
+    if (pthread_create(&out->thread, NULL, writer_thread, out)) {
+        pthread_cond_destroy(&out->cond);
+        pthread_mutex_destroy(&out->mutex);
+        return AVERROR(EAGAIN);
+    }
+    out->started = 1;
+    return 0;
+}
+
+static void fanout_close(FanoutOutput *out)
+{
+    AVPacket *pkt;
+    int ret;
+
+    if (out->started) {
+        fanout_push(out, NULL);
+        pthread_join(out->thread, NULL);
+        pthread_cond_destroy(&out->cond);
+        pthread_mutex_destroy(&out->mutex);
+    }
+    if (out->queue) {
+        while (av_fifo_read(out->queue, &pkt, 1) >= 0)
+            av_packet_free(&pkt);
+        av_fifo_freep2(&out->queue);
+    }
+    if (out->oc) {
+        if (!(out->oc->oformat->flags & AVFMT_NOFILE) &&
+            (ret = async_writer_avio_close(&out->oc->pb)) < 0 && !out->error) {
+            av_log(NULL, AV_LOG_ERROR, "%s: %s\n", out->filename, av_err2str(ret));
+            out->error = ret;
+        }
+        avformat_free_context(out->oc);
+        out->oc = NULL;
+    }
+    av_freep(&out->streams);
+}
+
+int main(int argc, char *argv[])
+{
+    AVFormatContext *ic = NULL;
+    FanoutOutput *outputs = NULL;
+    AVPacket *pkt = NULL, *ref;
+    const char *src, *map = NULL;
+    int nb_outputs = 0;
+    int nb_streams;
+    int64_t packets = 0;
+    int i, j, ret;
+
+    if (argc < 3) {
+        av_log(NULL, AV_LOG_INFO, "Usage: %s <input> [-map v|a|all|i,j,...] <output> ...\n", argv[0]);
+        return -1;
+    }
+    src = argv[1];
+
+    outputs = av_calloc(argc, sizeof(*outputs));
+    if (!outputs)
+        return -1;
+    for (i = 2; i < argc; i++) {
+        if (!strcmp(argv[i], "-map") && i + 1 < argc) {
+            map = argv[++i];
+            continue;
+        }
+        outputs[nb_outputs].filename = argv[i];
+        outputs[nb_outputs].map = map;
+        nb_outputs++;
+        map = NULL;
+    }
+    if (!nb_outputs) {
+        av_log(NULL, AV_LOG_ERROR, "No output given\n");
+        ret = AVERROR(EINVAL);
+        goto _ERROR;
+    }
+
+    // 1. 打开输入, 只打开一次
+    if ((ret = mmap_io_open_input(&ic, src, NULL, NULL)) < 0) {
+        av_log(NULL, AV_LOG_ERROR, "%s: %s\n", src, av_err2str(ret));
+        goto _ERROR;
+    }
+    if ((ret = avformat_find_stream_info(ic, NULL)) < 0) {
+        av_log(NULL, AV_LOG_ERROR, "%s: %s\n", src, av_err2str(ret));
+        goto _ERROR;
+    }
+
+    nb_streams = ic->nb_streams;
+
+    // 2. 每个输出: 流映射, 写头, 起写线程
+    for (i = 0; i < nb_outputs; i++) {
+        if ((ret = fanout_open(&outputs[i], ic)) < 0)
+            goto _ERROR;
+    }
+
+    // 3. 读一遍, 每个包分给映射了这个流的输出
+    pkt = av_packet_alloc();
+    if (!pkt) {
+        ret = AVERROR(ENOMEM);
+        goto _ERROR;
+    }
+    while ((ret = av_read_frame(ic, pkt)) >= 0) {
+        packets++;
+        for (j = 0; j < nb_outputs; j++) {
+            // 开头之后才冒出来的流不写
+            if (pkt->stream_index >= nb_streams || outputs[j].streams[pkt->stream_index].index < 0)
+                continue;
+            // 只加引用, 数据是共享的
+            if (!(ref = av_packet_clone(pkt))) {
+                ret = AVERROR(ENOMEM);
+                av_packet_unref(pkt);
+                goto _ERROR;
+            }
+            fanout_push(&outputs[j], ref);
+        }
+        av_packet_unref(pkt);
+    }
+    ret = ret == AVERROR_EOF ? 0 : ret;
+
+_ERROR:
+    // 4. 收尾: 每个写线程写完队列里的包和文件尾
+    for (i = 0; i < nb_outputs; i++) {
+        fanout_close(&outputs[i]);
+        if (outputs[i].packets)
+            av_log(NULL, AV_LOG_INFO, "%s: %"PRId64" packets, %"PRId64" bytes, queue full %"PRId64" times%s\n",
+                   outputs[i].filename, outputs[i].packets, outputs[i].bytes, outputs[i].full_waits,
+                   outputs[i].error ? ", failed" : "");
+        if (outputs[i].error && ret >= 0)
+            ret = outputs[i].error;
+    }
+    av_log(NULL, AV_LOG_INFO, "%s: %"PRId64" packets demuxed once for %d outputs\n", src, packets, nb_outputs);
+    av_packet_free(&pkt);
+    mmap_io_close_input(&ic);
+    av_free(outputs);
+    return ret < 0 ? -1 : 0;
+}
@@ -0,0 +1,3 @@
+#!/bin/bash
+
+clang -g -o encode_video encode_video.c ../common/async_writer.c `pkg-config --libs --cflags libavutil libavformat libavcodec` -lpthread
@@ -2,10 +2,12 @@
 #include <libavutil/opt.h>
 #include <libavcodec/avcodec.h>
 
+#include "../common/async_writer.h"
+
 
 // ./encode_video 6.1.h264 libx264
 
-static int encode(AVCodecContext *ctx, AVFrame *frame, AVPacket *pkt, FILE *out){
+static int encode(AVCodecContext *ctx, AVFrame *frame, AVPacket *pkt, AsyncWriter *out){
     int ret = -1;
 
     ret = avcodec_send_frame(ctx, frame);
@@ -22,8 +24,13 @@ static int encode(AVCodecContext *ctx, AVFrame *frame, AVPacket *pkt, FILE *out)
             return -1; //退出tkyc
         }
         
-        fwrite(pkt->data, 1, pkt->size, out);
+        // 交给写线程落盘, 编码不等磁盘
+        ret = async_writer_write(out, pkt->data, pkt->size);
         av_packet_unref(pkt);
+        if(ret < 0) {
+            av_log(NULL, AV_LOG_ERROR, "Failed to write packet: %s!\n", av_err2str(ret));
+            return -1;
+        }
     }
 _END:
     return 0;
@@ -33,7 +40,7 @@ int main(int argc, char* argv[]){
 
     int ret = -1;
 
-    FILE *f = NULL;
+    AsyncWriter *f = NULL;
 
     char *dst = NULL;
     char *codecName = NULL;
@@ -93,9 +100,9 @@ int main(int argc, char* argv[]){
     }
 
     //6. 创建输出文件
-    f = fopen(dst, "wb");
-    if(!f){
-        av_log(NULL, AV_LOG_ERROR, "Don't open file:%s", dst);
+    ret = async_writer_open(&f, dst, ASYNC_WRITER_PREALLOC);
+    if(ret < 0){
+        av_log(NULL, AV_LOG_ERROR, "Don't open file:%s: %s\n", dst, av_err2str(ret));
         goto _ERROR;
     }
 
@@ -172,7 +179,10 @@ _ERROR:
 
     //dst
     if(f){
-        fclose(f);
+        ret = async_writer_close(&f);
+        if(ret < 0) {
+            av_log(NULL, AV_LOG_ERROR, "Failed to write %s: %s\n", dst, av_err2str(ret));
+        }
     }
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,3 @@
+#!/bin/bash
+
+clang -g -o decode_video decode_video.c ../common/mmap_io.c ../common/probe_cache.c `pkg-config --libs --cflags libavutil libavformat libavcodec libswscale`
@@ -5,11 +5,17 @@
 #include <libavformat/avformat.h>
 #include <libavcodec/avcodec.h>
 #include <libswscale/swscale.h>
+#include <libavutil/time.h>
+
+#include "../common/mmap_io.h"
+#include "../common/probe_cache.h"
 
 #define WORD uint16_t
 #define DWORD uint32_t
 #define LONG int32_t
 
+static int64_t start_time;  // av_gettime_relative() 程序开始时间, 用于统计首帧耗时
+
 #pragma pack(2)
 typedef struct tagBITMAPFILEHEADER {
   WORD  bfType;
@@ -130,6 +136,10 @@ static int decode_write_frame(const char *outfilename, AVCodecContext *avctx,
             return -1;
         }
 
+        if (avctx->frame_number == 1)
+            fprintf(stderr, "time to first frame: %.1f ms\n",
+                    (av_gettime_relative() - start_time) / 1000.0);
+
         /* the picture is allocated by the decoder, no need to free it */
         snprintf(buf, sizeof(buf), "%s-%d.bmp", outfilename, avctx->frame_number);
         /*pgm_save(frame->data[0], frame->linesize[0],
@@ -145,6 +155,7 @@ int main(int argc, char **argv)
 {
     int ret;
     int idx;
+    int probe_flags = 0;
 
     const char *filename, *outfilename;
 
@@ -161,23 +172,29 @@ int main(int argc, char **argv)
     struct SwsContext *img_convert_ctx;
 
     if (argc <= 2) {
-        fprintf(stderr, "Usage: %s <input file> <output file>\n", argv[0]);
+        fprintf(stderr, "Usage: %s <input file> <output file> [-fast]\n", argv[0]);
         exit(0);
     }
     filename    = argv[1];
     outfilename = argv[2];
+    if (argc > 3 && !strcmp(argv[3], "-fast"))
+        probe_flags = PROBE_CACHE_FAST | PROBE_CACHE_STORE;
+
+    start_time = av_gettime_relative();
 
     /* open input file, and allocate format context */
-    if (avformat_open_input(&fmt_ctx, filename, NULL, NULL) < 0) {
+    if (mmap_io_open_input(&fmt_ctx, filename, NULL, NULL) < 0) {
         fprintf(stderr, "Could not open source file %s\n", filename);
         exit(1);
     }
 
-    /* retrieve stream information */
-    if (avformat_find_stream_info(fmt_ctx, NULL) < 0) {
+    /* retrieve stream information, -fast: bounded probing and the probe cache */
+    if ((ret = probe_cache_find_stream_info(fmt_ctx, filename, probe_flags)) < 0) {
         fprintf(stderr, "Could not find stream information\n");
         exit(1);
     }
+    fprintf(stderr, "opened %s in %.1f ms%s\n", filename,
+            (av_gettime_relative() - start_time) / 1000.0, ret > 0 ? " (probe cache)" : "");
 
     /* dump input information to stderr */
     //av_dump_format(fmt_ctx, 0, filename, 0);
@@ -253,7 +270,7 @@ int main(int argc, char **argv)
 
     decode_write_frame(outfilename, ctx, img_convert_ctx, frame, NULL);
 
-    avformat_close_input(&fmt_ctx);
+    mmap_io_close_input(&fmt_ctx);
 
     sws_freeContext(img_convert_ctx);
     avcodec_free_context(&ctx);
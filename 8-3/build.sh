@@ -1,3 +1,6 @@
 #!/bin/bash
 
-clang -g -o player player.c `pkg-config --libs --cflags libavutil libavformat libavcodec libswresample sdl2`
+# io_uring read-ahead (-io async) when liburing is installed, pread() threads otherwise
+URING=`pkg-config --exists liburing && echo "-DHAVE_LIBURING=1 $(pkg-config --libs --cflags liburing)"`
+
+clang -g -o player player.c ../common/async_io.c ../common/keyframe_index.c ../common/mmap_io.c ../common/probe_cache.c `pkg-config --libs --cflags libavutil libavformat libavcodec libswscale libswresample sdl2` -lpthread -lm $URING
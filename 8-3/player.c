@@ -1,21 +1,46 @@
+#include <stdatomic.h>
+#include <sys/resource.h>
+
 #include <SDL.h>
 
 #include <libavutil/avutil.h>
+#include <libavutil/cpu.h>
 #include <libavutil/fifo.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/opt.h>
+#include <libavutil/pixdesc.h>
 #include <libavutil/time.h>
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
 #include <libswscale/swscale.h>
 #include <libswresample/swresample.h>
 
-#define MAX_QUEUE_SIZE (5 * 1024 * 1024)
+#include "../common/async_io.h"
+#include "../common/keyframe_index.h"
+#include "../common/mmap_io.h"
+#include "../common/probe_cache.h"
+
+#define MAX_QUEUE_SIZE (15 * 1024 * 1024) /* memory budget shared by both packet queues */
+#define BUFFER_DURATION 2.0 /* seconds buffered per stream when the budget allows */
+#define MIN_FRAMES 25
+#define PACKET_QUEUE_CAPACITY 16384 /* must be a power of two */
+#define PACKET_POOL_SIZE 1024 /* must be a power of two */
+#define CACHE_LINE_SIZE 64
 #define SDL_AUDIO_BUFFER_SIZE 1024
 
-#define FF_REFRESH_EVENT (SDL_USEREVENT)
 #define FF_QUIT_EVENT (SDL_USEREVENT + 1)
 
+#define REFRESH_POLL_TIME 10000 /* us, longest sleep before SDL events are pumped again */
+#define REFRESH_SPIN_TIME 200   /* us, tail of a presentation wait that is spun */
+
 #define VIDEO_PICTURE_QUEUE_SIZE 3
 #define SAMPLE_QUEUE_SIZE 9
+
+/* alignment for planes we allocate ourselves (swscale output) */
+#define FRAME_POOL_ALIGN 64
+
+/* scale in the decode thread once the window shows at most this share of the source pixels */
+#define DOWNSCALE_THRESHOLD 0.5
 #define FRAME_QUEUE_SIZE FFMAX(SAMPLE_QUEUE_SIZE, VIDEO_PICTURE_QUEUE_SIZE)
 
 #define AV_SYNC_THRESHOLD 0.01
@@ -29,19 +54,74 @@ enum {
 
 typedef struct MyAVPacketList {
     AVPacket *pkt;
+    int serial;
 } MyAVPacketList;
 
+/*
+ * Recycled AVPacket shells. It runs the opposite way to the packet ring:
+ * the consumer returns emptied shells, the producer takes them back, so it
+ * is single-producer/single-consumer as well. A miss falls back to
+ * av_packet_alloc(), and shells returned to a full pool are freed.
+ */
+typedef struct PacketPool {
+    AVPacket **shells;
+    unsigned int mask;            ///< PACKET_POOL_SIZE - 1
+    char pad0[CACHE_LINE_SIZE];
+    atomic_uint windex;           ///< written by the queue consumer only
+    char pad1[CACHE_LINE_SIZE - sizeof(atomic_uint)];
+    atomic_uint rindex;           ///< written by the queue producer only
+    char pad2[CACHE_LINE_SIZE - sizeof(atomic_uint)];
+    int64_t hits;                 ///< producer only
+    int64_t misses;               ///< producer only
+    int64_t released;             ///< consumer only
+} PacketPool;
+
+/*
+ * Single-producer/single-consumer ring: read_thread is the only writer and
+ * the decoder (or the audio callback) is the only reader, so the hand-off
+ * only needs the two indices below. The mutex/cond pair is a parking spot
+ * used when one side has to sleep; it is never taken on the fast path.
+ *
+ * A seek can't flush the ring from the producer side; it bumps serial
+ * instead, and the consumer drops every packet stamped with an older one.
+ */
 typedef struct PacketQueue {
-    AVFifo *pkt_list;
-    int nb_packets;
-    int size;
-    int64_t duration;
+    MyAVPacketList *pkt_list;
+    unsigned int mask;            ///< PACKET_QUEUE_CAPACITY - 1
+    char pad0[CACHE_LINE_SIZE];
+    atomic_uint windex;           ///< written by the producer only
+    char pad1[CACHE_LINE_SIZE - sizeof(atomic_uint)];
+    atomic_uint rindex;           ///< written by the consumer only
+    char pad2[CACHE_LINE_SIZE - sizeof(atomic_uint)];
+    atomic_int nb_packets;
+    atomic_int size;
+    atomic_int_fast64_t duration;
+    atomic_int abort_request;
+    atomic_int serial;            ///< bumped by the producer on seek
+    atomic_int waiters;           ///< threads parked on cond
     SDL_mutex *mutex;
     SDL_cond *cond;
+    PacketPool pool;
+
+    /* limits, derived by read_thread from the observed bitrate */
+    AVRational time_base;
+    atomic_int max_size;
+    atomic_int_fast64_t max_duration; ///< in time_base units
+    int64_t default_duration;     ///< for packets that come without one
+    double bitrate;               ///< bytes per second, smoothed
+    int64_t rate_bytes;
+    int64_t rate_duration;
+
+    /* "space available": read_thread's continue_read_thread wait point */
+    atomic_int want_space;        ///< read_thread sleeps until this queue drains, WANT_SPACE_*
+    atomic_int_fast64_t space_signal_time; ///< when the consumer last woke it
+    SDL_mutex *space_mutex;
+    SDL_cond *space_cond;
 } PacketQueue;
 
 typedef struct Frame {
     AVFrame *frame;
+    int serial;           /* packet queue serial the frame was decoded from */
     double pts;           /* presentation timestamp for the frame */
     double duration;      /* estimated duration of the frame */
     int64_t pos;          /* byte position of the frame in the input file */
@@ -61,6 +141,36 @@ typedef struct FrameQueue {
     SDL_cond *cond;
 } FrameQueue;
 
+/*
+ * Backing store for the video decoder's get_buffer2: one AVBufferPool per
+ * plane, sized for the current format/resolution. Frames popped from
+ * pictq hand their planes back to the pool instead of freeing them.
+ */
+typedef struct FramePool {
+    AVBufferPool *pools[4];
+    int width, height;
+    enum AVPixelFormat format;
+    int linesize[4];
+    atomic_int_fast64_t gets;     ///< buffers handed to the decoder
+    atomic_int_fast64_t allocs;   ///< of which needed a fresh allocation
+    int reinits;
+} FramePool;
+
+/*
+ * Lock-free SPSC byte ring for decoded PCM: audio_thread writes, the SDL
+ * audio callback reads. Indices count bytes and wrap naturally.
+ */
+typedef struct AudioRing {
+    uint8_t *data;
+    unsigned int mask;
+    char pad0[CACHE_LINE_SIZE];
+    atomic_uint windex;           ///< written by audio_thread only
+    char pad1[CACHE_LINE_SIZE - sizeof(atomic_uint)];
+    atomic_uint rindex;           ///< written by the audio callback only
+    char pad2[CACHE_LINE_SIZE - sizeof(atomic_uint)];
+    atomic_uint discard_index;    ///< the reader skips everything before it
+} AudioRing;
+
 typedef struct VideoState {
 
   //for multi-media file
@@ -70,8 +180,11 @@ typedef struct VideoState {
   //sync
   int             av_sync_type;
 
-  double          audio_clock; ///< the time of have audio frame
-  double          frame_timer; ///< the time of have played video frame 
+  SDL_mutex       *audio_clock_mutex; ///< the three below change together
+  double          audio_clock; ///< pts at the end of the last frame sent to the ring
+  unsigned int    audio_clock_index; ///< ring write index that frame ends at
+  int             audio_clock_serial; ///< audioq serial audio_clock belongs to
+  double          frame_timer; ///< the time of have played video frame (monotonic clock)
   double          frame_last_pts;
   double          frame_last_delay;
 
@@ -85,14 +198,16 @@ typedef struct VideoState {
   AVStream        *audio_st;
   AVCodecContext  *audio_ctx;
   PacketQueue     audioq;
-  uint8_t         *audio_buf;
+  uint8_t         *audio_buf;      ///< resampler output, audio_thread only
   unsigned int    audio_buf_size;
-  unsigned int    audio_buf_index;
-  AVFrame         audio_frame;
-  AVPacket        audio_pkt;
-  uint8_t         *audio_pkt_data;
-  int             audio_pkt_size;
   struct SwrContext *audio_swr_ctx;
+  AudioRing       audio_ring;      ///< S16 PCM from audio_thread to the callback
+  atomic_int      audio_serial;    ///< audioq serial of the PCM being written
+  int             audio_bytes_per_sec;
+  SDL_Thread      *audio_tid;
+  int64_t         audio_callbacks;
+  int64_t         audio_underruns;
+  Uint64          audio_callback_max; ///< in SDL performance counter ticks
 
   //for video
   int             video_index;
@@ -100,18 +215,77 @@ typedef struct VideoState {
   AVCodecContext  *video_ctx;
   PacketQueue     videoq;
   AVPacket        video_pkt;
-  struct SwsContext *sws_ctx;
+  struct SwsContext *sws_ctx;      ///< decode thread only, see video_convert_frame
+  int             sws_src_w, sws_src_h;
+  enum AVPixelFormat sws_src_fmt;
+  int             sws_dst_w, sws_dst_h;
+  enum AVPixelFormat sws_dst_fmt;
+  FramePool       convert_pool;    ///< destination planes for converted frames
+  int64_t         frames_converted;
+  int64_t         frames_downscaled;
+  int64_t         convert_time;    ///< us spent in sws_scale_frame
 
   SDL_Texture     *texture;
 
   FrameQueue      pictq;
+  FramePool       frame_pool;
 
   int width, height, xleft, ytop;
+  atomic_uint     window_size;     ///< width << 16 | height, for the decode thread
+
+  int64_t         refresh_deadline; ///< av_gettime_relative() of the next refresh
+  int64_t         present_count;
+  int64_t         present_jitter_sum; ///< us between deadline and presentation
+  int64_t         present_jitter_max;
+
+  int64_t         frame_drops_late; ///< dropped because the next frame was already due
+  int64_t         frames_late;      ///< shown after their deadline
+  int             frame_timer_serial; ///< pictq serial frame_timer was started for
+
+  //seeking, requested by the event loop and carried out by read_thread
+  atomic_int      seek_req;        ///< set last, after the fields below
+  int             seek_precise;    ///< decode and discard up to the target
+  int64_t         seek_pos;        ///< AV_TIME_BASE units
+  int64_t         seek_rel;
+  double          seek_discard_pts; ///< precise seek target, in seconds
+  int             seek_discard_serial;
+  int64_t         seek_request_time; ///< av_gettime_relative(), 0 once the first frame is up
+  int             seek_from_serial;  ///< videoq serial when the seek was requested
+  int64_t         seeks;
+  int64_t         seek_latency_sum;
+  int64_t         seek_latency_max;
+  int64_t         frames_discarded_seek;
+  KeyframeIndex   *kfidx;          ///< read_thread only, NULL without a sidecar
+  SDL_Thread      *index_tid;      ///< builds the sidecar with -build_index
+  atomic_int      index_ready;
   
   SDL_Thread      *read_tid;
   SDL_Thread      *decode_tid;
 
+  //read_thread sleeps here on backpressure and at EOF
+  SDL_mutex       *wait_mutex;
+  SDL_cond        *continue_read_thread;
+  int64_t         read_waits;
+  int64_t         refill_latency_sum; ///< us from a consumer wakeup to read_thread resuming
+  int64_t         refill_latency_max;
+
   int             quit;
+  int             eof;             ///< read_thread has queued the drain packets
+  atomic_int      video_finished;  ///< the video decoder returned AVERROR_EOF
+  atomic_int      audio_finished;
+
+  //benchmark counters
+  int64_t         start_time;      ///< av_gettime_relative() at stream_open
+  int64_t         probe_done_time; ///< stream parameters known
+  int64_t         pkts_read;
+  int64_t         frames_decoded;
+  int64_t         video_pkts_sent;
+  int64_t         decoder_depth_sum;  ///< packets in the decoder when a frame comes out
+  int64_t         decoder_depth_max;
+  int64_t         frames_displayed;
+  int64_t         occupancy_samples;
+  int64_t         videoq_packets_sum, audioq_packets_sum, pictq_sum;
+  int             videoq_packets_max, audioq_packets_max;
 
 } VideoState;
 
@@ -125,20 +299,146 @@ static int screen_height = 0;
 
 static SDL_Window      *win;
 static SDL_Renderer    *renderer;
+static SDL_RendererInfo renderer_info = {0};
+
+/* decoder formats SDL can show without conversion */
+static const struct TextureFormatEntry {
+    enum AVPixelFormat format;
+    int texture_fmt;
+} sdl_texture_format_map[] = {
+    { AV_PIX_FMT_RGB8,           SDL_PIXELFORMAT_RGB332 },
+    { AV_PIX_FMT_RGB444,         SDL_PIXELFORMAT_RGB444 },
+    { AV_PIX_FMT_RGB555,         SDL_PIXELFORMAT_RGB555 },
+    { AV_PIX_FMT_BGR555,         SDL_PIXELFORMAT_BGR555 },
+    { AV_PIX_FMT_RGB565,         SDL_PIXELFORMAT_RGB565 },
+    { AV_PIX_FMT_BGR565,         SDL_PIXELFORMAT_BGR565 },
+    { AV_PIX_FMT_RGB24,          SDL_PIXELFORMAT_RGB24 },
+    { AV_PIX_FMT_BGR24,          SDL_PIXELFORMAT_BGR24 },
+    { AV_PIX_FMT_0RGB32,         SDL_PIXELFORMAT_RGB888 },
+    { AV_PIX_FMT_0BGR32,         SDL_PIXELFORMAT_BGR888 },
+    { AV_PIX_FMT_RGB32,          SDL_PIXELFORMAT_ARGB8888 },
+    { AV_PIX_FMT_RGB32_1,        SDL_PIXELFORMAT_RGBA8888 },
+    { AV_PIX_FMT_BGR32,          SDL_PIXELFORMAT_ABGR8888 },
+    { AV_PIX_FMT_BGR32_1,        SDL_PIXELFORMAT_BGRA8888 },
+    { AV_PIX_FMT_YUV420P,        SDL_PIXELFORMAT_IYUV },
+    { AV_PIX_FMT_YUVJ420P,       SDL_PIXELFORMAT_IYUV },
+    { AV_PIX_FMT_YUYV422,        SDL_PIXELFORMAT_YUY2 },
+    { AV_PIX_FMT_UYVY422,        SDL_PIXELFORMAT_UYVY },
+    { AV_PIX_FMT_NV12,           SDL_PIXELFORMAT_NV12 },
+    { AV_PIX_FMT_NV21,           SDL_PIXELFORMAT_NV21 },
+    { AV_PIX_FMT_NONE,           SDL_PIXELFORMAT_UNKNOWN },
+};
 
 static int is_full_screen = 0;
+static int64_t vsync_interval = 0; ///< us, set when the renderer presents on vsync
 static int screen_left = SDL_WINDOWPOS_CENTERED;
 static int screen_top = SDL_WINDOWPOS_CENTERED;
 
 static int av_sync_type = AV_SYNC_AUDIO_MASTER;
 
+static int display_disable = 0;
+static int audio_disable = 0;
+static int autoexit = 0;
+static int benchmark = 0;
+static int build_index = 0;
+static int probe_flags = 0; ///< PROBE_CACHE_FAST/PROBE_CACHE_STORE
+static enum { INPUT_IO_FILE, INPUT_IO_MMAP, INPUT_IO_ASYNC } input_io = INPUT_IO_MMAP;
+static int decoder_threads = 0; ///< 0: libavcodec's auto count, one per core up to its cap
+static int decoder_thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+
+static double buffer_duration = BUFFER_DURATION;
+static int64_t queue_memory_budget = MAX_QUEUE_SIZE;
+
+/* packet pool handling */
+static int packet_pool_init(PacketPool *pool)
+{
+    pool->shells = av_calloc(PACKET_POOL_SIZE, sizeof(*pool->shells));
+    if (!pool->shells)
+        return AVERROR(ENOMEM);
+    pool->mask = PACKET_POOL_SIZE - 1;
+    atomic_init(&pool->windex, 0);
+    atomic_init(&pool->rindex, 0);
+    pool->hits = pool->misses = pool->released = 0;
+    return 0;
+}
+
+/* producer side: take a blank shell, allocating one if the pool is dry */
+static AVPacket *packet_pool_get(PacketPool *pool)
+{
+    unsigned int rindex = atomic_load_explicit(&pool->rindex, memory_order_relaxed);
+    AVPacket *pkt;
+
+    if (atomic_load_explicit(&pool->windex, memory_order_acquire) == rindex) {
+        pool->misses++;
+        return av_packet_alloc();
+    }
+    pkt = pool->shells[rindex & pool->mask];
+    atomic_store_explicit(&pool->rindex, rindex + 1, memory_order_release);
+    pool->hits++;
+    return pkt;
+}
+
+/* consumer side: hand back a shell, which must already be unreferenced */
+static void packet_pool_put(PacketPool *pool, AVPacket *pkt)
+{
+    unsigned int windex = atomic_load_explicit(&pool->windex, memory_order_relaxed);
+
+    if (windex - atomic_load_explicit(&pool->rindex, memory_order_acquire) > pool->mask) {
+        pool->released++;
+        av_packet_free(&pkt);
+        return;
+    }
+    pool->shells[windex & pool->mask] = pkt;
+    atomic_store_explicit(&pool->windex, windex + 1, memory_order_release);
+}
+
+static void packet_pool_destroy(PacketPool *pool)
+{
+    unsigned int rindex = atomic_load(&pool->rindex);
+    unsigned int windex = atomic_load(&pool->windex);
+
+    if (!pool->shells)
+        return;
+    for (; rindex != windex; rindex++)
+        av_packet_free(&pool->shells[rindex & pool->mask]);
+    atomic_store(&pool->rindex, rindex);
+    av_freep(&pool->shells);
+}
+
+static void packet_pool_log_stats(PacketPool *pool, const char *name)
+{
+    int64_t total = pool->hits + pool->misses;
+
+    av_log(NULL, AV_LOG_INFO,
+           "%s packet pool: %"PRId64" hits, %"PRId64" misses (%.1f%% hit rate), %"PRId64" shells released\n",
+           name, pool->hits, pool->misses,
+           total ? 100.0 * pool->hits / total : 0.0, pool->released);
+}
+
 /* packet queue handling */
-static int packet_queue_init(PacketQueue *q)
+static int packet_queue_init(PacketQueue *q, SDL_mutex *space_mutex, SDL_cond *space_cond)
 {
     memset(q, 0, sizeof(PacketQueue));
-    q->pkt_list = av_fifo_alloc2(1, sizeof(MyAVPacketList), AV_FIFO_FLAG_AUTO_GROW);
+    q->pkt_list = av_calloc(PACKET_QUEUE_CAPACITY, sizeof(MyAVPacketList));
     if (!q->pkt_list)
         return AVERROR(ENOMEM);
+    if (packet_pool_init(&q->pool) < 0)
+        return AVERROR(ENOMEM);
+    q->mask = PACKET_QUEUE_CAPACITY - 1;
+    atomic_init(&q->windex, 0);
+    atomic_init(&q->rindex, 0);
+    atomic_init(&q->nb_packets, 0);
+    atomic_init(&q->size, 0);
+    atomic_init(&q->duration, 0);
+    atomic_init(&q->abort_request, 0);
+    atomic_init(&q->serial, 0);
+    atomic_init(&q->waiters, 0);
+    atomic_init(&q->max_size, queue_memory_budget / 2);
+    atomic_init(&q->max_duration, INT64_MAX);
+    atomic_init(&q->want_space, 0);
+    atomic_init(&q->space_signal_time, 0);
+    q->space_mutex = space_mutex;
+    q->space_cond = space_cond;
     q->mutex = SDL_CreateMutex();
     if (!q->mutex) {
         av_log(NULL, AV_LOG_FATAL, "SDL_CreateMutex(): %s\n", SDL_GetError());
@@ -152,21 +452,106 @@ static int packet_queue_init(PacketQueue *q)
     return 0;
 }
 
-static int packet_queue_put_private(PacketQueue *q, AVPacket *pkt)
+/*
+ * Wake whoever is parked on the queue, only paying for the lock if someone
+ * is. Called right after an index store; the fence keeps that store from
+ * being ordered after the waiters load (store-buffer reordering), the other
+ * half of the handshake in packet_queue_park().
+ */
+static void packet_queue_wake(PacketQueue *q)
 {
-    MyAVPacketList pkt1;
-    int ret;
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load(&q->waiters)) {
+        SDL_LockMutex(q->mutex);
+        SDL_CondBroadcast(q->cond);
+        SDL_UnlockMutex(q->mutex);
+    }
+}
 
-    pkt1.pkt = pkt;
+/* MIN_FRAMES and the buffer duration queued (any number of packets without durations) */
+static int packet_queue_has_enough(PacketQueue *q)
+{
+    int64_t duration = atomic_load(&q->duration);
 
-    ret = av_fifo_write(q->pkt_list, &pkt1, 1);
-    if (ret < 0)
-        return ret;
-    q->nb_packets++;
-    q->size += pkt1.pkt->size + sizeof(pkt1);
-    q->duration += pkt1.pkt->duration;
+    return atomic_load(&q->abort_request) ||
+           (atomic_load(&q->nb_packets) > MIN_FRAMES &&
+            (!duration || duration >= atomic_load(&q->max_duration)));
+}
+
+enum {
+    WANT_SPACE_SIZE = 1,  ///< read_thread stopped on the memory budget
+    WANT_SPACE_FRAMES,    ///< read_thread stopped with every stream having enough
+};
+
+/* below three quarters of the limit read_thread stopped on, so refills come in batches */
+static int packet_queue_is_low(PacketQueue *q, int want)
+{
+    if (want == WANT_SPACE_SIZE)
+        return atomic_load(&q->size) <= atomic_load(&q->max_size) / 4 * 3;
+    return atomic_load(&q->nb_packets) <= MIN_FRAMES ||
+           atomic_load(&q->duration) <= atomic_load(&q->max_duration) / 4 * 3;
+}
+
+/* consumer side: wake read_thread once a queue it is waiting on has drained */
+static void packet_queue_signal_space(PacketQueue *q)
+{
+    int want = atomic_load(&q->want_space);
+
+    if (!want || !packet_queue_is_low(q, want))
+        return;
+    if (atomic_exchange(&q->want_space, 0)) {
+        atomic_store(&q->space_signal_time, av_gettime_relative());
+        SDL_LockMutex(q->space_mutex);
+        SDL_CondSignal(q->space_cond);
+        SDL_UnlockMutex(q->space_mutex);
+    }
+}
+
+/*
+ * Park until 'full' (non-zero: wait for space, zero: wait for data) stops
+ * being true. The waiter count is published, then a full fence, then the
+ * ring is re-checked; packet_queue_wake() fences between its index store
+ * and the waiters load. With both fences at least one side sees the other:
+ * either we see the new index, or the waker sees waiters != 0 and
+ * broadcasts under the mutex we hold until SDL_CondWait() releases it.
+ */
+static void packet_queue_park(PacketQueue *q, int full)
+{
+    unsigned int used;
+
+    SDL_LockMutex(q->mutex);
+    atomic_fetch_add(&q->waiters, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+    used = atomic_load(&q->windex) - atomic_load(&q->rindex);
+    if (!atomic_load(&q->abort_request) &&
+        (full ? used > q->mask : used == 0))
+        SDL_CondWait(q->cond, q->mutex);
+    atomic_fetch_sub(&q->waiters, 1);
+    SDL_UnlockMutex(q->mutex);
+}
+
+/* producer side only */
+static int packet_queue_put_private(PacketQueue *q, AVPacket *pkt)
+{
+    MyAVPacketList *pkt1;
+    unsigned int windex;
+
+    windex = atomic_load_explicit(&q->windex, memory_order_relaxed);
+    while (windex - atomic_load_explicit(&q->rindex, memory_order_acquire) > q->mask) {
+        if (atomic_load(&q->abort_request))
+            return -1;
+        packet_queue_park(q, 1);
+    }
+
+    pkt1 = &q->pkt_list[windex & q->mask];
+    pkt1->pkt = pkt;
+    pkt1->serial = atomic_load_explicit(&q->serial, memory_order_relaxed);
+    atomic_fetch_add(&q->nb_packets, 1);
+    atomic_fetch_add(&q->size, pkt->size + (int)sizeof(*pkt1));
+    atomic_fetch_add(&q->duration, pkt->duration);
     /* XXX: should duplicate packet data in DV case */
-    SDL_CondSignal(q->cond);
+    atomic_store_explicit(&q->windex, windex + 1, memory_order_release);
+    packet_queue_wake(q);
     return 0;
 }
 
@@ -175,16 +560,14 @@ static int packet_queue_put(PacketQueue *q, AVPacket *pkt)
     AVPacket *pkt1;
     int ret;
 
-    pkt1 = av_packet_alloc();
+    pkt1 = packet_pool_get(&q->pool);
     if (!pkt1) {
         av_packet_unref(pkt);
         return -1;
     }
     av_packet_move_ref(pkt1, pkt);
 
-    SDL_LockMutex(q->mutex);
     ret = packet_queue_put_private(q, pkt1);
-    SDL_UnlockMutex(q->mutex);
 
     if (ret < 0)
         av_packet_free(&pkt1);
@@ -192,51 +575,91 @@ static int packet_queue_put(PacketQueue *q, AVPacket *pkt)
     return ret;
 }
 
-/* return < 0 if aborted, 0 if no packet and > 0 if packet.  */
-static int packet_queue_get(PacketQueue *q, AVPacket *pkt, int block)
+/* an empty packet tells the decoder to drain */
+static int packet_queue_put_nullpacket(PacketQueue *q, AVPacket *pkt, int stream_index)
 {
-    MyAVPacketList pkt1;
-    int ret;
+    pkt->stream_index = stream_index;
+    return packet_queue_put(q, pkt);
+}
 
-    SDL_LockMutex(q->mutex);
+/* producer side: start a new serial, everything queued so far becomes stale */
+static int packet_queue_start_serial(PacketQueue *q)
+{
+    return atomic_fetch_add(&q->serial, 1) + 1;
+}
+
+/* return < 0 if aborted, 0 if no packet and > 0 if packet.  */
+static int packet_queue_get(PacketQueue *q, AVPacket *pkt, int block, int *serial)
+{
+    MyAVPacketList *pkt1;
+    unsigned int rindex;
 
+    rindex = atomic_load_explicit(&q->rindex, memory_order_relaxed);
     for (;;) {
-        if (av_fifo_read(q->pkt_list, &pkt1, 1) >= 0) {
-            q->nb_packets--;
-            q->size -= pkt1.pkt->size + sizeof(pkt1);
-            q->duration -= pkt1.pkt->duration;
-            av_packet_move_ref(pkt, pkt1.pkt);
-            av_packet_free(&pkt1.pkt);
-            ret = 1;
+        if (atomic_load(&q->abort_request))
+            return -1;
+        if (atomic_load_explicit(&q->windex, memory_order_acquire) != rindex)
             break;
-        } else if (!block) {
-            ret = 0;
-            break;
-        } else {
-            SDL_CondWait(q->cond, q->mutex);
-        }
+        if (!block)
+            return 0;
+        packet_queue_park(q, 0);
     }
-    SDL_UnlockMutex(q->mutex);
-    return ret;
+
+    pkt1 = &q->pkt_list[rindex & q->mask];
+    atomic_fetch_sub(&q->nb_packets, 1);
+    atomic_fetch_sub(&q->size, pkt1->pkt->size + (int)sizeof(*pkt1));
+    atomic_fetch_sub(&q->duration, pkt1->pkt->duration);
+    av_packet_move_ref(pkt, pkt1->pkt);
+    if (serial)
+        *serial = pkt1->serial;
+    packet_pool_put(&q->pool, pkt1->pkt);
+    pkt1->pkt = NULL;
+    atomic_store_explicit(&q->rindex, rindex + 1, memory_order_release);
+    packet_queue_wake(q);
+    packet_queue_signal_space(q);
+    return 1;
 }
 
+/* consumer side only, or once both threads have stopped */
 static void packet_queue_flush(PacketQueue *q)
 {
-    MyAVPacketList pkt1;
+    unsigned int rindex = atomic_load(&q->rindex);
+    unsigned int windex = atomic_load(&q->windex);
+
+    for (; rindex != windex; rindex++) {
+        MyAVPacketList *pkt1 = &q->pkt_list[rindex & q->mask];
+        atomic_fetch_sub(&q->nb_packets, 1);
+        atomic_fetch_sub(&q->size, pkt1->pkt->size + (int)sizeof(*pkt1));
+        atomic_fetch_sub(&q->duration, pkt1->pkt->duration);
+        av_packet_unref(pkt1->pkt);
+        packet_pool_put(&q->pool, pkt1->pkt);
+        pkt1->pkt = NULL;
+    }
+    atomic_store(&q->rindex, rindex);
+    packet_queue_wake(q);
+    packet_queue_signal_space(q);
+}
 
+static void packet_queue_abort(PacketQueue *q)
+{
     SDL_LockMutex(q->mutex);
-    while (av_fifo_read(q->pkt_list, &pkt1, 1) >= 0)
-        av_packet_free(&pkt1.pkt);
-    q->nb_packets = 0;
-    q->size = 0;
-    q->duration = 0;
+    atomic_store(&q->abort_request, 1);
+    SDL_CondBroadcast(q->cond);
     SDL_UnlockMutex(q->mutex);
+
+    if (q->space_cond) {
+        SDL_LockMutex(q->space_mutex);
+        SDL_CondSignal(q->space_cond);
+        SDL_UnlockMutex(q->space_mutex);
+    }
 }
 
 static void packet_queue_destroy(PacketQueue *q)
 {
-    packet_queue_flush(q);
-    av_fifo_freep2(&q->pkt_list);
+    if (q->pkt_list)
+        packet_queue_flush(q);
+    av_freep(&q->pkt_list);
+    packet_pool_destroy(&q->pool);
     SDL_DestroyMutex(q->mutex);
     SDL_DestroyCond(q->cond);
 }
@@ -283,6 +706,20 @@ static Frame *frame_queue_peek(FrameQueue *fq)
     return &fq->queue[fq->rindex];
 }
 
+static Frame *frame_queue_peek_next(FrameQueue *fq)
+{
+    return &fq->queue[(fq->rindex + 1) % VIDEO_PICTURE_QUEUE_SIZE];
+}
+
+static int frame_queue_nb_remaining(FrameQueue *fq)
+{
+    int size;
+    SDL_LockMutex(fq->mutex);
+    size = fq->size;
+    SDL_UnlockMutex(fq->mutex);
+    return size;
+}
+
 static Frame *frame_queue_peek_writable(FrameQueue *fq)
 {
     /* wait until we have space to put a new frame */
@@ -328,19 +765,105 @@ static void frame_queue_abort(FrameQueue *fq)
     SDL_UnlockMutex(fq->mutex);
 }
 
+/* audio ring handling */
+static int audio_ring_init(AudioRing *r, unsigned int min_size)
+{
+    unsigned int size = 1;
+
+    while (size < min_size)
+        size <<= 1;
+    r->data = av_malloc(size);
+    if (!r->data)
+        return AVERROR(ENOMEM);
+    r->mask = size - 1;
+    atomic_init(&r->windex, 0);
+    atomic_init(&r->rindex, 0);
+    atomic_init(&r->discard_index, 0);
+    return 0;
+}
+
+static void audio_ring_destroy(AudioRing *r)
+{
+    av_freep(&r->data);
+}
+
+/* where the next read starts: past anything discarded the reader hasn't skipped yet */
+static unsigned int audio_ring_read_index(AudioRing *r)
+{
+    unsigned int rindex = atomic_load_explicit(&r->rindex, memory_order_acquire);
+    unsigned int discard = atomic_load_explicit(&r->discard_index, memory_order_acquire);
+
+    return (int)(discard - rindex) > 0 ? discard : rindex;
+}
+
+/* bytes that will still be played */
+static unsigned int audio_ring_fill(AudioRing *r)
+{
+    unsigned int rindex = audio_ring_read_index(r);
+    unsigned int windex = atomic_load_explicit(&r->windex, memory_order_acquire);
+
+    return (int)(windex - rindex) > 0 ? windex - rindex : 0;
+}
+
+/* copy up to len bytes in one or two chunks around the wrap point */
+static int audio_ring_write(AudioRing *r, const uint8_t *buf, int len)
+{
+    unsigned int windex = atomic_load_explicit(&r->windex, memory_order_relaxed);
+    unsigned int space = r->mask + 1 - (windex - atomic_load_explicit(&r->rindex, memory_order_acquire));
+    unsigned int off = windex & r->mask;
+    unsigned int n = FFMIN((unsigned int)len, space);
+    unsigned int first = FFMIN(n, r->mask + 1 - off);
+
+    memcpy(r->data + off, buf, first);
+    memcpy(r->data, buf + first, n - first);
+    atomic_store_explicit(&r->windex, windex + n, memory_order_release);
+    return n;
+}
+
+/* writer side: drop everything written so far, it is skipped on the next read */
+static void audio_ring_discard(AudioRing *r)
+{
+    atomic_store_explicit(&r->discard_index,
+                          atomic_load_explicit(&r->windex, memory_order_relaxed),
+                          memory_order_release);
+}
+
+static int audio_ring_read(AudioRing *r, uint8_t *buf, int len)
+{
+    unsigned int rindex = atomic_load_explicit(&r->rindex, memory_order_relaxed);
+    unsigned int discard = atomic_load_explicit(&r->discard_index, memory_order_acquire);
+
+    if ((int)(discard - rindex) > 0)
+        rindex = discard;
+    unsigned int fill = atomic_load_explicit(&r->windex, memory_order_acquire) - rindex;
+    unsigned int off = rindex & r->mask;
+    unsigned int n = FFMIN((unsigned int)len, fill);
+    unsigned int first = FFMIN(n, r->mask + 1 - off);
+
+    memcpy(buf, r->data + off, first);
+    memcpy(buf + first, r->data, n - first);
+    atomic_store_explicit(&r->rindex, rindex + n, memory_order_release);
+    return n;
+}
+
 double get_audio_clock(VideoState *is) {
   double pts;
-  int hw_buf_size, bytes_per_sec, n;
-  
-  pts = is->audio_clock; /* maintained in the audio thread */
-  hw_buf_size = is->audio_buf_size - is->audio_buf_index;
-  bytes_per_sec = 0;
-  n = is->audio_ctx->ch_layout.nb_channels * 2;
-  if(is->audio_st) {
-    bytes_per_sec = is->audio_ctx->sample_rate * n;
-  }
-  if(bytes_per_sec) {
-    pts -= (double)hw_buf_size / bytes_per_sec;
+  unsigned int index;
+  int serial, pending;
+
+  SDL_LockMutex(is->audio_clock_mutex);
+  pts = is->audio_clock;
+  index = is->audio_clock_index;
+  serial = is->audio_clock_serial;
+  SDL_UnlockMutex(is->audio_clock_mutex);
+
+  /* maintained in the audio thread, meaningless until it catches up with a seek */
+  if(serial != atomic_load(&is->audioq.serial))
+    return NAN;
+  //subtract what is still to be played before the end of that frame
+  pending = (int)(index - audio_ring_read_index(&is->audio_ring));
+  if(is->audio_bytes_per_sec && pending > 0) {
+    pts -= (double)pending / is->audio_bytes_per_sec;
   }
   return pts;
 }
@@ -422,140 +945,229 @@ static void set_default_window_size(int width, int height, AVRational sar)
     default_height = rect.h;
 }
 
-int audio_decode_frame(VideoState *is) {
+/* convert a decoded frame to interleaved S16 in is->audio_buf, return its size */
+static int audio_resample(VideoState *is, AVFrame *frame) {
 
-  int ret = -1;
   int data_size = 0;
+  int len2;
+
+  if(!is->audio_swr_ctx && frame->format != AV_SAMPLE_FMT_S16) {
+    AVChannelLayout in_ch_layout, out_ch_layout;
+    av_channel_layout_copy(&in_ch_layout, &is->audio_ctx->ch_layout);
+    av_channel_layout_copy(&out_ch_layout, &in_ch_layout);
+
+    swr_alloc_set_opts2(&is->audio_swr_ctx,
+                        &out_ch_layout,
+                        AV_SAMPLE_FMT_S16,
+                        is->audio_ctx->sample_rate,
+                        &in_ch_layout,
+                        is->audio_ctx->sample_fmt,
+                        is->audio_ctx->sample_rate,
+                        0,
+                        NULL);
+    if(!is->audio_swr_ctx || swr_init(is->audio_swr_ctx) < 0) {
+      av_log(is->audio_ctx, AV_LOG_ERROR, "Failed to initialize the resampler!\n");
+      swr_free(&is->audio_swr_ctx);
+      return -1;
+    }
+  }
 
-  int len1, len2;
+  if(is->audio_swr_ctx) {
+    const uint8_t **in = (const uint8_t **)frame->extended_data;
+    uint8_t **out = &is->audio_buf;
+    int out_count = frame->nb_samples + 256;
+    int out_size  = av_samples_get_buffer_size(NULL, frame->ch_layout.nb_channels, out_count, AV_SAMPLE_FMT_S16, 0);
+
+    av_fast_malloc(&is->audio_buf, &is->audio_buf_size, out_size);
+    if(!is->audio_buf)
+      return AVERROR(ENOMEM);
+
+    len2 = swr_convert(is->audio_swr_ctx, out, out_count, in, frame->nb_samples);
+    if(len2 < 0)
+      return len2;
+    data_size = len2 * frame->ch_layout.nb_channels * av_get_bytes_per_sample(AV_SAMPLE_FMT_S16);
+  } else {
+    //already S16, just copy it out
+    data_size = frame->nb_samples * frame->ch_layout.nb_channels * av_get_bytes_per_sample(AV_SAMPLE_FMT_S16);
+    av_fast_malloc(&is->audio_buf, &is->audio_buf_size, data_size);
+    if(!is->audio_buf)
+      return AVERROR(ENOMEM);
+    memcpy(is->audio_buf, frame->data[0], data_size);
+  }
+  return data_size;
+}
+
+/* push len bytes into the ring, sleeping for roughly the time the callback needs to make room */
+static int audio_ring_write_all(VideoState *is, const uint8_t *buf, int len) {
+  int n;
 
   for(;;) {
+    n = audio_ring_write(&is->audio_ring, buf, len);
+    buf += n;
+    len -= n;
+    if(len <= 0)
+      return 0;
+    if(atomic_load(&is->audioq.abort_request))
+      return -1;
+    if(atomic_load(&is->audio_serial) != atomic_load(&is->audioq.serial))
+      return 0; /* seeked away, the rest is stale */
+    av_usleep(av_clip64((int64_t)len * 1000000 / is->audio_bytes_per_sec, 1000, 10000));
+  }
+}
+
+/* decode and resample off the audio device thread, so the callback only copies */
+int audio_thread(void *arg) {
+
+  int ret = 0;
+  int data_size;
+  int serial = 0;
+  double pts;
+
+  VideoState *is = (VideoState *)arg;
+  AVFrame *frame = av_frame_alloc();
+  AVPacket *pkt = av_packet_alloc();
 
-     //从队列中读取数据
-    if(packet_queue_get(&is->audioq, &is->audio_pkt, 0) <= 0) {
-      av_log(NULL, AV_LOG_ERROR, "Could not get packet from audio queue!\n");
+  if(!frame || !pkt) {
+    ret = AVERROR(ENOMEM);
+    goto __OUT;
+  }
+
+  for(;;) {
+    //从队列中读取数据
+    if(packet_queue_get(&is->audioq, pkt, 1, &serial) < 0) {
       break;
     }
+    if(serial != atomic_load(&is->audioq.serial)) {
+      //queued before a seek
+      av_packet_unref(pkt);
+      continue;
+    }
+    if(serial != atomic_load(&is->audio_serial)) {
+      //first packet after a seek: forget the decoder state and the queued PCM
+      avcodec_flush_buffers(is->audio_ctx);
+      audio_ring_discard(&is->audio_ring);
+      atomic_store(&is->audio_serial, serial);
+      atomic_store(&is->audio_finished, 0);
+    }
 
-    ret = avcodec_send_packet(is->audio_ctx, &is->audio_pkt);
-    av_packet_unref(&is->audio_pkt);
+    ret = avcodec_send_packet(is->audio_ctx, pkt);
+    av_packet_unref(pkt);
     if(ret < 0) {
       av_log(is->audio_ctx, AV_LOG_ERROR, "Failed to send pkt to decoder!\n");
-      goto __OUT;
+      continue;
     }
-  
+
     while(ret >= 0) {
-      ret = avcodec_receive_frame(is->audio_ctx, &is->audio_frame);
-      if(ret == AVERROR(EAGAIN) || ret == AVERROR_EOF){
+      ret = avcodec_receive_frame(is->audio_ctx, frame);
+      if(ret == AVERROR_EOF){
+        atomic_store(&is->audio_finished, 1);
+        avcodec_flush_buffers(is->audio_ctx);
+        break;
+      } else if(ret == AVERROR(EAGAIN)){
         break;
       } else if( ret < 0) {
         av_log(is->audio_ctx, AV_LOG_ERROR, "Failed to receive frame from decoder!\n");
-        goto __OUT;
+        break;
       }
 
-      if(!is->audio_swr_ctx) {
-                AVChannelLayout in_ch_layout, out_ch_layout;
-                av_channel_layout_copy(&in_ch_layout, &is->audio_ctx->ch_layout);
-                av_channel_layout_copy(&out_ch_layout, &in_ch_layout);
-
-                if(is->audio_ctx->sample_fmt != AV_SAMPLE_FMT_S16){
-                    swr_alloc_set_opts2(&is->audio_swr_ctx,
-                                &out_ch_layout,
-                                AV_SAMPLE_FMT_S16,
-                                is->audio_ctx->sample_rate,
-                                &in_ch_layout,
-                                is->audio_ctx->sample_fmt,
-                                is->audio_ctx->sample_rate, 
-                                0, 
-                                NULL);
-                    swr_init(is->audio_swr_ctx);
-                }
-            
-            }
-
-      if(is->audio_swr_ctx){
-
-        const uint8_t **in = (const uint8_t **)is->audio_frame.extended_data;
-        uint8_t **out = &is->audio_buf;
-        int out_count = is->audio_frame.nb_samples + 256;
+      pts = frame->pts == AV_NOPTS_VALUE ? NAN : frame->pts * av_q2d(is->audio_st->time_base);
+      if(serial == is->seek_discard_serial && !isnan(pts) &&
+         pts + (double)frame->nb_samples / frame->sample_rate < is->seek_discard_pts) {
+        //precise seek, still before the target
+        av_frame_unref(frame);
+        continue;
+      }
 
-	      //data_size = 2 * 2 * is->aframe->nb_samples;
-        int out_size  = av_samples_get_buffer_size(NULL, is->audio_frame.ch_layout.nb_channels, out_count, AV_SAMPLE_FMT_S16, 0);
-        av_fast_malloc(&is->audio_buf, &is->audio_buf_size, out_size);
+      data_size = audio_resample(is, frame);
 
-        //assert(data_size <= buf_size);
-        len2 = swr_convert(is->audio_swr_ctx,
-                    out,
-                    out_count, //MAX_AUDIO_FRAME_SIZE*3/2,
-                    in,
-                    is->audio_frame.nb_samples);
+      //the clock is the pts at the end of this frame, which the ring reaches once it is written;
+      //set before the data goes in so a reader never pairs the new fill with the old clock
+      SDL_LockMutex(is->audio_clock_mutex);
+      is->audio_clock = pts + (double) frame->nb_samples / frame->sample_rate;
+      is->audio_clock_index = atomic_load_explicit(&is->audio_ring.windex, memory_order_relaxed) +
+                              FFMAX(data_size, 0);
+      is->audio_clock_serial = serial;
+      SDL_UnlockMutex(is->audio_clock_mutex);
 
-        //输出
-        data_size = len2 * is->audio_frame.ch_layout.nb_channels * av_get_bytes_per_sample(AV_SAMPLE_FMT_S16);
-        //av_log(NULL, AV_LOG_DEBUG, "data_size:%d, compare:%d\n", data_size, 2 * 2 * is->audio_frame.nb_samples);
+      if(data_size > 0 && audio_ring_write_all(is, is->audio_buf, data_size) < 0) {
+        av_frame_unref(frame);
+        goto __OUT;
       }
-
-      if (!isnan(is->audio_frame.pts))
-        is->audio_clock = is->audio_frame.pts + (double) is->audio_frame.nb_samples / is->audio_frame.sample_rate;
-      else
-        is->audio_clock = NAN;
-      //release pkt
-      av_frame_unref(&is->audio_frame);
-
-      return data_size;
+      //release frame
+      av_frame_unref(frame);
     }
   }
+  ret = 0;
 
 __OUT:
+  av_frame_free(&frame);
+  av_packet_free(&pkt);
   return ret;
 }
 
+/* runs on the audio device thread: no decoding, no locks, only a copy out of the ring */
 void sdl_audio_callback(void *userdata, Uint8 *stream, int len) {
 
   VideoState *is = (VideoState *)userdata;
+  Uint64 start = SDL_GetPerformanceCounter();
+  Uint64 elapsed;
   int len1 = 0;
-  int audio_size = 0;
-
-  while(len > 0) {
-
-    if(is->audio_buf_index >= is->audio_buf_size) {
-      /* We have already sent all our data; get more */
-      audio_size = audio_decode_frame(is);
-      if(audio_size < 0) {
-	      /* If error, output silence */
-	      is->audio_buf_size = SDL_AUDIO_BUFFER_SIZE; 
-        is->audio_buf = NULL;
-      } else {
-	      is->audio_buf_size = audio_size;
-      }
-      is->audio_buf_index = 0;
-    }
-
-    len1 = is->audio_buf_size - is->audio_buf_index;
-    if(len1 > len)
-      len1 = len;
 
-    if(is->audio_buf)
-      memcpy(stream, (uint8_t *)is->audio_buf + is->audio_buf_index, len1);
-    else 
-      memset(stream, 0, len1);
-    len -= len1;
-    stream += len1;
-    is->audio_buf_index += len1;
+  /* while a seek is in flight the ring only holds stale PCM */
+  if(atomic_load(&is->audio_serial) == atomic_load(&is->audioq.serial)) {
+    len1 = audio_ring_read(&is->audio_ring, stream, len);
+    if(len1 < len)
+      is->audio_underruns++; /* the decoder fell behind */
   }
+  if(len1 < len)
+    memset(stream + len1, 0, len - len1);
+
+  is->audio_callbacks++;
+  elapsed = SDL_GetPerformanceCounter() - start;
+  if(elapsed > is->audio_callback_max)
+    is->audio_callback_max = elapsed;
 }
 
-static Uint32 sdl_refresh_timer_cb(Uint32 interval, void *opaque) {
-  SDL_Event event;
-  event.type = FF_REFRESH_EVENT;
-  event.user.data1 = opaque;
-  SDL_PushEvent(&event);
-  return 0; /* 0 means stop timer */
+/* schedule a video refresh in 'delay' seconds */
+static void schedule_refresh(VideoState *is, double delay) {
+  is->refresh_deadline = av_gettime_relative() + (int64_t)(delay * 1000000.0);
+  /* with vsync, present blocks until the next vblank, so aim half a
+     refresh early and let the picture land on the vblank nearest its pts */
+  if(vsync_interval && delay > 0)
+    is->refresh_deadline -= vsync_interval / 2;
 }
 
-/* schedule a video refresh in 'delay' ms */
-static void schedule_refresh(VideoState *is, int delay) {
-  SDL_AddTimer(delay, sdl_refresh_timer_cb, is);
+/*
+ * Sleep on the monotonic clock until refresh_deadline. The bulk is an
+ * av_usleep(), the last REFRESH_SPIN_TIME is spun for sub-millisecond
+ * precision. While pictq is empty we wait on its condition instead, so
+ * a freshly decoded picture is refreshed immediately.
+ */
+static void presentation_wait(VideoState *is) {
+  int64_t remaining = is->refresh_deadline - av_gettime_relative();
+
+  if(remaining <= 0)
+    return;
+
+  if(is->video_st && frame_queue_nb_remaining(&is->pictq) == 0) {
+    SDL_LockMutex(is->pictq.mutex);
+    if(is->pictq.size == 0 && !is->pictq.abort)
+      SDL_CondWaitTimeout(is->pictq.cond, is->pictq.mutex,
+                          FFMIN(remaining, REFRESH_POLL_TIME) / 1000 + 1);
+    if(is->pictq.size > 0)
+      is->refresh_deadline = av_gettime_relative();
+    SDL_UnlockMutex(is->pictq.mutex);
+    return;
+  }
+
+  if(remaining > REFRESH_POLL_TIME) {
+    av_usleep(REFRESH_POLL_TIME);
+    return;
+  }
+  if(remaining > REFRESH_SPIN_TIME)
+    av_usleep(remaining - REFRESH_SPIN_TIME);
+  while(av_gettime_relative() < is->refresh_deadline)
+    ;
 }
 
 static int video_open(VideoState *is)
@@ -577,52 +1189,151 @@ static int video_open(VideoState *is)
 
     is->width  = w;
     is->height = h;
+    atomic_store(&is->window_size, (unsigned)w << 16 | (h & 0xffff));
+
+    return 0;
+}
 
+/*
+ * SDL texture format for a decoder format, if the renderer takes it as is.
+ * Without a renderer (-nodisp) every mapped format counts as displayable.
+ */
+static Uint32 get_sdl_pix_fmt(int format)
+{
+    int i, j;
+
+    for (i = 0; sdl_texture_format_map[i].format != AV_PIX_FMT_NONE; i++) {
+        if (sdl_texture_format_map[i].format != format)
+            continue;
+        if (!renderer)
+            return sdl_texture_format_map[i].texture_fmt;
+        for (j = 0; j < renderer_info.num_texture_formats; j++)
+            if (renderer_info.texture_formats[j] == sdl_texture_format_map[i].texture_fmt)
+                return sdl_texture_format_map[i].texture_fmt;
+    }
+    return SDL_PIXELFORMAT_UNKNOWN;
+}
+
+static int realloc_texture(SDL_Texture **texture, Uint32 new_format, int new_width, int new_height)
+{
+    Uint32 format;
+    int access, w, h;
+
+    if (!*texture || SDL_QueryTexture(*texture, &format, &access, &w, &h) < 0 ||
+        new_width != w || new_height != h || new_format != format) {
+        if (*texture)
+            SDL_DestroyTexture(*texture);
+        if (!(*texture = SDL_CreateTexture(renderer, new_format, SDL_TEXTUREACCESS_STREAMING, new_width, new_height)))
+            return -1;
+        av_log(NULL, AV_LOG_VERBOSE, "Created %dx%d texture with %s.\n",
+               new_width, new_height, SDL_GetPixelFormatName(new_format));
+    }
     return 0;
 }
 
+/*
+ * One copy per plane from the decoded frame into texture memory. Planar
+ * and semi-planar YUV go through SDL's YUV/NV update calls, packed
+ * formats are written straight into the locked texture. The decoder
+ * can't render into the texture itself: it keeps reading its output
+ * frames as references, and a lock only lasts until the next upload.
+ */
+static int upload_texture(SDL_Texture **tex, AVFrame *frame)
+{
+    Uint32 sdl_pix_fmt = get_sdl_pix_fmt(frame->format);
+    void *pixels;
+    int pitch, ret = 0;
+
+    if (sdl_pix_fmt == SDL_PIXELFORMAT_UNKNOWN)
+        return AVERROR(ENOSYS);
+    if (realloc_texture(tex, sdl_pix_fmt, frame->width, frame->height) < 0)
+        return -1;
+
+    switch (sdl_pix_fmt) {
+    case SDL_PIXELFORMAT_IYUV:
+        if (frame->linesize[0] > 0 && frame->linesize[1] > 0 && frame->linesize[2] > 0) {
+            ret = SDL_UpdateYUVTexture(*tex, NULL, frame->data[0], frame->linesize[0],
+                                                   frame->data[1], frame->linesize[1],
+                                                   frame->data[2], frame->linesize[2]);
+        } else if (frame->linesize[0] < 0 && frame->linesize[1] < 0 && frame->linesize[2] < 0) {
+            ret = SDL_UpdateYUVTexture(*tex, NULL, frame->data[0] + frame->linesize[0] * (frame->height                    - 1), -frame->linesize[0],
+                                                   frame->data[1] + frame->linesize[1] * (AV_CEIL_RSHIFT(frame->height, 1) - 1), -frame->linesize[1],
+                                                   frame->data[2] + frame->linesize[2] * (AV_CEIL_RSHIFT(frame->height, 1) - 1), -frame->linesize[2]);
+        } else {
+            av_log(NULL, AV_LOG_ERROR, "Mixed negative and positive linesizes are not supported.\n");
+            return -1;
+        }
+        break;
+    case SDL_PIXELFORMAT_NV12:
+    case SDL_PIXELFORMAT_NV21:
+        if (frame->linesize[0] < 0 || frame->linesize[1] < 0)
+            return -1;
+        ret = SDL_UpdateNVTexture(*tex, NULL, frame->data[0], frame->linesize[0],
+                                              frame->data[1], frame->linesize[1]);
+        break;
+    default:
+        if ((ret = SDL_LockTexture(*tex, NULL, &pixels, &pitch)) < 0)
+            break;
+        av_image_copy_plane(pixels, pitch, frame->data[0], frame->linesize[0],
+                            av_image_get_linesize(frame->format, frame->width, 0), frame->height);
+        SDL_UnlockTexture(*tex);
+        break;
+    }
+    return ret;
+}
+
+/* the first picture from after a seek is about to go up */
+static void seek_latency_update(VideoState *is, Frame *vp)
+{
+  int64_t latency;
+
+  if(!is->seek_request_time || vp->serial == is->seek_from_serial)
+    return;
+  latency = av_gettime_relative() - is->seek_request_time;
+  is->seek_request_time = 0;
+  is->seeks++;
+  is->seek_latency_sum += latency;
+  is->seek_latency_max = FFMAX(is->seek_latency_max, latency);
+  av_log(NULL, AV_LOG_VERBOSE, "seek: first frame at %.3fs after %.1f ms\n",
+         vp->pts, latency / 1000.0);
+}
+
 static void video_display(VideoState *is){
 
   Frame *vp = NULL;
   AVFrame *frame = NULL;
 
   SDL_Rect rect;
+
+  if(!is->frames_displayed++)
+    av_log(NULL, AV_LOG_INFO, "time to first frame: %.1f ms (open and probe %.1f ms)\n",
+           (av_gettime_relative() - is->start_time) / 1000.0,
+           (is->probe_done_time - is->start_time) / 1000.0);
+  if(display_disable) {
+    seek_latency_update(is, frame_queue_peek(&is->pictq));
+    frame_queue_pop(&is->pictq);
+    return;
+  }
   //1. open video
   if (!is->width)
         video_open(is);
   //2. peek frame
   vp = frame_queue_peek(&is->pictq);
+  seek_latency_update(is, vp);
 
   frame = vp->frame;
 
-  //3. create texture
-  if(!is->texture) {
-    int width = frame->width;
-    int height = frame->height;
-
-    Uint32 pixformat= SDL_PIXELFORMAT_IYUV;
-
-    //create texture for render
-    is->texture = SDL_CreateTexture(renderer,
-        pixformat,
-        SDL_TEXTUREACCESS_STREAMING,
-        width,
-        height);
-    if(!is->texture){
-      av_log(NULL, AV_LOG_ERROR, "Failed to alloct texture, NO MEMORY!\n");
-      return;
-    }
+  //3. (re)create the texture in the frame's own format and upload into it
+  if(upload_texture(&is->texture, frame) < 0) {
+    av_log(NULL, AV_LOG_ERROR, "Failed to upload a %s picture to a texture!\n",
+           av_get_pix_fmt_name(frame->format));
+    frame_queue_pop(&is->pictq);
+    return;
   }
   //4. calculate rect
   calculate_display_rect(&rect, is->xleft, is->ytop, is->width, is->height, vp->width, vp->height, vp->sar);
 
   //5. render
-  SDL_UpdateYUVTexture(is->texture, 
-                      NULL, 
-                      frame->data[0], frame->linesize[0],
-                      frame->data[1], frame->linesize[1],
-                      frame->data[2], frame->linesize[2]);
-
 	SDL_RenderClear(renderer);
 	SDL_RenderCopy(renderer, is->texture, NULL, &rect);
   //SDL_RenderCopy(renderer, is->texture, NULL, NULL);
@@ -632,16 +1343,56 @@ static void video_display(VideoState *is){
   frame_queue_pop(&is->pictq);
 }
 
+static void sample_occupancy(VideoState *is) {
+  int videoq_packets = atomic_load(&is->videoq.nb_packets);
+  int audioq_packets = atomic_load(&is->audioq.nb_packets);
+
+  is->occupancy_samples++;
+  is->videoq_packets_sum += videoq_packets;
+  is->audioq_packets_sum += audioq_packets;
+  is->pictq_sum += is->pictq.size;
+  is->videoq_packets_max = FFMAX(is->videoq_packets_max, videoq_packets);
+  is->audioq_packets_max = FFMAX(is->audioq_packets_max, audioq_packets);
+}
+
+/* every decoder has drained and everything decoded has been played */
+static int stream_finished(VideoState *is) {
+  if(atomic_load(&is->seek_req) || !is->eof)
+    return 0;
+  if(!atomic_load(&is->video_finished) || frame_queue_nb_remaining(&is->pictq) > 0)
+    return 0;
+  if(is->audio_st && (!atomic_load(&is->audio_finished) || audio_ring_fill(&is->audio_ring) > 0))
+    return 0;
+  return 1;
+}
+
 void video_refresh_timer(void *userdata) {
 
   VideoState *is = (VideoState *)userdata;
   Frame *vp = NULL;
 
   double actual_delay, delay, sync_threshold, ref_clock, diff;
+  int64_t jitter;
   
   if(is->video_st) {
+    sample_occupancy(is);
+    //pictures decoded before a seek, O(1) each
+    while(frame_queue_nb_remaining(&is->pictq) > 0 &&
+          frame_queue_peek(&is->pictq)->serial != atomic_load(&is->videoq.serial))
+      frame_queue_pop(&is->pictq);
     if(is->pictq.size == 0) {
-      schedule_refresh(is, 1); //if the queue is empty, so we shoud be as fast as checking queue of picture
+      if(autoexit && stream_finished(is)) {
+        SDL_Event event;
+        event.type = FF_QUIT_EVENT;
+        event.user.data1 = is;
+        SDL_PushEvent(&event);
+      }
+      //the queue is empty, presentation_wait() wakes up as soon as a picture is queued
+      schedule_refresh(is, REFRESH_POLL_TIME / 1000000.0);
+    } else if(benchmark) {
+      //no clock at all, show pictures as fast as they are decoded
+      video_display(is);
+      schedule_refresh(is, 0);
     } else {
       /* Now, normally here goes a ton of code
 	       about timing, etc. we're just going to
@@ -650,7 +1401,24 @@ void video_refresh_timer(void *userdata) {
 	       the timing - but I don't suggest that ;)
 	       We'll learn how to do it for real later.
       */
+      /* drop pictures whose successor is already behind the master clock,
+         the last queued picture is always shown */
+      if(is->av_sync_type != AV_SYNC_VIDEO_MASTER) {
+        ref_clock = get_master_clock(is);
+        while(frame_queue_nb_remaining(&is->pictq) > 1 &&
+              frame_queue_peek_next(&is->pictq)->pts < ref_clock) {
+          frame_queue_pop(&is->pictq);
+          is->frame_drops_late++;
+        }
+      }
+
       vp = frame_queue_peek(&is->pictq);
+      if(vp->serial != is->frame_timer_serial) {
+        //first picture after a seek, restart the timing from it
+        is->frame_timer = av_gettime_relative() / 1000000.0;
+        is->frame_last_pts = 0;
+        is->frame_timer_serial = vp->serial;
+      }
       is->video_current_pts = vp->pts;
       is->video_current_pts_time = av_gettime();
       if(is->frame_last_pts == 0) {
@@ -687,26 +1455,33 @@ void video_refresh_timer(void *userdata) {
 
       is->frame_timer += delay;
       /* computer the REAL delay */
-      actual_delay = is->frame_timer - (av_gettime() / 1000000.0);
-      if(actual_delay < 0.010) {
-        /* Really it should skip the picture instead */
-        actual_delay = 0.010;
+      actual_delay = is->frame_timer - (av_gettime_relative() / 1000000.0);
+      if(actual_delay < 0) {
+        is->frames_late++;
+        /* late pictures were dropped above, just show the next one asap */
+        actual_delay = 0;
       }
 
-      schedule_refresh(is, (int)(actual_delay * 1000 + 0.5));
+      jitter = FFABS(av_gettime_relative() - is->refresh_deadline);
+      is->present_count++;
+      is->present_jitter_sum += jitter;
+      is->present_jitter_max = FFMAX(is->present_jitter_max, jitter);
+
+      schedule_refresh(is, actual_delay);
       
       /* show the picture! */
       video_display(is);
     }
   } else {
-    schedule_refresh(is, 100);
+    schedule_refresh(is, 0.1);
   }
 }
 static int queue_picture(VideoState *is, 
                          AVFrame *src_frame, 
                          double pts, 
                          double duration, 
-                         int64_t pos)
+                         int64_t pos,
+                         int serial)
 {
     Frame *vp;
 
@@ -727,6 +1502,7 @@ static int queue_picture(VideoState *is,
     vp->pts = pts;
     vp->duration = duration;
     vp->pos = pos;
+    vp->serial = serial;
 
     //set_default_window_size(vp->width, vp->height, vp->sar);
 
@@ -735,6 +1511,253 @@ static int queue_picture(VideoState *is,
     return 0;
 }
 
+/* frame buffer pool handling */
+static AVBufferRef *frame_pool_alloc(void *opaque, size_t size)
+{
+    FramePool *fp = opaque;
+    atomic_fetch_add(&fp->allocs, 1);
+    return av_buffer_alloc(size);
+}
+
+static void frame_pool_uninit(FramePool *fp)
+{
+    int i;
+    /* buffers still referenced by frames keep their pool alive until released */
+    for (i = 0; i < 4; i++)
+        av_buffer_pool_uninit(&fp->pools[i]);
+    fp->width = fp->height = 0;
+    fp->format = AV_PIX_FMT_NONE;
+}
+
+/*
+ * Same plane layout rules as libavcodec's default allocator. Without a
+ * codec context (converted frames) planes are simply FRAME_POOL_ALIGN
+ * aligned.
+ */
+static int frame_pool_reinit(FramePool *fp, AVCodecContext *avctx, AVFrame *frame)
+{
+    int linesize_align[AV_NUM_DATA_POINTERS];
+    int linesize[4];
+    ptrdiff_t linesize1[4];
+    size_t sizes[4];
+    int w = frame->width, h = frame->height;
+    int i, ret, unaligned;
+
+    frame_pool_uninit(fp);
+
+    if (avctx) {
+        avcodec_align_dimensions2(avctx, &w, &h, linesize_align);
+    } else {
+        for (i = 0; i < AV_NUM_DATA_POINTERS; i++)
+            linesize_align[i] = FRAME_POOL_ALIGN;
+    }
+    do {
+        /* increase the width until every linesize fits the required alignment */
+        ret = av_image_fill_linesizes(linesize, frame->format, w);
+        if (ret < 0)
+            return ret;
+        w += w & ~(w - 1);
+
+        unaligned = 0;
+        for (i = 0; i < 4; i++)
+            unaligned |= linesize[i] % linesize_align[i];
+    } while (unaligned);
+
+    for (i = 0; i < 4; i++)
+        linesize1[i] = linesize[i];
+    ret = av_image_fill_plane_sizes(sizes, frame->format, h, linesize1);
+    if (ret < 0)
+        return ret;
+
+    for (i = 0; i < 4 && sizes[i]; i++) {
+        fp->pools[i] = av_buffer_pool_init2(sizes[i] + 16 + AV_INPUT_BUFFER_PADDING_SIZE,
+                                            fp, frame_pool_alloc, NULL);
+        if (!fp->pools[i]) {
+            frame_pool_uninit(fp);
+            return AVERROR(ENOMEM);
+        }
+        fp->linesize[i] = linesize[i];
+    }
+    fp->width = frame->width;
+    fp->height = frame->height;
+    fp->format = frame->format;
+    fp->reinits++;
+
+    av_log(avctx, AV_LOG_DEBUG, "frame pool: %dx%d %s\n",
+           fp->width, fp->height, av_get_pix_fmt_name(fp->format));
+    return 0;
+}
+
+/* fill frame's planes from the pool, re-laying it out if the geometry changed */
+static int frame_pool_get(FramePool *fp, AVCodecContext *avctx, AVFrame *frame)
+{
+    int i, ret;
+
+    if (fp->width != frame->width || fp->height != frame->height || fp->format != frame->format) {
+        if ((ret = frame_pool_reinit(fp, avctx, frame)) < 0)
+            return ret;
+    }
+
+    memset(frame->data, 0, sizeof(frame->data));
+    for (i = 0; i < 4 && fp->pools[i]; i++) {
+        frame->buf[i] = av_buffer_pool_get(fp->pools[i]);
+        if (!frame->buf[i])
+            goto fail;
+        frame->data[i] = frame->buf[i]->data;
+        frame->linesize[i] = fp->linesize[i];
+        atomic_fetch_add(&fp->gets, 1);
+    }
+    frame->extended_data = frame->data;
+    return 0;
+
+fail:
+    for (i = 0; i < 4; i++)
+        av_buffer_unref(&frame->buf[i]);
+    return AVERROR(ENOMEM);
+}
+
+/*
+ * Called by the decoder (one call at a time, possibly from a frame thread).
+ * Paletted and hardware formats are left to the default allocator.
+ */
+static int video_get_buffer2(AVCodecContext *avctx, AVFrame *frame, int flags)
+{
+    VideoState *is = avctx->opaque;
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(frame->format);
+
+    if (!(avctx->codec->capabilities & AV_CODEC_CAP_DR1) || !desc ||
+        (desc->flags & (AV_PIX_FMT_FLAG_PAL | AV_PIX_FMT_FLAG_HWACCEL)))
+        return avcodec_default_get_buffer2(avctx, frame, flags);
+
+    return frame_pool_get(&is->frame_pool, avctx, frame);
+}
+
+/*
+ * sws_getCachedContext can't set "threads", so the cache is kept by hand:
+ * the context is rebuilt only when the source or destination geometry
+ * changes, and runs swscale's slice threads on every core.
+ */
+static int video_update_scaler(VideoState *is, AVFrame *src, int dst_w, int dst_h,
+                               enum AVPixelFormat dst_fmt)
+{
+    struct SwsContext *sws;
+    int ret;
+
+    if (is->sws_ctx &&
+        is->sws_src_w == src->width && is->sws_src_h == src->height && is->sws_src_fmt == src->format &&
+        is->sws_dst_w == dst_w && is->sws_dst_h == dst_h && is->sws_dst_fmt == dst_fmt)
+        return 0;
+
+    sws_freeContext(is->sws_ctx);
+    is->sws_ctx = NULL;
+
+    if (!(sws = sws_alloc_context()))
+        return AVERROR(ENOMEM);
+    av_opt_set_int(sws, "srcw",       src->width,   0);
+    av_opt_set_int(sws, "srch",       src->height,  0);
+    av_opt_set_int(sws, "src_format", src->format,  0);
+    av_opt_set_int(sws, "dstw",       dst_w,        0);
+    av_opt_set_int(sws, "dsth",       dst_h,        0);
+    av_opt_set_int(sws, "dst_format", dst_fmt,      0);
+    av_opt_set_int(sws, "sws_flags",  SWS_BICUBIC,  0);
+    av_opt_set_int(sws, "threads",    av_cpu_count(), 0);
+    if ((ret = sws_init_context(sws, NULL, NULL)) < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Cannot initialize the conversion context %s -> %s\n",
+               av_get_pix_fmt_name(src->format), av_get_pix_fmt_name(dst_fmt));
+        sws_freeContext(sws);
+        return ret;
+    }
+    av_log(NULL, AV_LOG_VERBOSE, "scaler: %dx%d %s -> %dx%d %s, %d threads\n",
+           src->width, src->height, av_get_pix_fmt_name(src->format),
+           dst_w, dst_h, av_get_pix_fmt_name(dst_fmt), av_cpu_count());
+
+    is->sws_ctx = sws;
+    is->sws_src_w = src->width;
+    is->sws_src_h = src->height;
+    is->sws_src_fmt = src->format;
+    is->sws_dst_w = dst_w;
+    is->sws_dst_h = dst_h;
+    is->sws_dst_fmt = dst_fmt;
+    return 0;
+}
+
+/*
+ * Size the picture will be shown at. When that is much smaller than the
+ * source, return the display rect so the frame is scaled down before it
+ * is queued and uploaded.
+ */
+static void video_target_size(VideoState *is, AVFrame *frame, int *w, int *h)
+{
+    unsigned int size = atomic_load(&is->window_size);
+    SDL_Rect rect;
+
+    *w = frame->width;
+    *h = frame->height;
+    if (display_disable || !size)
+        return;
+
+    calculate_display_rect(&rect, 0, 0, size >> 16, size & 0xffff,
+                           frame->width, frame->height, frame->sample_aspect_ratio);
+    if ((int64_t)rect.w * rect.h <= (int64_t)frame->width * frame->height * DOWNSCALE_THRESHOLD) {
+        *w = FFMAX(rect.w & ~1, 2);
+        *h = FFMAX(rect.h & ~1, 2);
+    }
+}
+
+/*
+ * Turn a decoded frame into something cheap to display, in place: formats
+ * the renderer can't take become IYUV, and pictures far larger than the
+ * window are scaled down to it. Anything else is left untouched.
+ */
+static int video_convert_frame(VideoState *is, AVFrame *frame, AVFrame *tmp)
+{
+    int displayable = get_sdl_pix_fmt(frame->format) != SDL_PIXELFORMAT_UNKNOWN;
+    int64_t start;
+    int w, h, ret;
+
+    video_target_size(is, frame, &w, &h);
+    if (displayable && w == frame->width && h == frame->height)
+        return 0;
+
+    if ((ret = video_update_scaler(is, frame, w, h,
+                                   displayable ? frame->format : AV_PIX_FMT_YUV420P)) < 0)
+        return ret;
+
+    tmp->width  = is->sws_dst_w;
+    tmp->height = is->sws_dst_h;
+    tmp->format = is->sws_dst_fmt;
+    if ((ret = frame_pool_get(&is->convert_pool, NULL, tmp)) < 0)
+        return ret;
+
+    start = av_gettime_relative();
+    ret = sws_scale_frame(is->sws_ctx, tmp, frame);
+    is->convert_time += av_gettime_relative() - start;
+    if (ret < 0) {
+        av_frame_unref(tmp);
+        return ret;
+    }
+    is->frames_converted++;
+
+    av_frame_copy_props(tmp, frame);
+    if (w != frame->width || h != frame->height) {
+        /* the display rect already has the aspect ratio applied */
+        tmp->sample_aspect_ratio = av_make_q(1, 1);
+        is->frames_downscaled++;
+    }
+    av_frame_unref(frame);
+    av_frame_move_ref(frame, tmp);
+    return 0;
+}
+
+static void frame_pool_log_stats(FramePool *fp)
+{
+    int64_t gets = atomic_load(&fp->gets), allocs = atomic_load(&fp->allocs);
+
+    av_log(NULL, AV_LOG_INFO,
+           "frame pool: %"PRId64" plane buffers, %"PRId64" allocated (%.1f%% reused), %d reinits\n",
+           gets, allocs, gets ? 100.0 * (gets - allocs) / gets : 0.0, fp->reinits);
+}
+
 int decode_thread(void *arg) {
 
   int ret = -1;
@@ -744,25 +1767,46 @@ int decode_thread(void *arg) {
 
   VideoState *is = (VideoState *)arg;
   AVFrame *video_frame = NULL;
+  AVFrame *convert_frame = NULL;
   Frame *vp = NULL;
+  int64_t depth;
+  int serial = 0, decoder_serial = 0;
 
   AVRational tb = is->video_st->time_base;
   AVRational frame_rate = av_guess_frame_rate(is->ic, is->video_st, NULL);
 
   video_frame = av_frame_alloc();
+  convert_frame = av_frame_alloc();
+  if(!video_frame || !convert_frame) {
+    ret = AVERROR(ENOMEM);
+    goto __ERROR;
+  }
 
   for(;;) {
     if(is->quit) {
       break;
     }
 
-    if(packet_queue_get(&is->videoq, &is->video_pkt, 0) <= 0) {
+    //sleep on the queue until read_thread hands over a packet
+    if(packet_queue_get(&is->videoq, &is->video_pkt, 1, &serial) < 0) {
       // means we quit getting packets
-      av_log(is->video_ctx, AV_LOG_DEBUG, "video delay 10 ms\n");
-      SDL_Delay(10);
+      break;
+    }
+    if(serial != atomic_load(&is->videoq.serial)) {
+      //queued before a seek, never decoded
+      av_packet_unref(&is->video_pkt);
       continue;
     }
+    if(serial != decoder_serial) {
+      //first packet after a seek, drop the references to the old position
+      avcodec_flush_buffers(is->video_ctx);
+      decoder_serial = serial;
+      is->video_pkts_sent = is->frames_decoded;
+      atomic_store(&is->video_finished, 0);
+    }
 
+    if(is->video_pkt.data)
+      is->video_pkts_sent++;
     ret = avcodec_send_packet(is->video_ctx, &is->video_pkt);
     av_packet_unref(&is->video_pkt);
     if(ret < 0) {
@@ -772,7 +1816,12 @@ int decode_thread(void *arg) {
     
     while(ret >=0) {
       ret = avcodec_receive_frame(is->video_ctx, video_frame);
-      if(ret == AVERROR(EAGAIN) || ret == AVERROR_EOF){
+      if(ret == AVERROR_EOF){
+        //drained after the null packet, get ready for more input
+        atomic_store(&is->video_finished, 1);
+        avcodec_flush_buffers(is->video_ctx);
+        break;
+      } else if(ret == AVERROR(EAGAIN)){
         break;
       } else if( ret < 0) {
         av_log(is->video_ctx, AV_LOG_ERROR, "Failed to receive frame from video decoder!\n");
@@ -786,9 +1835,35 @@ int decode_thread(void *arg) {
       duration = (frame_rate.num && frame_rate.den ? av_q2d((AVRational){frame_rate.den, frame_rate.num}) : 0);
       pts = (video_frame->pts == AV_NOPTS_VALUE) ? NAN : video_frame->pts * av_q2d(tb);
       pts = synchronize_video(is, video_frame, pts);
-      
+
+      is->frames_decoded++;
+      depth = is->video_pkts_sent - is->frames_decoded;
+      is->decoder_depth_sum += depth;
+      is->decoder_depth_max = FFMAX(is->decoder_depth_max, depth);
+
+      if(serial != atomic_load(&is->videoq.serial)) {
+        //a seek came in while this packet was decoding
+        av_frame_unref(video_frame);
+        continue;
+      }
+      if(serial == is->seek_discard_serial && !isnan(pts) &&
+         pts + duration / 2 < is->seek_discard_pts) {
+        //precise seek, decoded only to reach the target
+        is->frames_discarded_seek++;
+        av_frame_unref(video_frame);
+        continue;
+      }
+
+      //formats SDL can't show become IYUV here, off the display thread
+      if(video_convert_frame(is, video_frame, convert_frame) < 0) {
+        av_log(is->video_ctx, AV_LOG_ERROR, "Failed to convert %s frame, dropping it!\n",
+               av_get_pix_fmt_name(video_frame->format));
+        av_frame_unref(video_frame);
+        continue;
+      }
+
       //insert FrameQueue
-      queue_picture(is, video_frame, pts, duration, video_frame->pkt_pos);
+      queue_picture(is, video_frame, pts, duration, video_frame->pkt_pos, serial);
 
       //sub reference count
       av_frame_unref(video_frame);
@@ -797,6 +1872,7 @@ int decode_thread(void *arg) {
   ret = 0;
 
 __ERROR:
+  av_frame_free(&convert_frame);
   av_frame_free(&video_frame);
   return ret;
 }
@@ -861,6 +1937,17 @@ int stream_component_open(VideoState *is, int stream_index) {
     av_log(avctx, AV_LOG_ERROR, "Couldn't copy codec parameters to codec context!\n");
     goto __ERROR; // Error copying codec context
   }
+  if(avctx->codec_type == AVMEDIA_TYPE_VIDEO) {
+    //decode into recycled buffers
+    is->frame_pool.format = AV_PIX_FMT_NONE;
+    avctx->opaque = is;
+    avctx->get_buffer2 = video_get_buffer2;
+
+    //frame threads add latency, slice threads don't but not every stream has slices;
+    //0 leaves the count to libavcodec, which caps it instead of running a frame thread per core
+    avctx->thread_count = decoder_threads;
+    avctx->thread_type = decoder_thread_type;
+  }
   //bind codec and codec context
   if((ret = avcodec_open2(avctx, codec, NULL))< 0) {
     av_log(NULL, AV_LOG_ERROR, "Failed to bind codecCtx and codec!\n");
@@ -881,23 +1968,45 @@ int stream_component_open(VideoState *is, int stream_index) {
       goto __ERROR;
     }
 
+    //room for SAMPLE_QUEUE_SIZE device buffers between the decoder and the callback
+    if((ret = audio_ring_init(&is->audio_ring, SAMPLE_QUEUE_SIZE * ret)) < 0) {
+      SDL_CloseAudio();
+      goto __ERROR;
+    }
+
     is->audio_buf_size = 0;
-    is->audio_buf_index = 0;
+    is->audio_bytes_per_sec = sample_rate * ch_layout.nb_channels * av_get_bytes_per_sample(AV_SAMPLE_FMT_S16);
     is->audio_st = st;
     is->audio_index = stream_index;
     is->audio_ctx = avctx;
-    
+
+    //create audio decode thread
+    is->audio_tid = SDL_CreateThread(audio_thread, "audio_thread", is);
+    if(!is->audio_tid) {
+      av_log(NULL, AV_LOG_FATAL, "SDL_CreateThread(): %s\n", SDL_GetError());
+      SDL_CloseAudio();
+      audio_ring_destroy(&is->audio_ring);
+      is->audio_st = NULL;
+      is->audio_index = -1;
+      is->audio_ctx = NULL;
+      goto __ERROR;
+    }
+
     //start play audio
     SDL_PauseAudio(0);
 
     break;
 
   case AVMEDIA_TYPE_VIDEO:
+    av_log(avctx, AV_LOG_INFO, "video decoder: %s, %d threads, %s threading\n",
+           codec->name, avctx->thread_count,
+           avctx->active_thread_type & FF_THREAD_FRAME ? "frame" :
+           avctx->active_thread_type & FF_THREAD_SLICE ? "slice" : "no");
     is->video_index = stream_index;
     is->video_st = st;
     is->video_ctx = avctx;
 
-    is->frame_timer = (double)av_gettime() / 1000000.0;
+    is->frame_timer = (double)av_gettime_relative() / 1000000.0;
     is->frame_last_delay = 40e-3;
     is->video_current_pts_time = av_gettime();
 
@@ -919,6 +2028,239 @@ __END:
   return ret;
 }
 
+/*
+ * Both queues share queue_memory_budget in proportion to their bitrate,
+ * which gives every stream the same buffered duration: buffer_duration,
+ * or less when that many seconds of the current bitrate would not fit.
+ */
+static void update_queue_limits(VideoState *is)
+{
+    PacketQueue *queues[2] = { &is->audioq, &is->videoq };
+    double total_rate = is->audioq.bitrate + is->videoq.bitrate;
+    double seconds = buffer_duration;
+    int i;
+
+    if (total_rate > 0)
+        seconds = FFMIN(seconds, queue_memory_budget / total_rate);
+
+    for (i = 0; i < 2; i++) {
+        PacketQueue *q = queues[i];
+        int64_t max_size = total_rate > 0 ? queue_memory_budget * (q->bitrate / total_rate)
+                                          : queue_memory_budget / 2;
+        atomic_store(&q->max_size, (int)FFMIN(max_size, INT_MAX));
+        if (q->time_base.num)
+            atomic_store(&q->max_duration,
+                         av_rescale_q(seconds * AV_TIME_BASE, AV_TIME_BASE_Q, q->time_base));
+    }
+    av_log(NULL, AV_LOG_DEBUG, "queue limits: %.2fs, audio %d bytes, video %d bytes\n",
+           seconds, atomic_load(&is->audioq.max_size), atomic_load(&is->videoq.max_size));
+}
+
+/* producer side: fill in missing durations and sample the bitrate about once a second */
+static void packet_queue_account(VideoState *is, PacketQueue *q, AVPacket *pkt)
+{
+    double elapsed, rate;
+
+    if (!pkt->duration)
+        pkt->duration = q->default_duration;
+    if (!q->time_base.num)
+        return;
+
+    q->rate_bytes += pkt->size;
+    q->rate_duration += pkt->duration;
+    elapsed = q->rate_duration * av_q2d(q->time_base);
+    if (elapsed < 1.0)
+        return;
+
+    rate = q->rate_bytes / elapsed;
+    q->bitrate = q->bitrate > 0 ? 0.7 * q->bitrate + 0.3 * rate : rate;
+    q->rate_bytes = q->rate_duration = 0;
+    update_queue_limits(is);
+}
+
+static void packet_queue_set_stream(PacketQueue *q, AVFormatContext *ic, AVStream *st)
+{
+    AVCodecParameters *par = st->codecpar;
+
+    q->time_base = st->time_base;
+    if (par->codec_type == AVMEDIA_TYPE_VIDEO) {
+        AVRational frame_rate = av_guess_frame_rate(ic, st, NULL);
+        if (frame_rate.num && frame_rate.den)
+            q->default_duration = av_rescale_q(1, av_inv_q(frame_rate), st->time_base);
+    } else if (par->codec_type == AVMEDIA_TYPE_AUDIO) {
+        if (par->frame_size && par->sample_rate)
+            q->default_duration = av_rescale_q(par->frame_size,
+                                               (AVRational){1, par->sample_rate}, st->time_base);
+    }
+}
+
+/*
+ * ffplay's rule: stop reading once the queues together hold the memory
+ * budget, or once every stream has enough. A queue past its share of the
+ * budget alone doesn't keep a starving one from being filled.
+ */
+static int read_thread_queues_full(VideoState *is)
+{
+    if (atomic_load(&is->audioq.size) + atomic_load(&is->videoq.size) > queue_memory_budget)
+        return 1;
+    return (!is->audio_st || packet_queue_has_enough(&is->audioq)) &&
+           (!is->video_st || packet_queue_has_enough(&is->videoq));
+}
+
+/*
+ * Sleep until a consumer drains a queue below its low water mark, or until
+ * someone else signals continue_read_thread (abort/quit). Over the budget
+ * that is a queue past its share; otherwise every stream has enough and any
+ * of them running low will do. Flags are raised before the queues are
+ * re-checked so a drain racing with us is not lost.
+ */
+static void read_thread_wait_for_space(VideoState *is)
+{
+    PacketQueue *queues[2] = { &is->audioq, &is->videoq };
+    int present[2] = { !!is->audio_st, !!is->video_st };
+    int64_t woken, signalled;
+    int over, flagged = 0, i;
+
+    SDL_LockMutex(is->wait_mutex);
+    if (read_thread_queues_full(is)) {
+        over = atomic_load(&is->audioq.size) + atomic_load(&is->videoq.size) > queue_memory_budget;
+        for (i = 0; i < 2; i++) {
+            if (present[i] && (!over || atomic_load(&queues[i]->size) >= atomic_load(&queues[i]->max_size))) {
+                atomic_store(&queues[i]->want_space, over ? WANT_SPACE_SIZE : WANT_SPACE_FRAMES);
+                flagged = 1;
+            }
+        }
+        // 份额是按码率刚算出来的, 可能谁都没超: 等大的那个降下来
+        if (!flagged) {
+            i = atomic_load(&is->videoq.size) >= atomic_load(&is->audioq.size);
+            atomic_store(&queues[i]->want_space, WANT_SPACE_SIZE);
+        }
+    }
+    if (!is->quit && !atomic_load(&is->videoq.abort_request) && !atomic_load(&is->seek_req) &&
+        (atomic_load(&is->audioq.want_space) || atomic_load(&is->videoq.want_space)))
+        SDL_CondWait(is->continue_read_thread, is->wait_mutex);
+    atomic_store(&is->audioq.want_space, 0);
+    atomic_store(&is->videoq.want_space, 0);
+    SDL_UnlockMutex(is->wait_mutex);
+
+    woken = av_gettime_relative();
+    signalled = FFMAX(atomic_exchange(&is->audioq.space_signal_time, 0),
+                      atomic_exchange(&is->videoq.space_signal_time, 0));
+    if (signalled > 0) {
+        is->read_waits++;
+        is->refill_latency_sum += woken - signalled;
+        is->refill_latency_max = FFMAX(is->refill_latency_max, woken - signalled);
+    }
+}
+
+/*
+ * Carry out a pending seek. Nothing is drained here: both queues get a new
+ * serial and the consumers drop older packets and frames as they reach them.
+ */
+static void read_thread_seek(VideoState *is)
+{
+    int64_t seek_target = is->seek_pos;
+    int64_t seek_min = is->seek_rel > 0 ? seek_target - is->seek_rel + 2 : INT64_MIN;
+    int64_t seek_max = is->seek_rel < 0 ? seek_target - is->seek_rel - 2 : INT64_MAX;
+    int ret;
+
+    /* precise: a keyframe at or before the target, everything up to it is decoded and dropped */
+    if (is->seek_precise) {
+        seek_min = INT64_MIN;
+        seek_max = seek_target;
+    }
+
+    /* a sidecar index finished in the background since the last seek */
+    if (!is->kfidx && atomic_exchange(&is->index_ready, 0))
+        kfidx_open(&is->kfidx, is->filename);
+
+    ret = -1;
+    if (is->kfidx)
+        ret = kfidx_seek(is->ic, is->kfidx, seek_min, seek_target);
+    if (ret < 0)
+        ret = avformat_seek_file(is->ic, -1, seek_min, seek_target, seek_max, 0);
+    if (ret < 0) {
+        av_log(NULL, AV_LOG_ERROR, "%s: error while seeking to %.3fs\n",
+               is->ic->url, seek_target / (double)AV_TIME_BASE);
+    } else {
+        /* both queues always move together, so their serials stay equal */
+        is->seek_discard_pts = seek_target / (double)AV_TIME_BASE;
+        is->seek_discard_serial = is->seek_precise ? atomic_load(&is->videoq.serial) + 1 : -1;
+        packet_queue_start_serial(&is->audioq);
+        packet_queue_start_serial(&is->videoq);
+    }
+    is->eof = 0;
+    atomic_store(&is->seek_req, 0);
+}
+
+/* sleep until woken through continue_read_thread, or for timeout_ms if >= 0 */
+static void read_thread_wait(VideoState *is, int timeout_ms)
+{
+    SDL_LockMutex(is->wait_mutex);
+    if (!is->quit && !atomic_load(&is->videoq.abort_request) && !atomic_load(&is->seek_req)) {
+        if (timeout_ms < 0)
+            SDL_CondWait(is->continue_read_thread, is->wait_mutex);
+        else
+            SDL_CondWaitTimeout(is->continue_read_thread, is->wait_mutex, timeout_ms);
+    }
+    SDL_UnlockMutex(is->wait_mutex);
+}
+
+static int index_interrupt_cb(void *opaque)
+{
+    VideoState *is = opaque;
+    return is->quit || atomic_load(&is->videoq.abort_request);
+}
+
+/* index the whole input at its own pace, seeks use it once it is complete */
+static int index_thread(void *arg)
+{
+    VideoState *is = arg;
+    AVIOInterruptCB int_cb = { index_interrupt_cb, is };
+
+    if (kfidx_build(is->filename, &int_cb) >= 0)
+        atomic_store(&is->index_ready, 1);
+    return 0;
+}
+
+/* open the input through the backend picked with -io */
+static int input_open(AVFormatContext **ic, const char *filename)
+{
+    switch (input_io) {
+    case INPUT_IO_MMAP:
+        return mmap_io_open_input(ic, filename, NULL, NULL);
+    case INPUT_IO_ASYNC:
+        return async_io_open_input(ic, filename, NULL, NULL);
+    default:
+        return avformat_open_input(ic, filename, NULL, NULL);
+    }
+}
+
+static void input_close(AVFormatContext **ic)
+{
+    AsyncIOStats st;
+
+    if (!*ic)
+        return;
+    switch (input_io) {
+    case INPUT_IO_MMAP:
+        mmap_io_close_input(ic);
+        break;
+    case INPUT_IO_ASYNC:
+        if ((*ic)->flags & AVFMT_FLAG_CUSTOM_IO) {
+            async_io_get_stats((*ic)->pb, &st);
+            av_log(NULL, AV_LOG_INFO,
+                   "read-ahead (%s): %"PRId64" MB, %"PRId64" stalls, %"PRId64" ms stalled, window %d max %d blocks\n",
+                   st.uring ? "io_uring" : "pread threads", st.bytes >> 20, st.stalls,
+                   st.stall_time / 1000, st.window, st.max_window);
+        }
+        async_io_close_input(ic);
+        break;
+    default:
+        avformat_close_input(ic);
+    }
+}
+
 int read_thread(void *arg) {
 
   Uint32 pixformat;
@@ -938,18 +2280,29 @@ int read_thread(void *arg) {
   }
 
   //1. Open media file
-  if((ret = avformat_open_input(&ic, is->filename, NULL, NULL)) < 0) {
+  //local files are mapped (-io mmap, default) or read ahead asynchronously (-io async)
+  if((ret = input_open(&ic, is->filename)) < 0) {
     av_log(NULL, AV_LOG_ERROR, "Could not open file: %s, %d(%s)\n", is->filename, ret, av_err2str(ret));
     goto __ERROR; // Couldn't open file
   }
   is->ic = ic;
   
-  //2. extract media info
-  if(avformat_find_stream_info(ic, NULL) < 0) { 
+  //2. extract media info, bounded with -fast, from the probe cache with -probe_cache
+  if((ret = probe_cache_find_stream_info(ic, is->filename, probe_flags)) < 0) { 
     av_log(NULL, AV_LOG_FATAL, "Couldn't find stream information\n");
     goto __ERROR;
   }
+  is->probe_done_time = av_gettime_relative();
+  av_log(NULL, AV_LOG_INFO, "opened %s in %.1f ms%s\n", is->filename,
+         (is->probe_done_time - is->start_time) / 1000.0, ret > 0 ? " (probe cache)" : "");
   
+  //a keyframe index next to the file lets seeks jump straight to the keyframe
+  if(kfidx_open(&is->kfidx, is->filename) < 0 && build_index) {
+    is->index_tid = SDL_CreateThread(index_thread, "index_thread", is);
+    if(!is->index_tid)
+      av_log(NULL, AV_LOG_WARNING, "SDL_CreateThread(): %s\n", SDL_GetError());
+  }
+
   //3. Find the first audio and video stream
   for(int i = 0; i < ic->nb_streams; i++) {
     AVStream *st = ic->streams[i];
@@ -957,7 +2310,7 @@ int read_thread(void *arg) {
     if(type == AVMEDIA_TYPE_VIDEO && video_index < 0) {
       video_index=i;
     }
-    if(type == AVMEDIA_TYPE_AUDIO && audio_index < 0) {
+    if(type == AVMEDIA_TYPE_AUDIO && audio_index < 0 && !audio_disable) {
       audio_index=i;
     }
 
@@ -967,10 +2320,19 @@ int read_thread(void *arg) {
     }
   }
 
-  if(video_index < 0 || audio_index < 0) {
-    av_log(NULL, AV_LOG_ERROR, "the file must be contains audio and video stream!\n");
+  if(video_index < 0) {
+    av_log(NULL, AV_LOG_ERROR, "the file must be contains video stream!\n");
     goto __ERROR;
   }
+  if(audio_index < 0) {
+    //nothing to sync to, let the video pts drive the clock
+    is->av_sync_type = AV_SYNC_VIDEO_MASTER;
+  }
+
+  if(audio_index >= 0)
+    packet_queue_set_stream(&is->audioq, ic, ic->streams[audio_index]);
+  packet_queue_set_stream(&is->videoq, ic, ic->streams[video_index]);
+  update_queue_limits(is);
 
   if(audio_index >= 0) { //4. open audio part
     stream_component_open(is, audio_index);
@@ -992,28 +2354,45 @@ int read_thread(void *arg) {
       goto __ERROR;
     }
 
-    //limit queue size
-    if(is->audioq.size > MAX_QUEUE_SIZE ||
-       is->videoq.size > MAX_QUEUE_SIZE) {
-      SDL_Delay(10);
+    if(atomic_load(&is->seek_req)) {
+      read_thread_seek(is);
+      continue;
+    }
+
+    //limit queue size, the consumers wake us up once they drain
+    if(read_thread_queues_full(is)) {
+      read_thread_wait_for_space(is);
       continue;
     }
 
     //6. read packet
     ret = av_read_frame(is->ic, pkt);
     if(ret < 0) {
-      if(is->ic->pb->error == 0) {
-        SDL_Delay(100); /* no error; wait for user input */
-        continue;
+      if(is->ic->pb && is->ic->pb->error) {
+        break;
+      }
+      if(ret == AVERROR_EOF) {
+        if(!is->eof) {
+          //let the decoders drain what they still hold
+          packet_queue_put_nullpacket(&is->videoq, pkt, is->video_index);
+          if(is->audio_st)
+            packet_queue_put_nullpacket(&is->audioq, pkt, is->audio_index);
+          is->eof = 1;
+        }
+        read_thread_wait(is, -1); /* no error; wait for user input */
       } else {
-	      break;
+        read_thread_wait(is, 10); /* transient, e.g. EAGAIN */
       }
+      continue;
     }
 
     //7. save packet to queue
+    is->pkts_read++;
     if(pkt->stream_index == is->video_index) {
+      packet_queue_account(is, &is->videoq, pkt);
       packet_queue_put(&is->videoq, pkt);
     } else if(pkt->stream_index == is->audio_index) {
+      packet_queue_account(is, &is->audioq, pkt);
       packet_queue_put(&is->audioq, pkt);
     } else { //discard other packets 
       av_packet_unref(pkt);
@@ -1021,8 +2400,8 @@ int read_thread(void *arg) {
   }
 
   /* all done - wait for it */
-  while(!is->quit) {
-    SDL_Delay(100);
+  while(!is->quit && !atomic_load(&is->videoq.abort_request)) {
+    read_thread_wait(is, -1);
   }
 
   ret = 0;
@@ -1053,9 +2432,17 @@ static void stream_component_close(VideoState *is, int stream_index){
   switch (codecpar->codec_type) {
   case AVMEDIA_TYPE_AUDIO:
       SDL_CloseAudio();
+      packet_queue_abort(&is->audioq);
+      SDL_WaitThread(is->audio_tid, NULL);
+      is->audio_tid = NULL;
+      av_log(NULL, AV_LOG_INFO,
+             "audio callback: %"PRId64" calls, %"PRId64" underruns, worst case %.1f us\n",
+             is->audio_callbacks, is->audio_underruns,
+             is->audio_callback_max * 1000000.0 / SDL_GetPerformanceFrequency());
       swr_free(&is->audio_swr_ctx);
       av_freep(&is->audio_buf);
       is->audio_buf = NULL;
+      audio_ring_destroy(&is->audio_ring);
 
       break;
   case AVMEDIA_TYPE_VIDEO:
@@ -1063,15 +2450,75 @@ static void stream_component_close(VideoState *is, int stream_index){
     frame_queue_signal(&is->pictq);
     SDL_WaitThread(is->decode_tid, NULL);
     is->decode_tid = NULL;
+    av_log(NULL, AV_LOG_INFO, "video: %"PRId64" frames dropped, %"PRId64" shown late\n",
+           is->frame_drops_late, is->frames_late);
+    if (is->frames_decoded) {
+        /* how far frame threading runs ahead of the output, in frames and time */
+        AVRational frame_rate = av_guess_frame_rate(ic, ic->streams[stream_index], NULL);
+        double frame_duration = frame_rate.num && frame_rate.den ? av_q2d(av_inv_q(frame_rate)) : 0;
+        double depth = (double)is->decoder_depth_sum / is->frames_decoded;
+        av_log(NULL, AV_LOG_INFO, "video decoder latency: avg %.1f frames (%.1f ms), max %"PRId64" frames (%.1f ms)\n",
+               depth, depth * frame_duration * 1000,
+               is->decoder_depth_max, is->decoder_depth_max * frame_duration * 1000);
+    }
+    if (is->present_count)
+        av_log(NULL, AV_LOG_INFO, "presentation jitter: avg %"PRId64" us, max %"PRId64" us over %"PRId64" frames\n",
+               is->present_jitter_sum / is->present_count, is->present_jitter_max, is->present_count);
+    if (is->frames_converted)
+        av_log(NULL, AV_LOG_INFO, "conversion: %"PRId64" frames (%"PRId64" downscaled), last %dx%d %s -> %dx%d %s, "
+               "avg %.2f ms (%.1f fps)\n",
+               is->frames_converted, is->frames_downscaled,
+               is->sws_src_w, is->sws_src_h, av_get_pix_fmt_name(is->sws_src_fmt),
+               is->sws_dst_w, is->sws_dst_h, av_get_pix_fmt_name(is->sws_dst_fmt),
+               is->convert_time / 1000.0 / is->frames_converted,
+               is->convert_time ? is->frames_converted * 1000000.0 / is->convert_time : 0.0);
+    sws_freeContext(is->sws_ctx);
+    is->sws_ctx = NULL;
+    frame_pool_log_stats(&is->frame_pool);
+    frame_pool_uninit(&is->frame_pool);
+    frame_pool_uninit(&is->convert_pool);
       break;
   default:
       break;
   }
 }
 
+static void print_benchmark_report(VideoState *is)
+{
+    struct rusage ru;
+    double elapsed = (av_gettime_relative() - is->start_time) / 1000000.0;
+    double utime = 0, stime = 0;
+    int64_t n = FFMAX(is->occupancy_samples, 1);
+
+    if (!getrusage(RUSAGE_SELF, &ru)) {
+        utime = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1000000.0;
+        stime = ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1000000.0;
+    }
+    if (elapsed <= 0)
+        elapsed = 1e-6;
+
+    av_log(NULL, AV_LOG_INFO, "bench: wall=%.3fs utime=%.3fs stime=%.3fs cpu=%.0f%%\n",
+           elapsed, utime, stime, 100.0 * (utime + stime) / elapsed);
+    av_log(NULL, AV_LOG_INFO, "bench: read %"PRId64" packets (%.1f/s), decoded %"PRId64" frames (%.1f fps), "
+           "displayed %"PRId64" frames (%.1f fps), dropped %"PRId64"\n",
+           is->pkts_read, is->pkts_read / elapsed,
+           is->frames_decoded, is->frames_decoded / elapsed,
+           is->frames_displayed, is->frames_displayed / elapsed, is->frame_drops_late);
+    av_log(NULL, AV_LOG_INFO, "bench: occupancy videoq avg %.1f max %d packets, audioq avg %.1f max %d packets, "
+           "pictq avg %.2f of %d\n",
+           (double)is->videoq_packets_sum / n, is->videoq_packets_max,
+           (double)is->audioq_packets_sum / n, is->audioq_packets_max,
+           (double)is->pictq_sum / n, VIDEO_PICTURE_QUEUE_SIZE);
+}
+
 static void stream_close(VideoState *is)
 {
+    /* wake up read_thread and the decoder if they are parked on a queue */
+    packet_queue_abort(&is->videoq);
+    packet_queue_abort(&is->audioq);
     SDL_WaitThread(is->read_tid, NULL);
+    SDL_WaitThread(is->index_tid, NULL);
+    kfidx_close(&is->kfidx);
 
     /* close each stream */
     if (is->audio_index >= 0)
@@ -1079,13 +2526,30 @@ static void stream_close(VideoState *is)
     if (is->video_index >= 0)
         stream_component_close(is, is->video_index);
 
-    avformat_close_input(&is->ic);
-
+    input_close(&is->ic);
+
+    if (benchmark || autoexit)
+        print_benchmark_report(is);
+    if (is->read_waits)
+        av_log(NULL, AV_LOG_INFO,
+               "read_thread: %"PRId64" backpressure waits, refill latency avg %"PRId64" us, max %"PRId64" us\n",
+               is->read_waits, is->refill_latency_sum / is->read_waits, is->refill_latency_max);
+    if (is->seeks)
+        av_log(NULL, AV_LOG_INFO,
+               "seek: %"PRId64" seeks, first frame after avg %.1f ms, max %.1f ms, %"PRId64" frames decoded and discarded\n",
+               is->seeks, is->seek_latency_sum / 1000.0 / is->seeks, is->seek_latency_max / 1000.0,
+               is->frames_discarded_seek);
+    packet_pool_log_stats(&is->videoq.pool, "video");
+    packet_pool_log_stats(&is->audioq.pool, "audio");
     packet_queue_destroy(&is->videoq);
     packet_queue_destroy(&is->audioq);
 
     frame_queue_destory(&is->pictq);
 
+    SDL_DestroyCond(is->continue_read_thread);
+    SDL_DestroyMutex(is->wait_mutex);
+    SDL_DestroyMutex(is->audio_clock_mutex);
+
     av_free(is->filename);
     if(is->texture)
         SDL_DestroyTexture(is->texture);
@@ -1108,10 +2572,19 @@ static VideoState* stream_open(const char* filename){
   }
   is->ytop    = 0;
   is->xleft   = 0;
+  is->start_time = av_gettime_relative();
+  is->seek_discard_serial = -1;
+
+  if(!(is->wait_mutex = SDL_CreateMutex()) ||
+     !(is->audio_clock_mutex = SDL_CreateMutex()) ||
+     !(is->continue_read_thread = SDL_CreateCond())) {
+    av_log(NULL, AV_LOG_FATAL, "SDL_CreateCond(): %s\n", SDL_GetError());
+    goto __ERROR;
+  }
 
   //初始化packet queue
-  if(packet_queue_init(&is->videoq) < 0 ||
-      packet_queue_init(&is->audioq) < 0) {
+  if(packet_queue_init(&is->videoq, is->wait_mutex, is->continue_read_thread) < 0 ||
+      packet_queue_init(&is->audioq, is->wait_mutex, is->continue_read_thread) < 0) {
       goto __ERROR;
       }
   
@@ -1130,8 +2603,8 @@ static VideoState* stream_open(const char* filename){
         goto __ERROR;
   }
 
-  //set timer for show picture
-  schedule_refresh(is, 40);
+  //first refresh
+  schedule_refresh(is, 0.040);
 
   return is;
 
@@ -1154,18 +2627,87 @@ static void do_exit(VideoState *is){
     exit(0);
 }
 
+/* present pictures on time between SDL events */
+static void refresh_loop_wait_event(VideoState *is, SDL_Event *event) {
+  SDL_PumpEvents();
+  while(!SDL_PeepEvents(event, 1, SDL_GETEVENT, SDL_FIRSTEVENT, SDL_LASTEVENT)) {
+    presentation_wait(is);
+    if(av_gettime_relative() >= is->refresh_deadline)
+      video_refresh_timer(is);
+    SDL_PumpEvents();
+  }
+}
+
+/*
+ * Seek incr seconds from the current position. A fast seek starts playing
+ * at the keyframe the demuxer lands on; a precise one decodes from there
+ * and discards everything before the target.
+ */
+static void stream_seek(VideoState *is, double incr, int precise)
+{
+  double pos;
+
+  if(!is->ic || atomic_load(&is->seek_req))
+    return;
+
+  pos = get_master_clock(is);
+  if(isnan(pos))
+    pos = (double)is->seek_pos / AV_TIME_BASE;
+  pos += incr;
+  if(is->ic->start_time != AV_NOPTS_VALUE && pos < is->ic->start_time / (double)AV_TIME_BASE)
+    pos = is->ic->start_time / (double)AV_TIME_BASE;
+
+  is->seek_pos = (int64_t)(pos * AV_TIME_BASE);
+  is->seek_rel = (int64_t)(incr * AV_TIME_BASE);
+  is->seek_precise = precise;
+  is->seek_request_time = av_gettime_relative();
+  is->seek_from_serial = atomic_load(&is->videoq.serial);
+  atomic_store(&is->seek_req, 1);
+
+  SDL_LockMutex(is->wait_mutex);
+  SDL_CondSignal(is->continue_read_thread);
+  SDL_UnlockMutex(is->wait_mutex);
+}
+
 static void sdl_event_loop(VideoState *is){
   SDL_Event       event;
+  double          incr;
   for(;;) {
-    SDL_WaitEvent(&event);
+    refresh_loop_wait_event(is, &event);
     switch(event.type) {
+      case SDL_KEYDOWN:
+        switch(event.key.keysym.sym) {
+          case SDLK_LEFT:
+            incr = -10.0;
+            goto do_seek;
+          case SDLK_RIGHT:
+            incr = 10.0;
+            goto do_seek;
+          case SDLK_DOWN:
+            incr = -60.0;
+            goto do_seek;
+          case SDLK_UP:
+            incr = 60.0;
+          do_seek:
+            //with shift held, land exactly on the target instead of the keyframe
+            stream_seek(is, incr, !!(event.key.keysym.mod & KMOD_SHIFT));
+            break;
+          default:
+            break;
+        }
+        break;
       case FF_QUIT_EVENT:
       case SDL_QUIT:
         is->quit = 1;
         do_exit(is);
         break;
-      case FF_REFRESH_EVENT:
-        video_refresh_timer(event.user.data1);
+      case SDL_WINDOWEVENT:
+        if(event.window.event == SDL_WINDOWEVENT_SIZE_CHANGED) {
+          //the decode thread picks the new size up and rebuilds its scaler
+          is->width  = event.window.data1;
+          is->height = event.window.data2;
+          atomic_store(&is->window_size, (unsigned)is->width << 16 | (is->height & 0xffff));
+        }
         break;
       default:
         break;
@@ -1173,6 +2715,34 @@ static void sdl_event_loop(VideoState *is){
   }
 }
 
+static int create_window(void) {
+  //creat window from SDL
+  win = SDL_CreateWindow("Media Player",
+                         SDL_WINDOWPOS_UNDEFINED,
+                         SDL_WINDOWPOS_UNDEFINED,
+                         default_width, default_height,
+                         SDL_WINDOW_OPENGL | SDL_WINDOW_RESIZABLE);
+  if(win) {
+    SDL_RendererInfo info;
+    SDL_DisplayMode mode;
+
+    renderer = SDL_CreateRenderer(win, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
+    if(!renderer) {
+      av_log(NULL, AV_LOG_WARNING, "Failed to initialize a hardware accelerated renderer: %s\n", SDL_GetError());
+      renderer = SDL_CreateRenderer(win, -1, 0);
+    }
+    if(renderer && !SDL_GetRendererInfo(renderer, &info))
+      renderer_info = info;
+    if(renderer && (renderer_info.flags & SDL_RENDERER_PRESENTVSYNC) &&
+       !SDL_GetCurrentDisplayMode(SDL_GetWindowDisplayIndex(win), &mode) && mode.refresh_rate > 0) {
+      vsync_interval = 1000000 / mode.refresh_rate;
+      av_log(NULL, AV_LOG_INFO, "renderer %s presents on vsync, %d Hz\n", info.name, mode.refresh_rate);
+    }
+  }
+
+  return win && renderer ? 0 : -1;
+}
+
 int main(int argc, char *argv[]) {
 
   int 		  ret = 0;
@@ -1181,31 +2751,75 @@ int main(int argc, char *argv[]) {
 
   av_log_set_level(AV_LOG_INFO);
 
-  if(argc < 2) {
-    fprintf(stderr, "Usage: command <file>\n");
-    exit(1);
+  //get options and filename
+  for(int i = 1; i < argc; i++) {
+    if(!strcmp(argv[i], "-nodisp")) {
+      display_disable = 1;
+    } else if(!strcmp(argv[i], "-noaudio")) {
+      audio_disable = 1;
+    } else if(!strcmp(argv[i], "-autoexit")) {
+      autoexit = 1;
+    } else if(!strcmp(argv[i], "-threads") && i + 1 < argc) {
+      decoder_threads = atoi(argv[++i]);
+    } else if(!strcmp(argv[i], "-thread_type") && i + 1 < argc) {
+      i++;
+      if(!strcmp(argv[i], "frame"))
+        decoder_thread_type = FF_THREAD_FRAME;
+      else if(!strcmp(argv[i], "slice"))
+        decoder_thread_type = FF_THREAD_SLICE;
+      else if(!strcmp(argv[i], "auto"))
+        decoder_thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+      else {
+        av_log(NULL, AV_LOG_FATAL, "Unknown thread type: %s\n", argv[i]);
+        input_filename = NULL;
+        break;
+      }
+    } else if(!strcmp(argv[i], "-benchmark")) {
+      //headless, unsynchronized, report and quit at the end
+      benchmark = display_disable = audio_disable = autoexit = 1;
+    } else if(!strcmp(argv[i], "-build_index")) {
+      build_index = 1;
+    } else if(!strcmp(argv[i], "-fast")) {
+      probe_flags |= PROBE_CACHE_FAST;
+    } else if(!strcmp(argv[i], "-probe_cache")) {
+      probe_flags |= PROBE_CACHE_STORE;
+    } else if(!strcmp(argv[i], "-io") && i + 1 < argc) {
+      i++;
+      if(!strcmp(argv[i], "file"))
+        input_io = INPUT_IO_FILE;
+      else if(!strcmp(argv[i], "mmap"))
+        input_io = INPUT_IO_MMAP;
+      else if(!strcmp(argv[i], "async"))
+        input_io = INPUT_IO_ASYNC;
+      else
+        av_log(NULL, AV_LOG_WARNING, "Unknown io backend %s, using mmap\n", argv[i]);
+    } else if(argv[i][0] == '-' && argv[i][1]) {
+      av_log(NULL, AV_LOG_FATAL, "Unknown option: %s\n", argv[i]);
+      input_filename = NULL;
+      break;
+    } else {
+      input_filename = argv[i];
+    }
   }
 
-  //get filename
-  input_filename = argv[1];
+  if(!input_filename) {
+    fprintf(stderr, "Usage: command [-nodisp] [-noaudio] [-autoexit] [-benchmark]\n"
+                    "               [-threads n] [-thread_type frame|slice|auto] [-build_index]\n"
+                    "               [-fast] [-probe_cache] [-io file|mmap|async] <file>\n");
+    exit(1);
+  }
 
-  flags = SDL_INIT_VIDEO | SDL_INIT_AUDIO | SDL_INIT_TIMER;
+  flags = SDL_INIT_TIMER | SDL_INIT_EVENTS;
+  if(!display_disable)
+    flags |= SDL_INIT_VIDEO;
+  if(!audio_disable)
+    flags |= SDL_INIT_AUDIO;
   if(SDL_Init(flags)) {
     av_log(NULL, AV_LOG_FATAL, "Could not initialize SDL - %s\n", SDL_GetError());
     exit(1);
   }
 
-  //creat window from SDL
-  win = SDL_CreateWindow("Media Player",
-                         SDL_WINDOWPOS_UNDEFINED,
-                         SDL_WINDOWPOS_UNDEFINED,
-						             default_width, default_height,
-                         SDL_WINDOW_OPENGL | SDL_WINDOW_RESIZABLE);
-  if(win) {
-    renderer = SDL_CreateRenderer(win, -1, 0);
-  }
-
-  if(!win || !renderer){
+  if(!display_disable && create_window() < 0){
       av_log(NULL, AV_LOG_FATAL, "Failed to create window or renderer!\n");
       do_exit(NULL);
   }
@@ -0,0 +1,9 @@
+#!/bin/bash
+
+# io_uring read-ahead when liburing is installed, pread() threads otherwise
+URING=`pkg-config --exists liburing && echo "-DHAVE_LIBURING=1 $(pkg-config --libs --cflags liburing)"`
+
+clang -O2 -g -o demux_bench demux_bench.c ../common/async_io.c ../common/mmap_io.c `pkg-config --libs --cflags libavutil libavformat libavcodec` -lpthread -lm $URING
+
+# the player's SPSC ring against the AVFifo + SDL_mutex queue it replaced
+clang -O2 -g -o packet_queue_bench packet_queue_bench.c `pkg-config --libs --cflags libavutil libavcodec sdl2` -lpthread
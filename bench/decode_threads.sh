@@ -0,0 +1,39 @@
+#!/bin/bash
+
+# Decoder threading matrix for the player: -threads x -thread_type on synthetic
+# 1080p and 4K clips, each run headless with -benchmark.
+#  ./decode_threads.sh [seconds] [workdir]
+# Needs ffmpeg with libx264 to generate the clips and ../8-3/player built.
+
+SECONDS_PER_CLIP=${1:-20}
+WORKDIR=${2:-/tmp/decode_threads}
+PLAYER=`dirname $0`/../8-3/player
+THREADS="1 2 4 8 0"
+TYPES="frame slice auto"
+
+mkdir -p $WORKDIR || exit 1
+
+# testsrc2 is cheap to generate and busy enough that every frame costs real decoding;
+# the 4K clip uses 8 slices per frame so slice threading has something to split
+gen() {
+    [ -f "$1" ] && return
+    ffmpeg -hide_banner -loglevel error -f lavfi -i testsrc2=size=$2:rate=30:duration=$SECONDS_PER_CLIP \
+           -c:v libx264 -preset veryfast -x264-params slices=8 -pix_fmt yuv420p -y "$1" || exit 1
+}
+gen $WORKDIR/testsrc_1080p.mp4 1920x1080
+gen $WORKDIR/testsrc_4k.mp4 3840x2160
+
+printf "%-20s %-8s %-6s %10s %8s %8s\n" clip threads type fps cpu wall
+for clip in $WORKDIR/testsrc_1080p.mp4 $WORKDIR/testsrc_4k.mp4; do
+    for t in $THREADS; do
+        for type in $TYPES; do
+            log=`$PLAYER -benchmark -threads $t -thread_type $type $clip 2>&1`
+            fps=`echo "$log" | sed -n 's/.*decoded [0-9]* frames (\([0-9.]*\) fps).*/\1/p'`
+            cpu=`echo "$log" | sed -n 's/.*cpu=\([0-9]*%\).*/\1/p'`
+            wall=`echo "$log" | sed -n 's/.*wall=\([0-9.]*s\).*/\1/p'`
+            # 0 is libavcodec's auto count, show what it picked
+            [ $t = 0 ] && t=auto:`echo "$log" | sed -n 's/.*video decoder: [^,]*, \([0-9]*\) threads.*/\1/p'`
+            printf "%-20s %-8s %-6s %10s %8s %8s\n" `basename $clip` $t $type "$fps" "$cpu" "$wall"
+        done
+    done
+done
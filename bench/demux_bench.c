@@ -0,0 +1,165 @@
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <libavutil/avutil.h>
+#include <libavutil/time.h>
+#include <libavformat/avformat.h>
+
+#include "../common/async_io.h"
+#include "../common/mmap_io.h"
+
+// 纯解复用吞吐测试: 只 av_read_frame, 不解码
+// 对每个文件交替跑 file 协议 / mmap / 异步预读, 每种方式取最好的一次
+// 大文件 (几 GB) 才看得出差别
+// -cold: 每次之前把文件从页缓存里踢掉 (POSIX_FADV_DONTNEED, 不需要 root), 测冷启动磁盘 I/O
+//  ./demux_bench -runs 3 -cold big1.mkv big2.mp4
+
+enum { MODE_FILE, MODE_MMAP, MODE_ASYNC, NB_MODES };
+
+static const char *mode_names[NB_MODES] = { "file", "mmap", "async" };
+
+typedef struct BenchResult {
+    int64_t bytes;
+    int64_t packets;
+    int64_t usec;
+    int64_t stalls;     ///< async only: reads that waited on the disk
+    int64_t stall_time;
+} BenchResult;
+
+/* drop the file's pages from the page cache */
+static void evict_file(const char *filename)
+{
+    int fd = open(filename, O_RDONLY);
+
+    if (fd < 0)
+        return;
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+}
+
+static int demux_pass(const char *filename, int mode, BenchResult *res)
+{
+    AVFormatContext *ic = NULL;
+    AVPacket *pkt = NULL;
+    AsyncIOStats st;
+    int64_t start;
+    int ret;
+
+    memset(res, 0, sizeof(*res));
+    start = av_gettime_relative();
+
+    if (mode == MODE_MMAP)
+        ret = mmap_io_open_input(&ic, filename, NULL, NULL);
+    else if (mode == MODE_ASYNC)
+        ret = async_io_open_input(&ic, filename, NULL, NULL);
+    else
+        ret = avformat_open_input(&ic, filename, NULL, NULL);
+    if (ret < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Could not open %s: %s\n", filename, av_err2str(ret));
+        return ret;
+    }
+    if (mode != MODE_FILE && !(ic->flags & AVFMT_FLAG_CUSTOM_IO))
+        av_log(NULL, AV_LOG_WARNING, "%s is not a regular file, using the file protocol\n", filename);
+
+    pkt = av_packet_alloc();
+    if (!pkt) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    while ((ret = av_read_frame(ic, pkt)) >= 0) {
+        res->bytes += pkt->size;
+        res->packets++;
+        av_packet_unref(pkt);
+    }
+    if (ret == AVERROR_EOF)
+        ret = 0;
+    else
+        av_log(NULL, AV_LOG_ERROR, "Error reading %s: %s\n", filename, av_err2str(ret));
+
+end:
+    res->usec = av_gettime_relative() - start;
+    av_packet_free(&pkt);
+    if (mode == MODE_MMAP) {
+        mmap_io_close_input(&ic);
+    } else if (mode == MODE_ASYNC) {
+        if (ic->flags & AVFMT_FLAG_CUSTOM_IO) {
+            async_io_get_stats(ic->pb, &st);
+            res->stalls = st.stalls;
+            res->stall_time = st.stall_time;
+        }
+        async_io_close_input(&ic);
+    } else {
+        avformat_close_input(&ic);
+    }
+    return ret;
+}
+
+static void print_result(int mode, const BenchResult *r)
+{
+    double sec = r->usec / 1000000.0;
+
+    printf("  %-5s %8.1f MB/s %10.0f pkt/s  (%" PRId64 " packets, %.1f MB, %.3f s)",
+           mode_names[mode], r->bytes / (1024.0 * 1024.0) / sec, r->packets / sec,
+           r->packets, r->bytes / (1024.0 * 1024.0), sec);
+    if (mode == MODE_ASYNC)
+        printf("  %" PRId64 " stalls, %.1f ms", r->stalls, r->stall_time / 1000.0);
+    printf("\n");
+}
+
+int main(int argc, char *argv[])
+{
+    int runs = 3;
+    int cold = 0;
+    int i, run, mode;
+    int ret = 0;
+
+    av_log_set_level(AV_LOG_ERROR);
+
+    for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+        if (!strcmp(argv[i], "-runs") && i + 1 < argc)
+            runs = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-cold"))
+            cold = 1;
+        else
+            break;
+    }
+    if (i >= argc || runs <= 0) {
+        fprintf(stderr, "Usage: %s [-runs n] [-cold] file...\n", argv[0]);
+        return 1;
+    }
+
+    for (; i < argc; i++) {
+        BenchResult best[NB_MODES] = { { 0 } };
+
+        printf("%s%s\n", argv[i], cold ? " (cold page cache)" : "");
+        for (run = 0; run < runs; run++) {
+            // 交替跑, 各方式吃到的页缓存状态尽量一样
+            for (mode = 0; mode < NB_MODES; mode++) {
+                BenchResult r;
+
+                if (cold)
+                    evict_file(argv[i]);
+                if ((ret = demux_pass(argv[i], mode, &r)) < 0)
+                    break;
+                if (!best[mode].usec || r.usec < best[mode].usec)
+                    best[mode] = r;
+            }
+            if (ret < 0)
+                break;
+        }
+        if (ret < 0)
+            continue;
+        for (mode = 0; mode < NB_MODES; mode++)
+            print_result(mode, &best[mode]);
+        printf("  vs file: mmap %.2fx, async %.2fx\n",
+               (double)best[MODE_FILE].usec / best[MODE_MMAP].usec,
+               (double)best[MODE_FILE].usec / best[MODE_ASYNC].usec);
+    }
+
+    return ret < 0;
+}
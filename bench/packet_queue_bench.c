@@ -0,0 +1,388 @@
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <SDL.h>
+
+#include <libavutil/avutil.h>
+#include <libavutil/fifo.h>
+#include <libavutil/mem.h>
+#include <libavutil/time.h>
+#include <libavcodec/avcodec.h>
+
+// 播放器包队列的吞吐测试: 一个生产线程 put, 一个消费线程 get, 比较每秒能过多少个包
+//  fifo: 原来的 AVFifo + SDL_mutex/SDL_cond 队列, 每个包 av_packet_alloc
+//  ring: 8-3/player.c 现在的无锁 SPSC 环 + 包壳池, 空/满时才停在 cond 上
+// 两种都限制在同样的容量内 (原来的队列由 read_thread 按大小限流, 这里按包数)
+//  ./packet_queue_bench [-n packets] [-cap n] [-runs n]
+
+#define CACHE_LINE_SIZE 64
+
+/* ---- fifo: the queue the player used to have ---- */
+
+typedef struct FifoQueue {
+    AVFifo *pkt_list;
+    int nb_packets;
+    int cap;
+    int abort_request;
+    SDL_mutex *mutex;
+    SDL_cond *cond;
+} FifoQueue;
+
+static int fifo_init(FifoQueue *q, int cap)
+{
+    memset(q, 0, sizeof(*q));
+    q->pkt_list = av_fifo_alloc2(1, sizeof(AVPacket *), AV_FIFO_FLAG_AUTO_GROW);
+    q->mutex = SDL_CreateMutex();
+    q->cond = SDL_CreateCond();
+    q->cap = cap;
+    return q->pkt_list && q->mutex && q->cond ? 0 : AVERROR(ENOMEM);
+}
+
+static int fifo_put(FifoQueue *q, AVPacket *pkt)
+{
+    AVPacket *pkt1 = av_packet_alloc();
+    int ret;
+
+    if (!pkt1)
+        return AVERROR(ENOMEM);
+    av_packet_move_ref(pkt1, pkt);
+    SDL_LockMutex(q->mutex);
+    while (q->nb_packets >= q->cap && !q->abort_request)
+        SDL_CondWait(q->cond, q->mutex);
+    ret = q->abort_request ? -1 : av_fifo_write(q->pkt_list, &pkt1, 1);
+    if (ret >= 0)
+        q->nb_packets++;
+    SDL_CondSignal(q->cond);
+    SDL_UnlockMutex(q->mutex);
+    if (ret < 0)
+        av_packet_free(&pkt1);
+    return ret;
+}
+
+/* return < 0 if aborted, > 0 with a packet */
+static int fifo_get(FifoQueue *q, AVPacket *pkt)
+{
+    AVPacket *pkt1;
+
+    SDL_LockMutex(q->mutex);
+    while (av_fifo_read(q->pkt_list, &pkt1, 1) < 0) {
+        if (q->abort_request) {
+            SDL_UnlockMutex(q->mutex);
+            return -1;
+        }
+        SDL_CondWait(q->cond, q->mutex);
+    }
+    q->nb_packets--;
+    SDL_CondSignal(q->cond);
+    SDL_UnlockMutex(q->mutex);
+    av_packet_move_ref(pkt, pkt1);
+    av_packet_free(&pkt1);
+    return 1;
+}
+
+static void fifo_abort(FifoQueue *q)
+{
+    SDL_LockMutex(q->mutex);
+    q->abort_request = 1;
+    SDL_CondBroadcast(q->cond);
+    SDL_UnlockMutex(q->mutex);
+}
+
+static void fifo_destroy(FifoQueue *q)
+{
+    AVPacket *pkt;
+
+    while (q->pkt_list && av_fifo_read(q->pkt_list, &pkt, 1) >= 0)
+        av_packet_free(&pkt);
+    av_fifo_freep2(&q->pkt_list);
+    SDL_DestroyMutex(q->mutex);
+    SDL_DestroyCond(q->cond);
+}
+
+/* ---- ring: the player's SPSC ring, without the size/duration accounting ---- */
+
+typedef struct RingQueue {
+    AVPacket **pkts;
+    unsigned int mask;
+    char pad0[CACHE_LINE_SIZE];
+    atomic_uint windex;
+    char pad1[CACHE_LINE_SIZE - sizeof(atomic_uint)];
+    atomic_uint rindex;
+    char pad2[CACHE_LINE_SIZE - sizeof(atomic_uint)];
+    atomic_int waiters;
+    atomic_int abort_request;
+    SDL_mutex *mutex;
+    SDL_cond *cond;
+
+    /* shells travel back from the consumer, same as PacketPool */
+    AVPacket **shells;
+    atomic_uint pool_windex;
+    atomic_uint pool_rindex;
+} RingQueue;
+
+static int ring_init(RingQueue *q, int cap)
+{
+    unsigned int size = 1;
+
+    while (size < cap)
+        size <<= 1;
+    memset(q, 0, sizeof(*q));
+    q->mask = size - 1;
+    q->pkts = av_calloc(size, sizeof(*q->pkts));
+    q->shells = av_calloc(size, sizeof(*q->shells));
+    atomic_init(&q->windex, 0);
+    atomic_init(&q->rindex, 0);
+    atomic_init(&q->waiters, 0);
+    atomic_init(&q->abort_request, 0);
+    atomic_init(&q->pool_windex, 0);
+    atomic_init(&q->pool_rindex, 0);
+    q->mutex = SDL_CreateMutex();
+    q->cond = SDL_CreateCond();
+    return q->pkts && q->shells && q->mutex && q->cond ? 0 : AVERROR(ENOMEM);
+}
+
+static void ring_wake(RingQueue *q)
+{
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load(&q->waiters)) {
+        SDL_LockMutex(q->mutex);
+        SDL_CondBroadcast(q->cond);
+        SDL_UnlockMutex(q->mutex);
+    }
+}
+
+static void ring_park(RingQueue *q, int full)
+{
+    unsigned int used;
+
+    SDL_LockMutex(q->mutex);
+    atomic_fetch_add(&q->waiters, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+    used = atomic_load(&q->windex) - atomic_load(&q->rindex);
+    if (!atomic_load(&q->abort_request) &&
+        (full ? used > q->mask : used == 0))
+        SDL_CondWait(q->cond, q->mutex);
+    atomic_fetch_sub(&q->waiters, 1);
+    SDL_UnlockMutex(q->mutex);
+}
+
+static int ring_put(RingQueue *q, AVPacket *pkt)
+{
+    unsigned int windex = atomic_load_explicit(&q->windex, memory_order_relaxed);
+    unsigned int prindex = atomic_load_explicit(&q->pool_rindex, memory_order_relaxed);
+    AVPacket *pkt1;
+
+    if (atomic_load_explicit(&q->pool_windex, memory_order_acquire) != prindex) {
+        pkt1 = q->shells[prindex & q->mask];
+        atomic_store_explicit(&q->pool_rindex, prindex + 1, memory_order_release);
+    } else if (!(pkt1 = av_packet_alloc())) {
+        return AVERROR(ENOMEM);
+    }
+    av_packet_move_ref(pkt1, pkt);
+
+    while (windex - atomic_load_explicit(&q->rindex, memory_order_acquire) > q->mask) {
+        if (atomic_load(&q->abort_request)) {
+            av_packet_free(&pkt1);
+            return -1;
+        }
+        ring_park(q, 1);
+    }
+    q->pkts[windex & q->mask] = pkt1;
+    atomic_store_explicit(&q->windex, windex + 1, memory_order_release);
+    ring_wake(q);
+    return 0;
+}
+
+/* return < 0 if aborted, > 0 with a packet */
+static int ring_get(RingQueue *q, AVPacket *pkt)
+{
+    unsigned int rindex = atomic_load_explicit(&q->rindex, memory_order_relaxed);
+    unsigned int pwindex;
+    AVPacket *pkt1;
+
+    while (atomic_load_explicit(&q->windex, memory_order_acquire) == rindex) {
+        if (atomic_load(&q->abort_request))
+            return -1;
+        ring_park(q, 0);
+    }
+    pkt1 = q->pkts[rindex & q->mask];
+    av_packet_move_ref(pkt, pkt1);
+
+    pwindex = atomic_load_explicit(&q->pool_windex, memory_order_relaxed);
+    if (pwindex - atomic_load_explicit(&q->pool_rindex, memory_order_acquire) > q->mask) {
+        av_packet_free(&pkt1);
+    } else {
+        q->shells[pwindex & q->mask] = pkt1;
+        atomic_store_explicit(&q->pool_windex, pwindex + 1, memory_order_release);
+    }
+    atomic_store_explicit(&q->rindex, rindex + 1, memory_order_release);
+    ring_wake(q);
+    return 1;
+}
+
+static void ring_abort(RingQueue *q)
+{
+    SDL_LockMutex(q->mutex);
+    atomic_store(&q->abort_request, 1);
+    SDL_CondBroadcast(q->cond);
+    SDL_UnlockMutex(q->mutex);
+}
+
+static void ring_destroy(RingQueue *q)
+{
+    unsigned int i;
+
+    for (i = atomic_load(&q->rindex); i != atomic_load(&q->windex); i++)
+        av_packet_free(&q->pkts[i & q->mask]);
+    for (i = atomic_load(&q->pool_rindex); i != atomic_load(&q->pool_windex); i++)
+        av_packet_free(&q->shells[i & q->mask]);
+    av_freep(&q->pkts);
+    av_freep(&q->shells);
+    SDL_DestroyMutex(q->mutex);
+    SDL_DestroyCond(q->cond);
+}
+
+/* ---- driver ---- */
+
+enum { QUEUE_FIFO, QUEUE_RING, NB_QUEUES };
+
+static const char *queue_names[NB_QUEUES] = { "fifo", "ring" };
+
+typedef struct BenchRun {
+    int type;
+    FifoQueue fifo;
+    RingQueue ring;
+    int64_t nb_packets;
+    AVPacket *model;   ///< every packet is a reference to its data, like demuxed ones
+    int64_t checksum;  ///< consumer side, keeps the gets honest
+    atomic_int error;  ///< set by the producer when it stops short
+} BenchRun;
+
+static int producer_thread(void *arg)
+{
+    BenchRun *b = arg;
+    AVPacket *pkt = av_packet_alloc();
+    int64_t i;
+    int ret = 0;
+
+    for (i = 0; pkt && i < b->nb_packets && ret >= 0; i++) {
+        if ((ret = av_packet_ref(pkt, b->model)) < 0)
+            break;
+        pkt->pts = i;
+        ret = b->type == QUEUE_FIFO ? fifo_put(&b->fifo, pkt) : ring_put(&b->ring, pkt);
+    }
+    if (!pkt || ret < 0) {
+        // 消费线程可能正停在 get 上, 中止队列让它返回
+        atomic_store(&b->error, pkt ? ret : AVERROR(ENOMEM));
+        if (b->type == QUEUE_FIFO)
+            fifo_abort(&b->fifo);
+        else
+            ring_abort(&b->ring);
+    }
+    av_packet_free(&pkt);
+    return 0;
+}
+
+static int bench_run(int type, int64_t nb_packets, int cap, double *rate)
+{
+    BenchRun b = { 0 };
+    SDL_Thread *producer;
+    AVPacket *pkt;
+    int64_t i, start, usec;
+    int ret;
+
+    b.type = type;
+    b.nb_packets = nb_packets;
+    atomic_init(&b.error, 0);
+    b.model = av_packet_alloc();
+    pkt = av_packet_alloc();
+    if (!b.model || !pkt || av_new_packet(b.model, 1024) < 0) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    ret = type == QUEUE_FIFO ? fifo_init(&b.fifo, cap) : ring_init(&b.ring, cap);
+    if (ret < 0)
+        goto end;
+
+    start = av_gettime_relative();
+    producer = SDL_CreateThread(producer_thread, "producer", &b);
+    if (!producer) {
+        ret = AVERROR(EAGAIN);
+        goto end;
+    }
+    for (i = 0; i < nb_packets; i++) {
+        if ((type == QUEUE_FIFO ? fifo_get(&b.fifo, pkt) : ring_get(&b.ring, pkt)) < 0)
+            break;
+        b.checksum += pkt->pts;
+        av_packet_unref(pkt);
+    }
+    SDL_WaitThread(producer, NULL);
+    usec = FFMAX(av_gettime_relative() - start, 1);
+
+    if ((ret = atomic_load(&b.error)) < 0) {
+        fprintf(stderr, "%s: producer failed: %s\n", queue_names[type], av_err2str(ret));
+        goto end;
+    }
+    if (b.checksum != nb_packets * (nb_packets - 1) / 2) {
+        fprintf(stderr, "%s: packets lost or reordered\n", queue_names[type]);
+        ret = AVERROR_BUG;
+        goto end;
+    }
+    *rate = nb_packets * 1000000.0 / usec;
+
+end:
+    if (type == QUEUE_FIFO)
+        fifo_destroy(&b.fifo);
+    else
+        ring_destroy(&b.ring);
+    av_packet_free(&b.model);
+    av_packet_free(&pkt);
+    return ret;
+}
+
+int main(int argc, char *argv[])
+{
+    int64_t nb_packets = 2000000;
+    int cap = 1024;
+    int runs = 3;
+    double best[NB_QUEUES] = { 0 }, rate;
+    int i, run, type;
+
+    for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+        if (!strcmp(argv[i], "-n") && i + 1 < argc)
+            nb_packets = atoll(argv[++i]);
+        else if (!strcmp(argv[i], "-cap") && i + 1 < argc)
+            cap = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-runs") && i + 1 < argc)
+            runs = atoi(argv[++i]);
+        else
+            break;
+    }
+    if (i < argc || nb_packets <= 0 || cap <= 0 || runs <= 0) {
+        fprintf(stderr, "Usage: %s [-n packets] [-cap n] [-runs n]\n", argv[0]);
+        return 1;
+    }
+    if (SDL_Init(0) < 0) {
+        fprintf(stderr, "SDL_Init(): %s\n", SDL_GetError());
+        return 1;
+    }
+
+    // 交替跑, 取每种最好的一次
+    for (run = 0; run < runs; run++) {
+        for (type = 0; type < NB_QUEUES; type++) {
+            if (bench_run(type, nb_packets, cap, &rate) < 0)
+                return 1;
+            best[type] = FFMAX(best[type], rate);
+        }
+    }
+    printf("%"PRId64" packets, capacity %d, 1 producer + 1 consumer\n", nb_packets, cap);
+    for (type = 0; type < NB_QUEUES; type++)
+        printf("  %-4s %12.0f pkt/s\n", queue_names[type], best[type]);
+    printf("  ring vs fifo: %.2fx\n", best[QUEUE_RING] / best[QUEUE_FIFO]);
+
+    SDL_Quit();
+    return 0;
+}
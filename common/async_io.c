@@ -0,0 +1,543 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#if HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+#include <libavutil/common.h>
+#include <libavutil/error.h>
+#include <libavutil/mem.h>
+#include <libavutil/time.h>
+#include <libavformat/avformat.h>
+
+#include "async_io.h"
+
+#define ASYNC_IO_BUFFER_SIZE (64 * 1024)
+
+enum {
+    BLOCK_FREE,
+    BLOCK_QUEUED,  ///< waiting for a pread() thread, or submitted to the ring
+    BLOCK_RUNNING, ///< being read by a pread() thread
+    BLOCK_DONE,
+};
+
+typedef struct AsyncBlock {
+    uint8_t *data;
+    int64_t num;         ///< block number, the block starts at num * ASYNC_IO_BLOCK_SIZE
+    int state;
+    int len;             ///< bytes read, or an AVERROR
+    int64_t submit_time;
+    int64_t done_time;
+} AsyncBlock;
+
+typedef struct AsyncIO {
+    int fd;
+    int64_t size;
+    int64_t nb_blocks;
+    int64_t pos;
+
+    /* blocks [head, tail) are in flight or read, block n lives in blocks[n % ASYNC_IO_MAX_WINDOW] */
+    AsyncBlock blocks[ASYNC_IO_MAX_WINDOW];
+    int64_t head;
+    int64_t tail;
+    int inflight;
+
+    int window;
+    double read_time;    ///< us to read one block, averaged
+    double consume_time; ///< us the demuxer takes to go through one block, averaged
+    int64_t last_consumed;
+    AsyncIOStats stats;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+#if HAVE_LIBURING
+    struct io_uring ring;
+#endif
+    int uring;
+    pthread_t workers[ASYNC_IO_THREADS];
+    int nb_workers;
+    int64_t next_job;    ///< next queued block for the pread() threads
+    int abort;
+    int error;           ///< io_uring refused a submission, nothing more is queued
+} AsyncIO;
+
+static inline AsyncBlock *block_get(AsyncIO *s, int64_t num)
+{
+    return &s->blocks[num % ASYNC_IO_MAX_WINDOW];
+}
+
+static inline int block_expected(AsyncIO *s, AsyncBlock *b)
+{
+    return FFMIN(ASYNC_IO_BLOCK_SIZE, s->size - b->num * ASYNC_IO_BLOCK_SIZE);
+}
+
+static void *async_io_worker(void *arg)
+{
+    AsyncIO *s = arg;
+
+    pthread_mutex_lock(&s->lock);
+    while (!s->abort) {
+        AsyncBlock *b;
+        ssize_t n;
+        int len;
+
+        if (s->next_job >= s->tail) {
+            pthread_cond_wait(&s->cond, &s->lock);
+            continue;
+        }
+        b = block_get(s, s->next_job++);
+        if (b->state != BLOCK_QUEUED)
+            continue;
+        b->state = BLOCK_RUNNING;
+        pthread_mutex_unlock(&s->lock);
+
+        n = pread(s->fd, b->data, block_expected(s, b), b->num * ASYNC_IO_BLOCK_SIZE);
+        len = n < 0 ? AVERROR(errno) : n;
+
+        pthread_mutex_lock(&s->lock);
+        b->len = len;
+        b->done_time = av_gettime_relative();
+        b->state = BLOCK_DONE;
+        s->inflight--;
+        pthread_cond_broadcast(&s->cond);
+    }
+    pthread_mutex_unlock(&s->lock);
+    return NULL;
+}
+
+#if HAVE_LIBURING
+/* collect completions, waiting for at least one if wait is set */
+static void async_io_reap(AsyncIO *s, int wait)
+{
+    struct io_uring_cqe *cqe;
+    AsyncBlock *b;
+    int ret;
+
+    while (s->inflight) {
+        ret = wait ? io_uring_wait_cqe(&s->ring, &cqe) : io_uring_peek_cqe(&s->ring, &cqe);
+        if (ret < 0)
+            break;
+        b = io_uring_cqe_get_data(cqe);
+        b->len = cqe->res;
+        b->done_time = av_gettime_relative();
+        b->state = BLOCK_DONE;
+        s->inflight--;
+        io_uring_cqe_seen(&s->ring, cqe);
+        wait = 0;
+    }
+}
+
+/*
+ * Submit the last count blocks queued. SQEs the kernel did not take stay in
+ * the ring and would go out with any later submit, so on a hard error the
+ * blocks behind them fail and the ring takes nothing more.
+ */
+static int async_io_submit(AsyncIO *s, int count)
+{
+    int ret = 0;
+
+    while (count) {
+        ret = io_uring_submit(&s->ring);
+        if (ret > 0) {
+            count -= FFMIN(ret, count);
+            continue;
+        }
+        if (ret == -EINTR)
+            continue;
+        /* out of resources: make room by collecting what did go out */
+        if ((ret == -EAGAIN || ret == -EBUSY) && s->inflight > count) {
+            async_io_reap(s, 1);
+            continue;
+        }
+        ret = ret < 0 ? AVERROR(-ret) : AVERROR(EIO);
+        break;
+    }
+    if (!count)
+        return 0;
+
+    pthread_mutex_lock(&s->lock);
+    for (; count; count--) {
+        AsyncBlock *b = block_get(s, s->tail - count);
+        b->len = ret;
+        b->done_time = av_gettime_relative();
+        b->state = BLOCK_DONE;
+        s->inflight--;
+    }
+    s->error = ret;
+    pthread_mutex_unlock(&s->lock);
+    return ret;
+}
+#endif
+
+/*
+ * Keep window blocks in flight past the head. Returns the error that stopped
+ * it short of that; whatever was queued before stays queued.
+ */
+static int async_io_fill(AsyncIO *s)
+{
+    int submitted = 0, ret = 0;
+
+    if (s->error)
+        return s->error;
+    pthread_mutex_lock(&s->lock);
+    while (s->tail < s->head + s->window && s->tail < s->nb_blocks) {
+        AsyncBlock *b = block_get(s, s->tail);
+
+        if (!b->data && !(b->data = av_malloc(ASYNC_IO_BLOCK_SIZE))) {
+            ret = AVERROR(ENOMEM);
+            break;
+        }
+        b->num = s->tail;
+        b->len = 0;
+        b->submit_time = av_gettime_relative();
+#if HAVE_LIBURING
+        if (s->uring) {
+            struct io_uring_sqe *sqe = io_uring_get_sqe(&s->ring);
+            if (!sqe) {
+                ret = AVERROR(EBUSY);
+                break;
+            }
+            io_uring_prep_read(sqe, s->fd, b->data, block_expected(s, b),
+                               b->num * ASYNC_IO_BLOCK_SIZE);
+            io_uring_sqe_set_data(sqe, b);
+        }
+#endif
+        b->state = BLOCK_QUEUED;
+        s->tail++;
+        s->inflight++;
+        submitted++;
+    }
+    if (submitted && !s->uring)
+        pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+
+#if HAVE_LIBURING
+    if (s->uring) {
+        if (submitted) {
+            int err = async_io_submit(s, submitted);
+            if (err < 0)
+                ret = err;
+        }
+        async_io_reap(s, 0);
+    }
+#endif
+    return ret;
+}
+
+static void async_io_wait(AsyncIO *s, AsyncBlock *b, int stall)
+{
+    int64_t start;
+
+    pthread_mutex_lock(&s->lock);
+    if (b->state == BLOCK_DONE) {
+        pthread_mutex_unlock(&s->lock);
+        return;
+    }
+    start = av_gettime_relative();
+#if HAVE_LIBURING
+    if (s->uring) {
+        /* completions are only ever collected on this thread */
+        pthread_mutex_unlock(&s->lock);
+        while (b->state != BLOCK_DONE && s->inflight)
+            async_io_reap(s, 1);
+        pthread_mutex_lock(&s->lock);
+    }
+#endif
+    while (b->state != BLOCK_DONE && !s->uring)
+        pthread_cond_wait(&s->cond, &s->lock);
+    pthread_mutex_unlock(&s->lock);
+
+    if (stall) {
+        s->stats.stalls++;
+        s->stats.stall_time += av_gettime_relative() - start;
+        /* the window fell short, don't wait for the averages to catch up */
+        s->window = FFMIN(s->window + 1, ASYNC_IO_MAX_WINDOW);
+    }
+}
+
+/* drop every block, e.g. on a seek out of the window */
+static void async_io_reset(AsyncIO *s, int64_t num)
+{
+    int i;
+
+#if HAVE_LIBURING
+    if (s->uring) {
+        while (s->inflight)
+            async_io_reap(s, 1);
+    }
+#endif
+    pthread_mutex_lock(&s->lock);
+    /* blocks no thread has picked up yet are simply forgotten */
+    for (; s->next_job < s->tail; s->next_job++) {
+        AsyncBlock *b = block_get(s, s->next_job);
+        if (b->state == BLOCK_QUEUED) {
+            b->state = BLOCK_FREE;
+            s->inflight--;
+        }
+    }
+    while (s->inflight && !s->uring)
+        pthread_cond_wait(&s->cond, &s->lock);
+    for (i = 0; i < ASYNC_IO_MAX_WINDOW; i++)
+        s->blocks[i].state = BLOCK_FREE;
+    s->head = s->tail = s->next_job = num;
+    s->last_consumed = 0;
+    pthread_mutex_unlock(&s->lock);
+}
+
+/* the demuxer is done with the head block */
+static void async_io_consume(AsyncIO *s)
+{
+    AsyncBlock *b = block_get(s, s->head);
+    int64_t now = av_gettime_relative();
+    int target;
+
+    s->read_time = s->read_time ? 0.875 * s->read_time + 0.125 * (b->done_time - b->submit_time)
+                                : b->done_time - b->submit_time;
+    if (s->last_consumed)
+        s->consume_time = s->consume_time ? 0.875 * s->consume_time + 0.125 * (now - s->last_consumed)
+                                          : now - s->last_consumed;
+    s->last_consumed = now;
+
+    /* enough blocks in flight to cover one read at the current consumption rate */
+    if (s->consume_time > 0) {
+        target = FFMIN(ceil(s->read_time / s->consume_time), ASYNC_IO_MAX_WINDOW) + 1;
+        target = av_clip(target, ASYNC_IO_MIN_WINDOW, ASYNC_IO_MAX_WINDOW);
+        s->window = target > s->window ? target : FFMAX(target, s->window - 1);
+    }
+    s->stats.max_window = FFMAX(s->stats.max_window, s->window);
+
+    pthread_mutex_lock(&s->lock);
+    b->state = BLOCK_FREE;
+    s->head++;
+    pthread_mutex_unlock(&s->lock);
+}
+
+static int async_io_read(void *opaque, uint8_t *buf, int buf_size)
+{
+    AsyncIO *s = opaque;
+    AsyncBlock *b;
+    int64_t num;
+    int off, len, ret;
+
+    if (s->pos >= s->size)
+        return AVERROR_EOF;
+
+    num = s->pos / ASYNC_IO_BLOCK_SIZE;
+    if (num < s->head || num >= s->tail)
+        async_io_reset(s, num);
+    /* skipped forward inside the window */
+    while (s->head < num) {
+        async_io_wait(s, block_get(s, s->head), 0);
+        async_io_consume(s);
+    }
+    ret = async_io_fill(s);
+    /* nothing to wait for: the block we need was never queued */
+    if (num >= s->tail)
+        return ret < 0 ? ret : AVERROR(EIO);
+
+    b = block_get(s, num);
+    async_io_wait(s, b, 1);
+    if (b->len < 0)
+        return b->len;
+    if (b->len < block_expected(s, b) && b->len > 0) {
+        /* short read, finish the block in place */
+        ssize_t n;
+        while (b->len < block_expected(s, b) &&
+               (n = pread(s->fd, b->data + b->len, block_expected(s, b) - b->len,
+                          b->num * ASYNC_IO_BLOCK_SIZE + b->len)) > 0)
+            b->len += n;
+    }
+    off = s->pos - num * ASYNC_IO_BLOCK_SIZE;
+    len = FFMIN(buf_size, b->len - off);
+    if (len <= 0)
+        return AVERROR_EOF; // truncated under us
+    memcpy(buf, b->data + off, len);
+    s->pos += len;
+    s->stats.bytes += len;
+
+    if (off + len == b->len) {
+        s->stats.blocks++;
+        async_io_consume(s);
+        async_io_fill(s);
+    }
+    return len;
+}
+
+static int64_t async_io_seek(void *opaque, int64_t offset, int whence)
+{
+    AsyncIO *s = opaque;
+    int64_t pos;
+
+    switch (whence & ~AVSEEK_FORCE) {
+    case AVSEEK_SIZE:
+        return s->size;
+    case SEEK_SET:
+        pos = offset;
+        break;
+    case SEEK_CUR:
+        pos = s->pos + offset;
+        break;
+    case SEEK_END:
+        pos = s->size + offset;
+        break;
+    default:
+        return AVERROR(EINVAL);
+    }
+    if (pos < 0 || pos > s->size)
+        return AVERROR(EINVAL);
+    /* the ring is repositioned by the next read */
+    s->pos = pos;
+    return pos;
+}
+
+static void async_io_destroy(AsyncIO *s)
+{
+    int i;
+
+#if HAVE_LIBURING
+    if (s->uring) {
+        while (s->inflight)
+            async_io_reap(s, 1);
+        io_uring_queue_exit(&s->ring);
+    }
+#endif
+    pthread_mutex_lock(&s->lock);
+    s->abort = 1;
+    pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+    for (i = 0; i < s->nb_workers; i++)
+        pthread_join(s->workers[i], NULL);
+
+    for (i = 0; i < ASYNC_IO_MAX_WINDOW; i++)
+        av_free(s->blocks[i].data);
+    pthread_cond_destroy(&s->cond);
+    pthread_mutex_destroy(&s->lock);
+    close(s->fd);
+    av_free(s);
+}
+
+AVIOContext *async_io_alloc(const char *filename)
+{
+    AVIOContext *pb;
+    AsyncIO *s;
+    uint8_t *buffer;
+    struct stat st;
+    int fd, i;
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return NULL;
+    }
+    s = av_mallocz(sizeof(*s));
+    if (!s) {
+        close(fd);
+        return NULL;
+    }
+    s->fd = fd;
+    s->size = st.st_size;
+    s->nb_blocks = (s->size + ASYNC_IO_BLOCK_SIZE - 1) / ASYNC_IO_BLOCK_SIZE;
+    s->window = ASYNC_IO_MIN_WINDOW;
+    s->stats.max_window = s->window;
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->cond, NULL);
+    /* blocks are read in file order, let the kernel's own read-ahead follow */
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+#if HAVE_LIBURING
+    s->uring = io_uring_queue_init(ASYNC_IO_MAX_WINDOW, &s->ring, 0) >= 0;
+#endif
+    if (!s->uring) {
+        for (i = 0; i < ASYNC_IO_THREADS; i++) {
+            if (pthread_create(&s->workers[i], NULL, async_io_worker, s))
+                break;
+            s->nb_workers++;
+        }
+        if (!s->nb_workers) {
+            async_io_destroy(s);
+            return NULL;
+        }
+    }
+    s->stats.uring = s->uring;
+
+    buffer = av_malloc(ASYNC_IO_BUFFER_SIZE);
+    pb = buffer ? avio_alloc_context(buffer, ASYNC_IO_BUFFER_SIZE, 0, s,
+                                     async_io_read, NULL, async_io_seek) : NULL;
+    if (!pb) {
+        av_free(buffer);
+        async_io_destroy(s);
+        return NULL;
+    }
+    return pb;
+}
+
+void async_io_get_stats(AVIOContext *pb, AsyncIOStats *stats)
+{
+    AsyncIO *s = pb->opaque;
+
+    *stats = s->stats;
+    stats->window = s->window;
+}
+
+void async_io_free(AVIOContext **pb)
+{
+    AsyncIO *s;
+
+    if (!*pb)
+        return;
+    s = (*pb)->opaque;
+    av_log(NULL, AV_LOG_VERBOSE,
+           "async io (%s): %"PRId64" blocks, %"PRId64" stalls (%"PRId64" ms), window %d, max %d\n",
+           s->uring ? "io_uring" : "pread threads", s->stats.blocks, s->stats.stalls,
+           s->stats.stall_time / 1000, s->window, s->stats.max_window);
+    async_io_destroy(s);
+    av_freep(&(*pb)->buffer);
+    avio_context_free(pb);
+}
+
+int async_io_open_input(AVFormatContext **pic, const char *url,
+                        const AVInputFormat *fmt, AVDictionary **options)
+{
+    AVIOContext *pb = async_io_alloc(url);
+    AVFormatContext *ic;
+    int ret;
+
+    if (!pb)
+        return avformat_open_input(pic, url, fmt, options);
+
+    ic = *pic ? *pic : avformat_alloc_context();
+    if (!ic) {
+        async_io_free(&pb);
+        return AVERROR(ENOMEM);
+    }
+    ic->pb = pb;
+    ic->flags |= AVFMT_FLAG_CUSTOM_IO;
+    /* on failure avformat_open_input() frees ic, but never a custom pb */
+    if ((ret = avformat_open_input(&ic, url, fmt, options)) < 0) {
+        async_io_free(&pb);
+        *pic = NULL;
+        return ret;
+    }
+    *pic = ic;
+    return ret;
+}
+
+void async_io_close_input(AVFormatContext **pic)
+{
+    AVIOContext *pb = NULL;
+
+    if (!*pic)
+        return;
+    if ((*pic)->flags & AVFMT_FLAG_CUSTOM_IO)
+        pb = (*pic)->pb;
+    avformat_close_input(pic);
+    async_io_free(&pb);
+}
@@ -0,0 +1,49 @@
+#ifndef COMMON_ASYNC_IO_H
+#define COMMON_ASYNC_IO_H
+
+#include <libavformat/avformat.h>
+
+/*
+ * Read local files through an AVIOContext that keeps several large reads in
+ * flight ahead of the demuxer, so av_read_frame() rarely waits on the disk.
+ * Reads are issued with io_uring when built with HAVE_LIBURING and the
+ * kernel allows it, otherwise by a small pool of pread() threads.
+ *
+ * The read-ahead window (in ASYNC_IO_BLOCK_SIZE blocks) follows the
+ * consumption rate: it is sized so that the time to read one block is
+ * covered by the blocks the demuxer consumes meanwhile, and grows on every
+ * stall.
+ */
+
+#define ASYNC_IO_BLOCK_SIZE  (1024 * 1024)
+#define ASYNC_IO_MIN_WINDOW  2
+#define ASYNC_IO_MAX_WINDOW  32 ///< also the number of blocks allocated, at most
+#define ASYNC_IO_THREADS     4  ///< pread() threads without io_uring
+
+typedef struct AsyncIOStats {
+    int64_t bytes;      ///< bytes handed to the demuxer
+    int64_t blocks;     ///< blocks read from the file
+    int64_t stalls;     ///< reads that had to wait for their block
+    int64_t stall_time; ///< us spent waiting
+    int window;         ///< current read-ahead window, blocks
+    int max_window;     ///< largest window used
+    int uring;          ///< reads went through io_uring
+} AsyncIOStats;
+
+/* an AVIOContext reading filename asynchronously, NULL if it isn't a regular file */
+AVIOContext *async_io_alloc(const char *filename);
+
+void async_io_free(AVIOContext **pb);
+
+void async_io_get_stats(AVIOContext *pb, AsyncIOStats *stats);
+
+/*
+ * avformat_open_input() on top of async_io_alloc(), opening anything that
+ * isn't a regular file the regular way. Close with async_io_close_input().
+ */
+int async_io_open_input(AVFormatContext **pic, const char *url,
+                        const AVInputFormat *fmt, AVDictionary **options);
+
+void async_io_close_input(AVFormatContext **pic);
+
+#endif /* COMMON_ASYNC_IO_H */
@@ -0,0 +1,405 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE /* fallocate() */
+#endif
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <libavutil/avstring.h>
+#include <libavutil/common.h>
+#include <libavutil/error.h>
+#include <libavutil/fifo.h>
+#include <libavutil/mem.h>
+#include <libavutil/time.h>
+#include <libavformat/avformat.h>
+
+#include "async_writer.h"
+
+#define ASYNC_WRITER_BUFFER_SIZE (64 * 1024) ///< AVIOContext buffer in front of the blocks
+
+typedef struct WriteBlock {
+    uint8_t *data;
+    int64_t offset;  ///< file offset of data[0]
+    int len;
+    int limit;       ///< the block ends at the next aligned offset
+} WriteBlock;
+
+struct AsyncWriter {
+    int fd;
+    int64_t pos;
+    int64_t size;        ///< end of the furthest write
+    WriteBlock *cur;     ///< being filled, owned by the writing thread
+
+    /* full blocks go through queue to the writer thread and come back on free_blocks */
+    AVFifo *queue;
+    AVFifo *free_blocks;
+    int error;           ///< first failed pwrite(), every later write and close fail with it
+
+    int64_t prealloc;
+    int64_t allocated;   ///< writer thread only
+    AsyncWriterStats stats;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+    int thread_started;
+    int abort;
+};
+
+/* reserve [0, end) without touching the file size, 0 if the system can't */
+static int preallocate(int fd, int64_t end)
+{
+#if defined(__linux__)
+    return fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, end) < 0 ? AVERROR(errno) : 0;
+#elif defined(__APPLE__)
+    fstore_t fst = { F_ALLOCATEALL, F_PEOFPOSMODE, 0, end, 0 };
+
+    return fcntl(fd, F_PREALLOCATE, &fst) < 0 ? AVERROR(errno) : 0;
+#else
+    return AVERROR(ENOSYS);
+#endif
+}
+
+static int write_block(AsyncWriter *w, WriteBlock *b)
+{
+    int64_t end = b->offset + b->len;
+    ssize_t n;
+    int done = 0;
+
+    // 不够了就再预留一大段, 文件系统能分到连续的空间
+    if (w->prealloc && end > w->allocated) {
+        int64_t target = FFMAX(end, w->allocated + w->prealloc);
+
+        if (preallocate(w->fd, target) < 0)
+            w->prealloc = 0;
+        else
+            w->allocated = target;
+    }
+    while (done < b->len) {
+        n = pwrite(w->fd, b->data + done, b->len - done, b->offset + done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return n < 0 ? AVERROR(errno) : AVERROR(EIO);
+        done += n;
+    }
+    return 0;
+}
+
+static void *async_writer_thread(void *arg)
+{
+    AsyncWriter *w = arg;
+    WriteBlock *b;
+    int ret;
+
+    pthread_mutex_lock(&w->lock);
+    for (;;) {
+        while (!av_fifo_can_read(w->queue) && !w->abort)
+            pthread_cond_wait(&w->cond, &w->lock);
+        // abort 之前交上来的块都要写完
+        if (av_fifo_read(w->queue, &b, 1) < 0)
+            break;
+        pthread_mutex_unlock(&w->lock);
+
+        ret = write_block(w, b);
+
+        pthread_mutex_lock(&w->lock);
+        if (ret < 0 && !w->error)
+            w->error = ret;
+        if (ret >= 0) {
+            w->stats.bytes += b->len;
+            w->stats.blocks++;
+        }
+        w->stats.allocated = w->allocated;
+        av_fifo_write(w->free_blocks, &b, 1);
+        pthread_cond_broadcast(&w->cond);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+static WriteBlock *block_alloc(void)
+{
+    WriteBlock *b = av_mallocz(sizeof(*b));
+
+    if (b && !(b->data = av_malloc(ASYNC_WRITER_BLOCK_SIZE)))
+        av_freep(&b);
+    return b;
+}
+
+static void block_free(WriteBlock **b)
+{
+    if (*b)
+        av_free((*b)->data);
+    av_freep(b);
+}
+
+/* a free block for the current position: from the ring, a new one while under the limit, or wait for the disk */
+static int block_get(AsyncWriter *w, WriteBlock **pb)
+{
+    WriteBlock *b = NULL;
+    int64_t start = 0;
+    int ret;
+
+    pthread_mutex_lock(&w->lock);
+    while (av_fifo_read(w->free_blocks, &b, 1) < 0 && w->stats.nb_blocks >= ASYNC_WRITER_MAX_BLOCKS) {
+        if (!start) {
+            start = av_gettime_relative();
+            w->stats.stalls++;
+        }
+        pthread_cond_wait(&w->cond, &w->lock);
+    }
+    if (start)
+        w->stats.stall_time += av_gettime_relative() - start;
+    ret = w->error;
+    if (!b && ret >= 0) {
+        // 盘跟不上: 再加一块, 不让写的线程停下来
+        if ((b = block_alloc()))
+            w->stats.nb_blocks++;
+        else
+            ret = AVERROR(ENOMEM);
+    }
+    pthread_mutex_unlock(&w->lock);
+
+    if (ret < 0) {
+        if (b) {
+            pthread_mutex_lock(&w->lock);
+            av_fifo_write(w->free_blocks, &b, 1);
+            pthread_mutex_unlock(&w->lock);
+        }
+        return ret;
+    }
+    b->offset = w->pos;
+    b->len = 0;
+    b->limit = ASYNC_WRITER_BLOCK_SIZE - w->pos % ASYNC_WRITER_BLOCK_SIZE;
+    *pb = b;
+    return 0;
+}
+
+static void block_submit(AsyncWriter *w)
+{
+    pthread_mutex_lock(&w->lock);
+    if (w->cur->len)
+        av_fifo_write(w->queue, &w->cur, 1);
+    else
+        av_fifo_write(w->free_blocks, &w->cur, 1);
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+    w->cur = NULL;
+}
+
+static void async_writer_destroy(AsyncWriter *w)
+{
+    WriteBlock *b;
+
+    if (w->thread_started) {
+        pthread_mutex_lock(&w->lock);
+        w->abort = 1;
+        pthread_cond_broadcast(&w->cond);
+        pthread_mutex_unlock(&w->lock);
+        pthread_join(w->thread, NULL);
+    }
+    block_free(&w->cur);
+    while (w->queue && av_fifo_read(w->queue, &b, 1) >= 0)
+        block_free(&b);
+    while (w->free_blocks && av_fifo_read(w->free_blocks, &b, 1) >= 0)
+        block_free(&b);
+    av_fifo_freep2(&w->queue);
+    av_fifo_freep2(&w->free_blocks);
+    pthread_cond_destroy(&w->cond);
+    pthread_mutex_destroy(&w->lock);
+    if (w->fd >= 0)
+        close(w->fd);
+    av_free(w);
+}
+
+int async_writer_open(AsyncWriter **pw, const char *filename, int64_t prealloc)
+{
+    AsyncWriter *w;
+    WriteBlock *b;
+    int i, ret;
+
+    w = av_mallocz(sizeof(*w));
+    if (!w)
+        return AVERROR(ENOMEM);
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->cond, NULL);
+    w->prealloc = FFMAX(prealloc, 0);
+
+    w->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (w->fd < 0) {
+        ret = AVERROR(errno);
+        async_writer_destroy(w);
+        return ret;
+    }
+    w->queue = av_fifo_alloc2(ASYNC_WRITER_MAX_BLOCKS, sizeof(WriteBlock *), 0);
+    w->free_blocks = av_fifo_alloc2(ASYNC_WRITER_MAX_BLOCKS, sizeof(WriteBlock *), 0);
+    if (!w->queue || !w->free_blocks) {
+        async_writer_destroy(w);
+        return AVERROR(ENOMEM);
+    }
+    for (i = 0; i < ASYNC_WRITER_MIN_BLOCKS; i++) {
+        if (!(b = block_alloc())) {
+            async_writer_destroy(w);
+            return AVERROR(ENOMEM);
+        }
+        av_fifo_write(w->free_blocks, &b, 1);
+        w->stats.nb_blocks++;
+    }
+    if ((ret = pthread_create(&w->thread, NULL, async_writer_thread, w))) {
+        async_writer_destroy(w);
+        return AVERROR(ret);
+    }
+    w->thread_started = 1;
+    *pw = w;
+    return 0;
+}
+
+int async_writer_write(AsyncWriter *w, const void *buf, int size)
+{
+    const uint8_t *p = buf;
+    int n, left = size, ret;
+
+    while (left > 0) {
+        if (!w->cur && (ret = block_get(w, &w->cur)) < 0)
+            return ret;
+        n = FFMIN(left, w->cur->limit - w->cur->len);
+        memcpy(w->cur->data + w->cur->len, p, n);
+        w->cur->len += n;
+        w->pos += n;
+        w->size = FFMAX(w->size, w->pos);
+        p += n;
+        left -= n;
+        if (w->cur->len == w->cur->limit)
+            block_submit(w);
+    }
+    return size;
+}
+
+int64_t async_writer_seek(AsyncWriter *w, int64_t offset, int whence)
+{
+    int64_t pos;
+
+    switch (whence & ~AVSEEK_FORCE) {
+    case AVSEEK_SIZE:
+        return w->size;
+    case SEEK_SET:
+        pos = offset;
+        break;
+    case SEEK_CUR:
+        pos = w->pos + offset;
+        break;
+    case SEEK_END:
+        pos = w->size + offset;
+        break;
+    default:
+        return AVERROR(EINVAL);
+    }
+    if (pos < 0)
+        return AVERROR(EINVAL);
+    /* the writer thread keeps the order, a patch written after the data lands after it */
+    if (pos != w->pos && w->cur)
+        block_submit(w);
+    w->pos = pos;
+    return pos;
+}
+
+void async_writer_get_stats(AsyncWriter *w, AsyncWriterStats *stats)
+{
+    pthread_mutex_lock(&w->lock);
+    *stats = w->stats;
+    pthread_mutex_unlock(&w->lock);
+}
+
+int async_writer_close(AsyncWriter **pw)
+{
+    AsyncWriter *w = *pw;
+    int ret;
+
+    if (!w)
+        return 0;
+    if (w->cur)
+        block_submit(w);
+    pthread_mutex_lock(&w->lock);
+    w->abort = 1;
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+    pthread_join(w->thread, NULL);
+    w->thread_started = 0;
+
+    ret = w->error;
+    // 预留了没用上的部分还回去
+    if (w->allocated > w->size && ftruncate(w->fd, w->size) < 0 && ret >= 0)
+        ret = AVERROR(errno);
+    if (close(w->fd) < 0 && ret >= 0)
+        ret = AVERROR(errno);
+    w->fd = -1;
+    av_log(NULL, AV_LOG_VERBOSE,
+           "async writer: %"PRId64" blocks, %"PRId64" stalls (%"PRId64" ms), %d buffers, %"PRId64" MB preallocated\n",
+           w->stats.blocks, w->stats.stalls, w->stats.stall_time / 1000,
+           w->stats.nb_blocks, w->stats.allocated >> 20);
+    async_writer_destroy(w);
+    *pw = NULL;
+    return ret;
+}
+
+static int async_writer_avio_write(void *opaque,
+#if LIBAVFORMAT_VERSION_MAJOR < 61
+                                   uint8_t *buf,
+#else
+                                   const uint8_t *buf,
+#endif
+                                   int buf_size)
+{
+    return async_writer_write(opaque, buf, buf_size);
+}
+
+static int64_t async_writer_avio_seek(void *opaque, int64_t offset, int whence)
+{
+    return async_writer_seek(opaque, offset, whence);
+}
+
+int async_writer_avio_open(AVIOContext **pb, const char *filename, int64_t prealloc)
+{
+    const char *proto = avio_find_protocol_name(filename);
+    AsyncWriter *w;
+    uint8_t *buffer;
+    int ret;
+
+    // 网络地址, 管道之类的照常打开
+    if (!proto || strcmp(proto, "file"))
+        return avio_open2(pb, filename, AVIO_FLAG_WRITE, NULL, NULL);
+    av_strstart(filename, "file:", &filename);
+    if ((ret = async_writer_open(&w, filename, prealloc)) < 0)
+        return ret;
+    buffer = av_malloc(ASYNC_WRITER_BUFFER_SIZE);
+    *pb = buffer ? avio_alloc_context(buffer, ASYNC_WRITER_BUFFER_SIZE, 1, w, NULL,
+                                      async_writer_avio_write, async_writer_avio_seek) : NULL;
+    if (!*pb) {
+        av_free(buffer);
+        async_writer_close(&w);
+        return AVERROR(ENOMEM);
+    }
+    return 0;
+}
+
+int async_writer_avio_close(AVIOContext **pb)
+{
+    AsyncWriter *w;
+    int ret, ret2;
+
+    if (!*pb)
+        return 0;
+    if ((*pb)->write_packet != async_writer_avio_write)
+        return avio_closep(pb);
+    w = (*pb)->opaque;
+    avio_flush(*pb);
+    ret = (*pb)->error;
+    av_freep(&(*pb)->buffer);
+    avio_context_free(pb);
+    ret2 = async_writer_close(&w);
+    return ret < 0 ? ret : ret2;
+}
@@ -0,0 +1,63 @@
+#ifndef COMMON_ASYNC_WRITER_H
+#define COMMON_ASYNC_WRITER_H
+
+#include <stdint.h>
+
+#include <libavformat/avformat.h>
+
+/*
+ * Write-behind output for local files. Writes are copied into
+ * ASYNC_WRITER_BLOCK_SIZE blocks, cut at block-aligned file offsets, and a
+ * writer thread pwrite()s the full ones in order, so the encoder or muxer
+ * thread only pays for a memcpy. The ring of blocks grows up to
+ * ASYNC_WRITER_MAX_BLOCKS while the disk falls behind; only past that does a
+ * write wait. Seeking back (muxers patching their headers) is just a new
+ * block at the new offset. Errors from the disk are reported by a later
+ * write or by close.
+ *
+ * The file can be preallocated ahead of the writes, prealloc bytes at a
+ * time, without changing its size (fallocate() on Linux, F_PREALLOCATE on
+ * macOS, nothing elsewhere).
+ */
+
+#define ASYNC_WRITER_BLOCK_SIZE  (1024 * 1024)
+#define ASYNC_WRITER_MIN_BLOCKS  4
+#define ASYNC_WRITER_MAX_BLOCKS  16
+#define ASYNC_WRITER_PREALLOC    (64 << 20) ///< a sensible prealloc for media files
+
+typedef struct AsyncWriter AsyncWriter;
+
+typedef struct AsyncWriterStats {
+    int64_t bytes;       ///< bytes written to the file
+    int64_t blocks;      ///< pwrite()s
+    int64_t stalls;      ///< writes that had to wait for a free block
+    int64_t stall_time;  ///< us spent waiting
+    int nb_blocks;       ///< blocks allocated
+    int64_t allocated;   ///< bytes preallocated
+} AsyncWriterStats;
+
+/* open (create or truncate) filename for writing; prealloc 0 disables preallocation */
+int async_writer_open(AsyncWriter **pw, const char *filename, int64_t prealloc);
+
+/* returns size, or the AVERROR of an earlier block that failed to reach the disk */
+int async_writer_write(AsyncWriter *w, const void *buf, int size);
+
+/* SEEK_SET/SEEK_CUR/SEEK_END, or AVSEEK_SIZE */
+int64_t async_writer_seek(AsyncWriter *w, int64_t offset, int whence);
+
+void async_writer_get_stats(AsyncWriter *w, AsyncWriterStats *stats);
+
+/* wait for every block to be written and close; returns the first error */
+int async_writer_close(AsyncWriter **pw);
+
+/*
+ * The same as the AVIOContext a muxer writes to, in place of avio_open2(),
+ * which still opens anything that isn't a local file (network, pipe).
+ * Write-only: muxers reading their output back (mp4 +faststart) need the
+ * regular one. Close with async_writer_avio_close().
+ */
+int async_writer_avio_open(AVIOContext **pb, const char *filename, int64_t prealloc);
+
+int async_writer_avio_close(AVIOContext **pb);
+
+#endif /* COMMON_ASYNC_WRITER_H */
@@ -0,0 +1,398 @@
+#include <stdint.h>
+
+#include <libavutil/common.h>
+#include <libavutil/fifo.h>
+#include <libavutil/mathematics.h>
+#include <libavutil/mem.h>
+#include <libavformat/avformat.h>
+
+#include "interleaver.h"
+
+typedef struct InterleaverStream {
+    AVFifo *queue;          ///< AVPacket *, pkt->pos holds the input position
+    AVRational time_base;
+    int64_t tail_ts;        ///< AV_TIME_BASE, last queued packet
+
+    /* last packet taken (queued or written); anything not after it was read before */
+    int64_t accepted_dts;
+    int64_t accepted_pos;
+    int64_t written_dts;
+    int64_t written_pos;
+    /* furthest packet ever read, the stream's last one once EOF was seen */
+    int64_t max_dts;
+    int64_t max_pos;
+
+    int skipping;           ///< queue dropped, packets ignored until the rewind
+    int finished;           ///< took its last packet
+} InterleaverStream;
+
+struct Interleaver {
+    AVFormatContext *oc;
+    AVFormatContext *ic;
+    InterleaverStream *streams;
+    int nb_streams;
+    int64_t max_bytes;
+    int64_t max_duration;
+    int64_t max_delta;      ///< AV_TIME_BASE, oc->max_interleave_delta
+
+    int64_t bytes;
+    int nb_queued;
+    int64_t drop_time;      ///< AV_TIME_BASE, earliest dropped packet, INT64_MAX if none
+    int64_t rewind_pos;     ///< input position of the earliest dropped packet
+    int eof_seen;
+    InterleaverStats stats;
+};
+
+static inline int64_t packet_dts(const AVPacket *pkt)
+{
+    return pkt->dts != AV_NOPTS_VALUE ? pkt->dts : pkt->pts;
+}
+
+static inline int64_t stream_ts(const InterleaverStream *s, int64_t dts)
+{
+    return av_rescale_q(dts, s->time_base, AV_TIME_BASE_Q);
+}
+
+/* a (dts, pos) pair at or before (ref_dts, ref_pos) */
+static inline int not_after(int64_t dts, int64_t pos, int64_t ref_dts, int64_t ref_pos)
+{
+    return ref_dts != AV_NOPTS_VALUE && (dts < ref_dts || (dts == ref_dts && pos <= ref_pos));
+}
+
+int interleaver_alloc(Interleaver **pil, AVFormatContext *oc, AVFormatContext *ic,
+                      int64_t max_bytes, int64_t max_duration)
+{
+    Interleaver *il;
+    int i;
+
+    il = av_mallocz(sizeof(*il));
+    if (!il)
+        return AVERROR(ENOMEM);
+    il->oc = oc;
+    // 只有能 seek 的输入才回退重读
+    if (ic && ic->pb && (ic->pb->seekable & AVIO_SEEKABLE_NORMAL))
+        il->ic = ic;
+    il->max_bytes = max_bytes > 0 ? max_bytes : INT64_MAX;
+    il->max_duration = max_duration > 0 ? max_duration : INT64_MAX;
+    il->max_delta = oc->max_interleave_delta > 0 ? oc->max_interleave_delta : INT64_MAX;
+    il->drop_time = INT64_MAX;
+    il->rewind_pos = INT64_MAX;
+
+    il->streams = av_calloc(oc->nb_streams, sizeof(*il->streams));
+    if (!il->streams) {
+        av_free(il);
+        return AVERROR(ENOMEM);
+    }
+    il->nb_streams = oc->nb_streams;
+    for (i = 0; i < il->nb_streams; i++) {
+        InterleaverStream *s = &il->streams[i];
+
+        s->queue = av_fifo_alloc2(64, sizeof(AVPacket *), AV_FIFO_FLAG_AUTO_GROW);
+        if (!s->queue) {
+            interleaver_free(&il);
+            return AVERROR(ENOMEM);
+        }
+        s->time_base = oc->streams[i]->time_base;
+        s->accepted_dts = s->written_dts = s->max_dts = AV_NOPTS_VALUE;
+    }
+    *pil = il;
+    return 0;
+}
+
+static int write_packet(Interleaver *il, AVPacket *pkt)
+{
+    InterleaverStream *s = &il->streams[pkt->stream_index];
+    int ret;
+
+    s->written_dts = packet_dts(pkt);
+    s->written_pos = pkt->pos;
+    pkt->pos = -1;
+    // av_write_frame() leaves the packet to us
+    ret = av_write_frame(il->oc, pkt);
+    av_packet_free(&pkt);
+    return ret;
+}
+
+/* the stream whose queued head comes first, -1 if all queues are empty or it is past the dropped packets */
+static int first_head(Interleaver *il)
+{
+    AVPacket *pkt;
+    int64_t ts, best_ts = il->drop_time;
+    int i, best = -1;
+
+    for (i = 0; i < il->nb_streams; i++) {
+        if (av_fifo_peek(il->streams[i].queue, &pkt, 1, 0) < 0)
+            continue;
+        ts = stream_ts(&il->streams[i], packet_dts(pkt));
+        if (ts < best_ts) {
+            best_ts = ts;
+            best = i;
+        }
+    }
+    return best;
+}
+
+static int write_head(Interleaver *il, int i)
+{
+    AVPacket *pkt;
+
+    av_fifo_read(il->streams[i].queue, &pkt, 1);
+    il->bytes -= pkt->size;
+    il->nb_queued--;
+    return write_packet(il, pkt);
+}
+
+/* a stream that can still deliver has an empty queue */
+static int waiting(Interleaver *il)
+{
+    InterleaverStream *s;
+    int i;
+
+    for (i = 0; i < il->nb_streams; i++) {
+        s = &il->streams[i];
+        if (!s->finished && !s->skipping && !av_fifo_can_read(s->queue))
+            return 1;
+    }
+    return 0;
+}
+
+/* from the head of stream i to the last packet queued on any stream */
+static int64_t queued_span(Interleaver *il, int i)
+{
+    AVPacket *pkt;
+    int64_t tail = INT64_MIN;
+    int j;
+
+    for (j = 0; j < il->nb_streams; j++) {
+        if (av_fifo_can_read(il->streams[j].queue))
+            tail = FFMAX(tail, il->streams[j].tail_ts);
+    }
+    av_fifo_peek(il->streams[i].queue, &pkt, 1, 0);
+    return tail - stream_ts(&il->streams[i], packet_dts(pkt));
+}
+
+/*
+ * Write in dts order for as long as no stream that can still deliver has an
+ * empty queue, or, like libavformat, past max_interleave_delta regardless.
+ */
+static int drain(Interleaver *il, int all)
+{
+    int i, ret;
+
+    for (;;) {
+        if ((i = first_head(il)) < 0)
+            return 0;
+        if (!all && waiting(il)) {
+            if (queued_span(il, i) <= il->max_delta)
+                return 0;
+            il->stats.delta_writes++;
+        }
+        if ((ret = write_head(il, i)) < 0)
+            return ret;
+    }
+}
+
+/* the longest stretch of one stream held in its queue; a lone sparse packet waiting is not a stretch */
+static int64_t queued_duration(Interleaver *il)
+{
+    AVPacket *pkt;
+    int64_t d = 0;
+    int i;
+
+    for (i = 0; i < il->nb_streams; i++) {
+        if (av_fifo_peek(il->streams[i].queue, &pkt, 1, 0) < 0)
+            continue;
+        d = FFMAX(d, il->streams[i].tail_ts - stream_ts(&il->streams[i], packet_dts(pkt)));
+    }
+    return d;
+}
+
+static int over_cap(Interleaver *il, int shift)
+{
+    return il->bytes > il->max_bytes >> shift || queued_duration(il) > il->max_duration >> shift;
+}
+
+/*
+ * Over the cap: the queued streams are the ones running ahead. Drop them to
+ * re-read later, or without an input to rewind write them out early.
+ */
+static int relieve(Interleaver *il)
+{
+    InterleaverStream *s;
+    AVPacket *pkt;
+    int i, ret;
+
+    if (!il->ic) {
+        il->stats.flushes++;
+        while (over_cap(il, 1) && (i = first_head(il)) >= 0) {
+            if ((ret = write_head(il, i)) < 0)
+                return ret;
+        }
+        return 0;
+    }
+
+    for (i = 0; i < il->nb_streams; i++) {
+        s = &il->streams[i];
+        if (!av_fifo_can_read(s->queue))
+            continue;
+        av_fifo_peek(s->queue, &pkt, 1, 0);
+        il->drop_time = FFMIN(il->drop_time, stream_ts(s, packet_dts(pkt)));
+        while (av_fifo_read(s->queue, &pkt, 1) >= 0) {
+            if (pkt->pos >= 0)
+                il->rewind_pos = FFMIN(il->rewind_pos, pkt->pos);
+            il->bytes -= pkt->size;
+            il->nb_queued--;
+            av_packet_free(&pkt);
+        }
+        s->skipping = 1;
+        s->accepted_dts = s->written_dts;
+        s->accepted_pos = s->written_pos;
+    }
+    return 0;
+}
+
+/* go back to the earliest dropped packet and read the skipped streams again */
+static int rewind_input(Interleaver *il)
+{
+    int i, ret = -1;
+
+    if (il->rewind_pos != INT64_MAX && !(il->ic->iformat->flags & AVFMT_NO_BYTE_SEEK))
+        ret = av_seek_frame(il->ic, -1, il->rewind_pos, AVSEEK_FLAG_BYTE);
+    if (ret < 0)
+        ret = av_seek_frame(il->ic, -1, il->drop_time, AVSEEK_FLAG_BACKWARD);
+    if (ret < 0) {
+        av_log(il->oc, AV_LOG_ERROR, "Could not seek back to re-read the skipped packets\n");
+        return ret;
+    }
+    for (i = 0; i < il->nb_streams; i++)
+        il->streams[i].skipping = 0;
+    il->drop_time = INT64_MAX;
+    il->rewind_pos = INT64_MAX;
+    il->stats.rewinds++;
+    return 0;
+}
+
+int interleaver_write(Interleaver *il, AVPacket *pkt, int64_t pos)
+{
+    InterleaverStream *s;
+    AVPacket *ref;
+    int64_t dts, ts;
+    int ret;
+
+    if (pkt->stream_index < 0 || pkt->stream_index >= il->nb_streams) {
+        av_packet_unref(pkt);
+        return AVERROR(EINVAL);
+    }
+    s = &il->streams[pkt->stream_index];
+    dts = packet_dts(pkt);
+    if (dts == AV_NOPTS_VALUE) {
+        // 没有时间戳没法排, 直接写
+        pkt->pos = -1;
+        ret = av_write_frame(il->oc, pkt);
+        av_packet_unref(pkt);
+        return ret;
+    }
+    if (s->max_dts == AV_NOPTS_VALUE || !not_after(dts, pos, s->max_dts, s->max_pos)) {
+        s->max_dts = dts;
+        s->max_pos = pos;
+    }
+
+    // 回退之后重读到的包, 或者正在跳过的流
+    if (il->ic && not_after(dts, pos, s->accepted_dts, s->accepted_pos)) {
+        il->stats.reread_packets++;
+        av_packet_unref(pkt);
+        return 0;
+    }
+    if (s->skipping) {
+        av_packet_unref(pkt);
+        return 0;
+    }
+
+    if (!(ref = av_packet_alloc())) {
+        av_packet_unref(pkt);
+        return AVERROR(ENOMEM);
+    }
+    av_packet_move_ref(ref, pkt);
+    ref->pos = pos;
+    ts = stream_ts(s, dts);
+    if ((ret = av_fifo_write(s->queue, &ref, 1)) < 0) {
+        av_packet_free(&ref);
+        return ret;
+    }
+    s->tail_ts = ts;
+    s->accepted_dts = dts;
+    s->accepted_pos = pos;
+    if (il->eof_seen && dts == s->max_dts && pos == s->max_pos)
+        s->finished = 1;
+    il->bytes += ref->size;
+    il->nb_queued++;
+    il->stats.peak_bytes = FFMAX(il->stats.peak_bytes, il->bytes);
+    il->stats.peak_packets = FFMAX(il->stats.peak_packets, il->nb_queued);
+
+    if ((ret = drain(il, 0)) < 0)
+        return ret;
+    /*
+     * Past the dropped packets the live streams queue up; once they hold
+     * half the cap, going back pairs a re-read with a useful stretch of them.
+     */
+    if (il->drop_time != INT64_MAX && over_cap(il, 1)) {
+        if ((ret = rewind_input(il)) < 0)
+            return ret;
+        if ((ret = drain(il, 0)) < 0)
+            return ret;
+    }
+    if (over_cap(il, 0)) {
+        if ((ret = relieve(il)) < 0)
+            return ret;
+        return drain(il, 0);
+    }
+    return 0;
+}
+
+int interleaver_eof(Interleaver *il)
+{
+    InterleaverStream *s;
+    int i, ret;
+
+    // 第一次到文件尾: 每个流最后一个包是哪个就知道了
+    il->eof_seen = 1;
+    for (i = 0; i < il->nb_streams; i++) {
+        s = &il->streams[i];
+        if (s->max_dts == AV_NOPTS_VALUE ||
+            (s->accepted_dts == s->max_dts && s->accepted_pos == s->max_pos))
+            s->finished = 1;
+    }
+
+    if (il->drop_time != INT64_MAX) {
+        if ((ret = rewind_input(il)) < 0)
+            return ret;
+        if ((ret = drain(il, 0)) < 0)
+            return ret;
+        return 1;
+    }
+    return drain(il, 1);
+}
+
+void interleaver_get_stats(Interleaver *il, InterleaverStats *stats)
+{
+    *stats = il->stats;
+}
+
+void interleaver_free(Interleaver **pil)
+{
+    Interleaver *il = *pil;
+    AVPacket *pkt;
+    int i;
+
+    if (!il)
+        return;
+    for (i = 0; i < il->nb_streams; i++) {
+        if (!il->streams[i].queue)
+            continue;
+        while (av_fifo_read(il->streams[i].queue, &pkt, 1) >= 0)
+            av_packet_free(&pkt);
+        av_fifo_freep2(&il->streams[i].queue);
+    }
+    av_free(il->streams);
+    av_freep(pil);
+}
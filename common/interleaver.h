@@ -0,0 +1,65 @@
+#ifndef COMMON_INTERLEAVER_H
+#define COMMON_INTERLEAVER_H
+
+#include <libavformat/avformat.h>
+
+/*
+ * Interleaving in front of av_write_frame() with bounded memory.
+ *
+ * av_interleaved_write_frame() queues packets until every stream has one,
+ * so a source whose streams are stored far apart (one stream's timestamps
+ * running well ahead of another's) makes it buffer without limit. This
+ * queue is capped in bytes and in duration, the longest stretch of one
+ * stream it holds.
+ *
+ * Like av_interleaved_write_frame(), it stops waiting for a stream that has
+ * nothing queued once the queued packets span more than the output's
+ * max_interleave_delta: sparse streams and streams that ended early are
+ * written around instead of holding everything up. Only when the cap is hit
+ * first are the packets of the streams that are ahead dropped, those streams
+ * skipped while the lagging ones catch up, and the input seeked back to
+ * re-read them; packets read twice are recognised by their dts and position
+ * and dropped. Without an input to seek (or if it can't be), the cap writes
+ * the streams that are ahead early instead, which keeps memory bounded at
+ * the cost of interleaving.
+ */
+
+typedef struct Interleaver Interleaver;
+
+typedef struct InterleaverStats {
+    int64_t peak_bytes;      ///< largest amount of queued packet data
+    int peak_packets;
+    int rewinds;             ///< seeks back on the input
+    int flushes;             ///< cap hits resolved by writing early
+    int64_t reread_packets;  ///< packets read again after a rewind and dropped
+    int64_t delta_writes;    ///< packets written past max_interleave_delta, not waiting for a stream
+} InterleaverStats;
+
+/*
+ * Write to oc, whose streams must all be set up; its max_interleave_delta
+ * (0: unlimited) is read here. ic is the input the packets come from,
+ * seeked back when the cap is hit, or NULL.
+ * max_bytes/max_duration (AV_TIME_BASE) <= 0 leave that dimension
+ * unbounded.
+ */
+int interleaver_alloc(Interleaver **pil, AVFormatContext *oc, AVFormatContext *ic,
+                      int64_t max_bytes, int64_t max_duration);
+
+/*
+ * Queue pkt (stream_index and timestamps already in oc's terms) and write
+ * whatever can be written. pos is the packet's position in the input.
+ * Takes the packet's reference. May seek ic.
+ */
+int interleaver_write(Interleaver *il, AVPacket *pkt, int64_t pos);
+
+/*
+ * The input hit EOF. Returns 1 if it was seeked back and reading must go
+ * on, 0 once everything has been written, or a negative AVERROR.
+ */
+int interleaver_eof(Interleaver *il);
+
+void interleaver_get_stats(Interleaver *il, InterleaverStats *stats);
+
+void interleaver_free(Interleaver **pil);
+
+#endif /* COMMON_INTERLEAVER_H */
@@ -0,0 +1,338 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <libavutil/avstring.h>
+#include <libavutil/log.h>
+#include <libavutil/mem.h>
+#include <libavformat/avformat.h>
+
+#include "keyframe_index.h"
+
+#define KFIDX_MAGIC "KFIDX\0\0\0"
+#define KFIDX_BATCH 4096 /* entries written, and the header updated, at a time */
+
+static char *kfidx_path(const char *filename)
+{
+    return av_asprintf("%s%s", filename, KFIDX_SUFFIX);
+}
+
+static int kfidx_header_valid(const KeyframeIndexHeader *hdr, size_t file_size)
+{
+    return !memcmp(hdr->magic, KFIDX_MAGIC, sizeof(hdr->magic)) &&
+           hdr->version == KFIDX_VERSION &&
+           hdr->entry_size == sizeof(KeyframeIndexEntry) &&
+           hdr->time_base_num > 0 && hdr->time_base_den > 0 &&
+           hdr->nb_entries <= (file_size - sizeof(*hdr)) / sizeof(KeyframeIndexEntry);
+}
+
+/* entries are only appended, so the byte seek the resume needs is the only requirement */
+static int kfidx_can_byte_seek(const AVFormatContext *ic)
+{
+    return (ic->iformat->flags & AVFMT_TS_DISCONT) &&
+           !(ic->iformat->flags & AVFMT_NO_BYTE_SEEK);
+}
+
+/*
+ * A sidecar whose input was modified since is only extended if the input
+ * just grew: the last indexed packet must still be where it was, unchanged.
+ */
+static int kfidx_tail_matches(AVFormatContext *ic, int fd, const KeyframeIndexHeader *hdr)
+{
+    KeyframeIndexEntry last;
+    AVPacket *pkt;
+    off_t off = sizeof(*hdr) + (hdr->nb_entries - 1) * sizeof(last);
+    int match = 0;
+
+    if (pread(fd, &last, sizeof(last), off) != sizeof(last) || last.pos < 0 ||
+        av_seek_frame(ic, -1, last.pos, AVSEEK_FLAG_BYTE) < 0 || !(pkt = av_packet_alloc()))
+        return 0;
+    while (av_read_frame(ic, pkt) >= 0) {
+        if (pkt->stream_index == hdr->stream_index && pkt->pos >= last.pos) {
+            match = pkt->pos == last.pos && pkt->size == last.size && pkt->dts == last.dts;
+            break;
+        }
+        av_packet_unref(pkt);
+    }
+    av_packet_free(&pkt);
+    return match;
+}
+
+static int kfidx_write_header(int fd, const KeyframeIndexHeader *hdr)
+{
+    if (pwrite(fd, hdr, sizeof(*hdr), 0) != sizeof(*hdr))
+        return AVERROR(errno);
+    return 0;
+}
+
+static int kfidx_write_entries(int fd, KeyframeIndexHeader *hdr,
+                               const KeyframeIndexEntry *entries, int nb)
+{
+    off_t off = sizeof(*hdr) + hdr->nb_entries * sizeof(*entries);
+    size_t size = nb * sizeof(*entries);
+
+    if (!nb)
+        return 0;
+    if (pwrite(fd, entries, size, off) != (ssize_t)size)
+        return AVERROR(errno);
+    hdr->nb_entries += nb;
+    hdr->indexed_pos = entries[nb - 1].pos;
+    /* the header goes last, a reader never sees entries it doesn't cover */
+    return kfidx_write_header(fd, hdr);
+}
+
+int kfidx_build(const char *filename, const AVIOInterruptCB *int_cb)
+{
+    AVFormatContext *ic = NULL;
+    AVPacket *pkt = NULL;
+    KeyframeIndexEntry *batch = NULL;
+    KeyframeIndexHeader hdr;
+    struct stat st;
+    char *path = NULL;
+    int64_t last_pos = -1;
+    int moved = 0; /* ic was seeked or read while checking the old sidecar */
+    int fd = -1, nb = 0, video_index, ret;
+
+    if (stat(filename, &st) < 0)
+        return AVERROR(errno);
+    if (!(path = kfidx_path(filename)))
+        return AVERROR(ENOMEM);
+
+    if (!(ic = avformat_alloc_context())) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    if (int_cb)
+        ic->interrupt_callback = *int_cb;
+    if ((ret = avformat_open_input(&ic, filename, NULL, NULL)) < 0) {
+        av_log(NULL, AV_LOG_ERROR, "kfidx: could not open %s: %s\n", filename, av_err2str(ret));
+        goto end;
+    }
+    video_index = av_find_best_stream(ic, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+    if (video_index < 0) {
+        ret = video_index;
+        goto end;
+    }
+
+    fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        ret = AVERROR(errno);
+        av_log(NULL, AV_LOG_WARNING, "kfidx: cannot write %s: %s\n", path, av_err2str(ret));
+        goto end;
+    }
+
+    /* pick up an existing sidecar where it stopped, if it still describes this file */
+    if (pread(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr) &&
+        kfidx_header_valid(&hdr, lseek(fd, 0, SEEK_END)) &&
+        hdr.stream_index == video_index &&
+        hdr.time_base_num == ic->streams[video_index]->time_base.num &&
+        hdr.time_base_den == ic->streams[video_index]->time_base.den) {
+        if ((hdr.flags & KFIDX_FLAG_COMPLETE) &&
+            hdr.file_size == st.st_size && hdr.file_mtime == st.st_mtime) {
+            av_log(NULL, AV_LOG_VERBOSE, "kfidx: %s is up to date\n", path);
+            ret = 0;
+            goto end;
+        }
+        if (hdr.nb_entries && hdr.file_size <= st.st_size && kfidx_can_byte_seek(ic)) {
+            moved = 1;
+            if ((hdr.file_mtime == st.st_mtime || kfidx_tail_matches(ic, fd, &hdr)) &&
+                av_seek_frame(ic, -1, hdr.indexed_pos, AVSEEK_FLAG_BYTE) >= 0) {
+                last_pos = hdr.indexed_pos;
+                av_log(NULL, AV_LOG_INFO, "kfidx: resuming %s after %"PRIu64" entries\n",
+                       path, hdr.nb_entries);
+            }
+        }
+    }
+    if (last_pos < 0) {
+        /* starting over: a rebuild that began at the old tail would be marked complete while missing everything before it */
+        if (moved && av_seek_frame(ic, -1, 0, AVSEEK_FLAG_BYTE) < 0 &&
+            (ret = avformat_seek_file(ic, -1, INT64_MIN, 0, 0, 0)) < 0) {
+            av_log(NULL, AV_LOG_ERROR, "kfidx: could not go back to the start of %s\n", filename);
+            goto end;
+        }
+        memset(&hdr, 0, sizeof(hdr));
+        memcpy(hdr.magic, KFIDX_MAGIC, sizeof(hdr.magic));
+        hdr.version = KFIDX_VERSION;
+        hdr.entry_size = sizeof(KeyframeIndexEntry);
+        hdr.stream_index = video_index;
+        hdr.time_base_num = ic->streams[video_index]->time_base.num;
+        hdr.time_base_den = ic->streams[video_index]->time_base.den;
+        hdr.indexed_pos = -1;
+    }
+    hdr.flags &= ~KFIDX_FLAG_COMPLETE;
+    hdr.file_size = st.st_size;
+    hdr.file_mtime = st.st_mtime;
+    if (ftruncate(fd, sizeof(hdr) + hdr.nb_entries * sizeof(KeyframeIndexEntry)) < 0) {
+        ret = AVERROR(errno);
+        goto end;
+    }
+    if ((ret = kfidx_write_header(fd, &hdr)) < 0)
+        goto end;
+
+    pkt = av_packet_alloc();
+    batch = av_malloc_array(KFIDX_BATCH, sizeof(*batch));
+    if (!pkt || !batch) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+
+    while ((ret = av_read_frame(ic, pkt)) >= 0) {
+        /* after a resume the demuxer may hand back what is already indexed */
+        if (pkt->stream_index == video_index && (last_pos < 0 || pkt->pos > last_pos)) {
+            KeyframeIndexEntry *e = &batch[nb++];
+            e->dts   = pkt->dts;
+            e->pts   = pkt->pts != AV_NOPTS_VALUE ? pkt->pts : pkt->dts;
+            e->pos   = pkt->pos;
+            e->size  = pkt->size;
+            e->flags = pkt->flags & AV_PKT_FLAG_KEY ? KFIDX_FLAG_KEY : 0;
+            if (nb == KFIDX_BATCH) {
+                if ((ret = kfidx_write_entries(fd, &hdr, batch, nb)) < 0)
+                    break;
+                nb = 0;
+            }
+        }
+        av_packet_unref(pkt);
+    }
+    if (ret == AVERROR_EOF) {
+        if ((ret = kfidx_write_entries(fd, &hdr, batch, nb)) >= 0) {
+            hdr.flags |= KFIDX_FLAG_COMPLETE;
+            ret = kfidx_write_header(fd, &hdr);
+        }
+        if (ret >= 0)
+            av_log(NULL, AV_LOG_INFO, "kfidx: indexed %"PRIu64" video packets of %s\n",
+                   hdr.nb_entries, filename);
+    } else if (ret < 0) {
+        /* interrupted or failed, keep what we have for the next attempt */
+        kfidx_write_entries(fd, &hdr, batch, nb);
+        if (ret != AVERROR_EXIT)
+            av_log(NULL, AV_LOG_ERROR, "kfidx: error while indexing %s: %s\n",
+                   filename, av_err2str(ret));
+    }
+
+end:
+    if (fd >= 0)
+        close(fd);
+    av_packet_free(&pkt);
+    av_free(batch);
+    avformat_close_input(&ic);
+    av_free(path);
+    return ret;
+}
+
+int kfidx_open(KeyframeIndex **pidx, const char *filename)
+{
+    KeyframeIndex *idx = NULL;
+    struct stat st, ist;
+    char *path;
+    int ret;
+
+    *pidx = NULL;
+    if (stat(filename, &ist) < 0)
+        return AVERROR(errno);
+    if (!(path = kfidx_path(filename)))
+        return AVERROR(ENOMEM);
+    if (!(idx = av_mallocz(sizeof(*idx)))) {
+        ret = AVERROR(ENOMEM);
+        goto fail;
+    }
+
+    idx->fd = open(path, O_RDONLY);
+    if (idx->fd < 0 || fstat(idx->fd, &st) < 0) {
+        ret = AVERROR(ENOENT);
+        goto fail;
+    }
+    if (st.st_size < (off_t)sizeof(KeyframeIndexHeader)) {
+        ret = AVERROR(ENOENT);
+        goto fail;
+    }
+    idx->map_size = st.st_size;
+    idx->map = mmap(NULL, idx->map_size, PROT_READ, MAP_SHARED, idx->fd, 0);
+    if (idx->map == MAP_FAILED) {
+        idx->map = NULL;
+        ret = AVERROR(errno);
+        goto fail;
+    }
+    idx->hdr = idx->map;
+    idx->entries = (const KeyframeIndexEntry *)(idx->hdr + 1);
+
+    if (!kfidx_header_valid(idx->hdr, idx->map_size) ||
+        !(idx->hdr->flags & KFIDX_FLAG_COMPLETE) ||
+        idx->hdr->file_size != ist.st_size || idx->hdr->file_mtime != ist.st_mtime) {
+        av_log(NULL, AV_LOG_VERBOSE, "kfidx: %s is incomplete or stale, ignoring it\n", path);
+        ret = AVERROR(ENOENT);
+        goto fail;
+    }
+#ifdef MADV_RANDOM
+    madvise(idx->map, idx->map_size, MADV_RANDOM);
+#endif
+
+    av_log(NULL, AV_LOG_VERBOSE, "kfidx: mapped %s, %"PRIu64" entries\n", path, idx->hdr->nb_entries);
+    av_free(path);
+    *pidx = idx;
+    return 0;
+
+fail:
+    av_free(path);
+    kfidx_close(&idx);
+    return ret;
+}
+
+void kfidx_close(KeyframeIndex **pidx)
+{
+    KeyframeIndex *idx = *pidx;
+
+    if (!idx)
+        return;
+    if (idx->map)
+        munmap(idx->map, idx->map_size);
+    if (idx->fd >= 0)
+        close(idx->fd);
+    av_freep(pidx);
+}
+
+const KeyframeIndexEntry *kfidx_lookup(const KeyframeIndex *idx, int64_t ts)
+{
+    const KeyframeIndexEntry *e = idx->entries;
+    size_t lo = 0, hi = idx->hdr->nb_entries;
+
+    /* entries are in decode order: find the first one decoded after ts ... */
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (e[mid].dts <= ts)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    /* ... and walk back, at most a GOP, to a keyframe shown no later than ts */
+    while (lo-- > 0) {
+        if ((e[lo].flags & KFIDX_FLAG_KEY) && e[lo].pts <= ts)
+            return &e[lo];
+    }
+    return NULL;
+}
+
+int kfidx_seek(AVFormatContext *ic, const KeyframeIndex *idx, int64_t min_ts, int64_t timestamp)
+{
+    const KeyframeIndexEntry *e;
+    AVStream *st;
+    int64_t ts;
+
+    if (idx->hdr->stream_index >= ic->nb_streams)
+        return AVERROR(EINVAL);
+    st = ic->streams[idx->hdr->stream_index];
+    if (st->time_base.num != idx->hdr->time_base_num || st->time_base.den != idx->hdr->time_base_den)
+        return AVERROR(EINVAL);
+
+    ts = av_rescale_q(timestamp, AV_TIME_BASE_Q, st->time_base);
+    if (!(e = kfidx_lookup(idx, ts)))
+        return AVERROR(ERANGE);
+    if (min_ts != INT64_MIN && e->pts < av_rescale_q(min_ts, AV_TIME_BASE_Q, st->time_base))
+        return AVERROR(ERANGE);
+
+    if (e->pos >= 0 && kfidx_can_byte_seek(ic))
+        return av_seek_frame(ic, -1, e->pos, AVSEEK_FLAG_BYTE);
+    return av_seek_frame(ic, idx->hdr->stream_index, e->pts, AVSEEK_FLAG_BACKWARD);
+}
@@ -0,0 +1,90 @@
+#ifndef COMMON_KEYFRAME_INDEX_H
+#define COMMON_KEYFRAME_INDEX_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <libavformat/avformat.h>
+
+/*
+ * Keyframe index sidecar: "<input>.kfidx" next to the media file, holding
+ * one fixed size entry per packet of the first video stream in file order.
+ * The file is a header followed by the entry array, in native byte order,
+ * so it is used straight from an mmap() without parsing.
+ *
+ * The header remembers the input's size and mtime. A sidecar that no
+ * longer matches is ignored by kfidx_open(); kfidx_build() extends it when
+ * an earlier build was interrupted, or when the input was modified but only
+ * grew (the last indexed packet reads back the same), and rebuilds it
+ * otherwise. Building reads the whole input, so callers only do it on
+ * request.
+ */
+
+#define KFIDX_SUFFIX      ".kfidx"
+#define KFIDX_VERSION     1
+
+#define KFIDX_FLAG_KEY      1   ///< entry flag: keyframe
+#define KFIDX_FLAG_COMPLETE 1   ///< header flag: the whole input is indexed
+
+typedef struct KeyframeIndexHeader {
+    char     magic[8];          ///< "KFIDX\0\0\0"
+    uint32_t version;
+    uint32_t entry_size;
+    int64_t  file_size;         ///< of the input when it was indexed
+    int64_t  file_mtime;
+    int64_t  indexed_pos;       ///< byte position of the last indexed packet
+    int32_t  stream_index;
+    int32_t  time_base_num;
+    int32_t  time_base_den;
+    uint32_t flags;
+    uint64_t nb_entries;
+} KeyframeIndexHeader;
+
+typedef struct KeyframeIndexEntry {
+    int64_t  pts;               ///< stream time base, dts if the packet had none
+    int64_t  dts;
+    int64_t  pos;               ///< byte offset of the packet, -1 if unknown
+    int32_t  size;
+    uint32_t flags;
+} KeyframeIndexEntry;
+
+typedef struct KeyframeIndex {
+    int fd;
+    void *map;
+    size_t map_size;
+    const KeyframeIndexHeader *hdr;
+    const KeyframeIndexEntry *entries;
+} KeyframeIndex;
+
+/*
+ * Create or bring up to date the sidecar of filename. int_cb, if set, can
+ * interrupt a long build; whatever was indexed so far is kept and resumed
+ * next time. Returns 0 on success, a negative AVERROR otherwise.
+ */
+int kfidx_build(const char *filename, const AVIOInterruptCB *int_cb);
+
+/*
+ * Map the sidecar of filename. Fails with AVERROR(ENOENT) if there is none,
+ * or if it is incomplete or stale.
+ */
+int kfidx_open(KeyframeIndex **pidx, const char *filename);
+
+void kfidx_close(KeyframeIndex **pidx);
+
+/* the last keyframe at or before ts (index time base), NULL if there is none */
+const KeyframeIndexEntry *kfidx_lookup(const KeyframeIndex *idx, int64_t ts);
+
+/*
+ * Seek ic to the keyframe at or before timestamp (AV_TIME_BASE units),
+ * but not before min_ts. Demuxers that resynchronize from any byte offset
+ * (AVFMT_TS_DISCONT: MPEG-TS/PS, FLV, ...) are sent straight to the
+ * packet's offset. Everything else is a plain av_seek_frame(BACKWARD) to
+ * the keyframe's exact timestamp on the indexed stream: the index only
+ * saves probing for the target, the demuxer's own seek does the rest, as
+ * a byte offset is no place to restart mp4/mkv demuxing. Returns
+ * < 0 if the index can't serve the request, the caller should fall back
+ * to a regular seek then.
+ */
+int kfidx_seek(AVFormatContext *ic, const KeyframeIndex *idx, int64_t min_ts, int64_t timestamp);
+
+#endif /* COMMON_KEYFRAME_INDEX_H */
@@ -0,0 +1,180 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <libavutil/common.h>
+#include <libavutil/error.h>
+#include <libavutil/mem.h>
+#include <libavformat/avformat.h>
+
+#include "mmap_io.h"
+
+typedef struct MmapIO {
+    uint8_t *data;
+    size_t size;
+    size_t pos;
+    size_t advised;     ///< end of the range already handed to MADV_WILLNEED
+    size_t page_size;
+} MmapIO;
+
+/* keep MMAP_IO_READAHEAD bytes ahead of the reader faulting in */
+static void mmap_io_readahead(MmapIO *m)
+{
+    size_t start, end;
+
+    if (m->advised >= m->size || m->pos + MMAP_IO_READAHEAD / 2 < m->advised)
+        return;
+    start = FFMAX(m->advised, m->pos) & ~(m->page_size - 1);
+    end = FFMIN(m->pos + MMAP_IO_READAHEAD, m->size);
+    if (end > start)
+        madvise(m->data + start, end - start, MADV_WILLNEED);
+    m->advised = end;
+}
+
+static int mmap_io_read(void *opaque, uint8_t *buf, int buf_size)
+{
+    MmapIO *m = opaque;
+    size_t len;
+
+    if (m->pos >= m->size)
+        return AVERROR_EOF;
+    len = FFMIN((size_t)buf_size, m->size - m->pos);
+    memcpy(buf, m->data + m->pos, len);
+    m->pos += len;
+    mmap_io_readahead(m);
+    return len;
+}
+
+static int64_t mmap_io_seek(void *opaque, int64_t offset, int whence)
+{
+    MmapIO *m = opaque;
+    int64_t pos;
+
+    switch (whence & ~AVSEEK_FORCE) {
+    case AVSEEK_SIZE:
+        return m->size;
+    case SEEK_SET:
+        pos = offset;
+        break;
+    case SEEK_CUR:
+        pos = m->pos + offset;
+        break;
+    case SEEK_END:
+        pos = m->size + offset;
+        break;
+    default:
+        return AVERROR(EINVAL);
+    }
+    if (pos < 0 || pos > (int64_t)m->size)
+        return AVERROR(EINVAL);
+
+    /* a jump out of the window being read ahead restarts it at the new position */
+    if ((size_t)pos > m->advised || (size_t)pos + MMAP_IO_READAHEAD < m->advised)
+        m->advised = pos;
+    m->pos = pos;
+    mmap_io_readahead(m);
+    return pos;
+}
+
+AVIOContext *mmap_io_alloc(const char *filename)
+{
+    AVIOContext *pb = NULL;
+    MmapIO *m = NULL;
+    uint8_t *buffer = NULL;
+    struct stat st;
+    void *data;
+    int fd;
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size <= 0 ||
+        (uint64_t)st.st_size > SIZE_MAX) {
+        close(fd);
+        return NULL;
+    }
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    /* the mapping keeps the file referenced */
+    close(fd);
+    if (data == MAP_FAILED)
+        return NULL;
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+    m = av_mallocz(sizeof(*m));
+    buffer = av_malloc(MMAP_IO_BUFFER_SIZE);
+    if (!m || !buffer)
+        goto fail;
+    m->data = data;
+    m->size = st.st_size;
+    m->page_size = sysconf(_SC_PAGESIZE);
+    mmap_io_readahead(m);
+
+    pb = avio_alloc_context(buffer, MMAP_IO_BUFFER_SIZE, 0, m, mmap_io_read, NULL, mmap_io_seek);
+    if (!pb)
+        goto fail;
+    /* large reads (packet payloads) skip the AVIOContext buffer */
+    pb->direct = 1;
+    return pb;
+
+fail:
+    av_free(buffer);
+    av_free(m);
+    munmap(data, st.st_size);
+    return NULL;
+}
+
+void mmap_io_free(AVIOContext **pb)
+{
+    MmapIO *m;
+
+    if (!*pb)
+        return;
+    m = (*pb)->opaque;
+    munmap(m->data, m->size);
+    av_free(m);
+    av_freep(&(*pb)->buffer);
+    avio_context_free(pb);
+}
+
+int mmap_io_open_input(AVFormatContext **pic, const char *url,
+                       const AVInputFormat *fmt, AVDictionary **options)
+{
+    AVIOContext *pb = mmap_io_alloc(url);
+    AVFormatContext *ic;
+    int ret;
+
+    if (!pb)
+        return avformat_open_input(pic, url, fmt, options);
+
+    ic = *pic ? *pic : avformat_alloc_context();
+    if (!ic) {
+        mmap_io_free(&pb);
+        return AVERROR(ENOMEM);
+    }
+    ic->pb = pb;
+    ic->flags |= AVFMT_FLAG_CUSTOM_IO;
+    /* on failure avformat_open_input() frees ic, but never a custom pb */
+    if ((ret = avformat_open_input(&ic, url, fmt, options)) < 0) {
+        mmap_io_free(&pb);
+        *pic = NULL;
+        return ret;
+    }
+    *pic = ic;
+    return ret;
+}
+
+void mmap_io_close_input(AVFormatContext **pic)
+{
+    AVIOContext *pb = NULL;
+
+    if (!*pic)
+        return;
+    if ((*pic)->flags & AVFMT_FLAG_CUSTOM_IO)
+        pb = (*pic)->pb;
+    avformat_close_input(pic);
+    mmap_io_free(&pb);
+}
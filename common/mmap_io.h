@@ -0,0 +1,32 @@
+#ifndef COMMON_MMAP_IO_H
+#define COMMON_MMAP_IO_H
+
+#include <libavformat/avformat.h>
+
+/*
+ * Demux local files through a memory mapping instead of the file protocol.
+ * Reads are served from the mapping (large ones straight into the caller's
+ * buffer), seeks only move an offset, and the kernel is told the access is
+ * sequential and asked to fault the next MMAP_IO_READAHEAD bytes in ahead
+ * of the reader.
+ */
+
+#define MMAP_IO_BUFFER_SIZE (64 * 1024)
+#define MMAP_IO_READAHEAD   (8 * 1024 * 1024)
+
+/* an AVIOContext reading filename through mmap, NULL if it can't be mapped */
+AVIOContext *mmap_io_alloc(const char *filename);
+
+void mmap_io_free(AVIOContext **pb);
+
+/*
+ * avformat_open_input() on top of mmap_io_alloc(). Anything that can't be
+ * mapped (URLs, pipes, devices) is opened the regular way. Contexts opened
+ * here must be closed with mmap_io_close_input().
+ */
+int mmap_io_open_input(AVFormatContext **pic, const char *url,
+                       const AVInputFormat *fmt, AVDictionary **options);
+
+void mmap_io_close_input(AVFormatContext **pic);
+
+#endif /* COMMON_MMAP_IO_H */
@@ -0,0 +1,371 @@
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <libavutil/avstring.h>
+#include <libavutil/channel_layout.h>
+#include <libavutil/log.h>
+#include <libavutil/mem.h>
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+
+#include "probe_cache.h"
+
+#define PROBE_CACHE_MAGIC   MKTAG('P', 'R', 'B', 'C')
+#define PROBE_CACHE_VERSION 1
+
+/* everything find_stream_info fills in that the tools look at */
+typedef struct CachedStream {
+    AVCodecParameters *par;
+    AVRational avg_frame_rate;
+    AVRational r_frame_rate;
+    int64_t start_time;
+    int64_t duration;
+    int64_t nb_frames;
+} CachedStream;
+
+static char *probe_cache_path(const char *key)
+{
+    const char *xdg = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    char *dir;
+    uint64_t hash = 0xcbf29ce484222325ULL; /* FNV-1a */
+    char *path;
+    const char *p;
+
+    if (xdg && *xdg)
+        dir = av_asprintf("%s/probe_cache", xdg);
+    else if (home && *home)
+        dir = av_asprintf("%s/.cache/probe_cache", home);
+    else
+        return NULL;
+    if (!dir)
+        return NULL;
+    if (mkdir(dir, 0755) < 0 && errno == ENOENT && xdg == NULL) {
+        /* ~/.cache itself may not exist yet */
+        char *parent = av_asprintf("%s/.cache", home);
+        if (parent) {
+            mkdir(parent, 0755);
+            av_free(parent);
+        }
+        mkdir(dir, 0755);
+    }
+
+    for (p = key; *p; p++) {
+        hash ^= (uint8_t)*p;
+        hash *= 0x100000001b3ULL;
+    }
+    path = av_asprintf("%s/%016"PRIx64, dir, hash);
+    av_free(dir);
+    return path;
+}
+
+static void put_q(AVIOContext *pb, AVRational q)
+{
+    avio_wl32(pb, q.num);
+    avio_wl32(pb, q.den);
+}
+
+static AVRational get_q(AVIOContext *pb)
+{
+    AVRational q;
+    q.num = (int)avio_rl32(pb);
+    q.den = (int)avio_rl32(pb);
+    return q;
+}
+
+/* a result worth caching: every audio/video stream is fully described */
+static int probe_cache_complete(const AVFormatContext *ic)
+{
+    unsigned int i;
+
+    for (i = 0; i < ic->nb_streams; i++) {
+        const AVCodecParameters *par = ic->streams[i]->codecpar;
+        if (par->codec_type == AVMEDIA_TYPE_VIDEO) {
+            if (par->codec_id == AV_CODEC_ID_NONE || par->format < 0 ||
+                par->width <= 0 || par->height <= 0)
+                return 0;
+        } else if (par->codec_type == AVMEDIA_TYPE_AUDIO) {
+            if (par->codec_id == AV_CODEC_ID_NONE || par->format < 0 ||
+                par->sample_rate <= 0 || par->ch_layout.nb_channels <= 0 ||
+                par->ch_layout.order == AV_CHANNEL_ORDER_CUSTOM)
+                return 0;
+        }
+    }
+    return 1;
+}
+
+static int probe_cache_store(const AVFormatContext *ic, const char *path,
+                             const char *key, const struct stat *st)
+{
+    AVIOContext *pb = NULL;
+    char *tmp = av_asprintf("%s.tmp", path);
+    unsigned int i;
+    int ret;
+
+    if (!tmp)
+        return AVERROR(ENOMEM);
+    if ((ret = avio_open(&pb, tmp, AVIO_FLAG_WRITE)) < 0)
+        goto end;
+
+    avio_wl32(pb, PROBE_CACHE_MAGIC);
+    avio_wl32(pb, PROBE_CACHE_VERSION);
+    avio_wl32(pb, strlen(key));
+    avio_write(pb, (const unsigned char *)key, strlen(key));
+    avio_wl64(pb, st->st_size);
+    avio_wl64(pb, st->st_mtime);
+    avio_wl64(pb, ic->start_time);
+    avio_wl64(pb, ic->duration);
+    avio_wl64(pb, ic->bit_rate);
+    avio_wl32(pb, ic->nb_streams);
+
+    for (i = 0; i < ic->nb_streams; i++) {
+        const AVStream *s = ic->streams[i];
+        const AVCodecParameters *par = s->codecpar;
+
+        /* identify the stream the demuxer creates on open */
+        avio_wl32(pb, s->id);
+        put_q(pb, s->time_base);
+
+        avio_wl32(pb, par->codec_type);
+        avio_wl32(pb, par->codec_id);
+        avio_wl32(pb, par->codec_tag);
+        avio_wl32(pb, par->format);
+        avio_wl64(pb, par->bit_rate);
+        avio_wl32(pb, par->bits_per_coded_sample);
+        avio_wl32(pb, par->bits_per_raw_sample);
+        avio_wl32(pb, par->profile);
+        avio_wl32(pb, par->level);
+        avio_wl32(pb, par->width);
+        avio_wl32(pb, par->height);
+        put_q(pb, par->sample_aspect_ratio);
+        put_q(pb, par->framerate);
+        avio_wl32(pb, par->field_order);
+        avio_wl32(pb, par->color_range);
+        avio_wl32(pb, par->color_primaries);
+        avio_wl32(pb, par->color_trc);
+        avio_wl32(pb, par->color_space);
+        avio_wl32(pb, par->chroma_location);
+        avio_wl32(pb, par->video_delay);
+        avio_wl32(pb, par->ch_layout.order);
+        avio_wl32(pb, par->ch_layout.nb_channels);
+        avio_wl64(pb, par->ch_layout.order == AV_CHANNEL_ORDER_NATIVE ? par->ch_layout.u.mask : 0);
+        avio_wl32(pb, par->sample_rate);
+        avio_wl32(pb, par->block_align);
+        avio_wl32(pb, par->frame_size);
+        avio_wl32(pb, par->initial_padding);
+        avio_wl32(pb, par->trailing_padding);
+        avio_wl32(pb, par->seek_preroll);
+        avio_wl32(pb, par->extradata_size);
+        avio_write(pb, par->extradata, par->extradata_size);
+
+        put_q(pb, s->avg_frame_rate);
+        put_q(pb, s->r_frame_rate);
+        avio_wl64(pb, s->start_time);
+        avio_wl64(pb, s->duration);
+        avio_wl64(pb, s->nb_frames);
+    }
+    avio_wl32(pb, PROBE_CACHE_MAGIC);
+
+    ret = pb->error;
+    avio_closep(&pb);
+    /* readers only ever see a complete entry */
+    if (ret >= 0 && rename(tmp, path) < 0)
+        ret = AVERROR(errno);
+    if (ret < 0)
+        unlink(tmp);
+
+end:
+    av_free(tmp);
+    return ret;
+}
+
+static int probe_cache_read_stream(AVIOContext *pb, const AVStream *s, CachedStream *cs)
+{
+    AVCodecParameters *par = cs->par;
+    AVRational tb;
+    int order, nb_channels;
+    uint64_t mask;
+
+    if ((int)avio_rl32(pb) != s->id)
+        return AVERROR_INVALIDDATA;
+    tb = get_q(pb);
+    if (av_cmp_q(tb, s->time_base))
+        return AVERROR_INVALIDDATA;
+
+    par->codec_type            = (int)avio_rl32(pb);
+    par->codec_id              = avio_rl32(pb);
+    par->codec_tag             = avio_rl32(pb);
+    par->format                = (int)avio_rl32(pb);
+    par->bit_rate              = avio_rl64(pb);
+    par->bits_per_coded_sample = avio_rl32(pb);
+    par->bits_per_raw_sample   = avio_rl32(pb);
+    par->profile               = (int)avio_rl32(pb);
+    par->level                 = (int)avio_rl32(pb);
+    par->width                 = avio_rl32(pb);
+    par->height                = avio_rl32(pb);
+    par->sample_aspect_ratio   = get_q(pb);
+    par->framerate             = get_q(pb);
+    par->field_order           = avio_rl32(pb);
+    par->color_range           = avio_rl32(pb);
+    par->color_primaries       = avio_rl32(pb);
+    par->color_trc             = avio_rl32(pb);
+    par->color_space           = avio_rl32(pb);
+    par->chroma_location       = avio_rl32(pb);
+    par->video_delay           = avio_rl32(pb);
+    order                      = avio_rl32(pb);
+    nb_channels                = avio_rl32(pb);
+    mask                       = avio_rl64(pb);
+    par->sample_rate           = avio_rl32(pb);
+    par->block_align           = avio_rl32(pb);
+    par->frame_size            = avio_rl32(pb);
+    par->initial_padding       = avio_rl32(pb);
+    par->trailing_padding      = avio_rl32(pb);
+    par->seek_preroll          = avio_rl32(pb);
+
+    if (order == AV_CHANNEL_ORDER_NATIVE) {
+        av_channel_layout_from_mask(&par->ch_layout, mask);
+    } else if (nb_channels > 0) {
+        par->ch_layout.order = AV_CHANNEL_ORDER_UNSPEC;
+        par->ch_layout.nb_channels = nb_channels;
+    }
+
+    par->extradata_size = avio_rl32(pb);
+    if (par->extradata_size < 0 || par->extradata_size > (1 << 24))
+        return AVERROR_INVALIDDATA;
+    if (par->extradata_size) {
+        par->extradata = av_mallocz(par->extradata_size + AV_INPUT_BUFFER_PADDING_SIZE);
+        if (!par->extradata)
+            return AVERROR(ENOMEM);
+        if (avio_read(pb, par->extradata, par->extradata_size) != par->extradata_size)
+            return AVERROR_INVALIDDATA;
+    }
+
+    cs->avg_frame_rate = get_q(pb);
+    cs->r_frame_rate   = get_q(pb);
+    cs->start_time     = avio_rl64(pb);
+    cs->duration       = avio_rl64(pb);
+    cs->nb_frames      = avio_rl64(pb);
+    return pb->eof_reached ? AVERROR_INVALIDDATA : 0;
+}
+
+/* all or nothing: ic is only touched once the whole entry has been read and checked */
+static int probe_cache_load(AVFormatContext *ic, const char *path,
+                            const char *key, const struct stat *st)
+{
+    AVIOContext *pb = NULL;
+    CachedStream *cs = NULL;
+    char *stored_key = NULL;
+    int64_t start_time, duration, bit_rate;
+    unsigned int i, nb_streams = 0, key_len;
+    int ret;
+
+    if (avio_open(&pb, path, AVIO_FLAG_READ) < 0)
+        return AVERROR(ENOENT);
+
+    ret = AVERROR_INVALIDDATA;
+    if (avio_rl32(pb) != PROBE_CACHE_MAGIC || avio_rl32(pb) != PROBE_CACHE_VERSION)
+        goto end;
+    key_len = avio_rl32(pb);
+    if (key_len != strlen(key) || !(stored_key = av_malloc(key_len + 1)))
+        goto end;
+    if (avio_read(pb, (unsigned char *)stored_key, key_len) != key_len)
+        goto end;
+    stored_key[key_len] = 0;
+    if (strcmp(stored_key, key) ||
+        (int64_t)avio_rl64(pb) != st->st_size || (int64_t)avio_rl64(pb) != st->st_mtime) {
+        ret = AVERROR(ENOENT); /* another file, or this one changed */
+        goto end;
+    }
+    start_time = avio_rl64(pb);
+    duration   = avio_rl64(pb);
+    bit_rate   = avio_rl64(pb);
+    nb_streams = avio_rl32(pb);
+    if (nb_streams != ic->nb_streams)
+        goto end;
+
+    if (!(cs = av_calloc(nb_streams, sizeof(*cs)))) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    for (i = 0; i < nb_streams; i++) {
+        if (!(cs[i].par = avcodec_parameters_alloc())) {
+            ret = AVERROR(ENOMEM);
+            goto end;
+        }
+        if ((ret = probe_cache_read_stream(pb, ic->streams[i], &cs[i])) < 0)
+            goto end;
+    }
+    if (avio_rl32(pb) != PROBE_CACHE_MAGIC || pb->eof_reached) {
+        ret = AVERROR_INVALIDDATA;
+        goto end;
+    }
+
+    for (i = 0; i < nb_streams; i++) {
+        AVStream *s = ic->streams[i];
+        if ((ret = avcodec_parameters_copy(s->codecpar, cs[i].par)) < 0)
+            goto end;
+        s->avg_frame_rate = cs[i].avg_frame_rate;
+        s->r_frame_rate   = cs[i].r_frame_rate;
+        s->start_time     = cs[i].start_time;
+        s->duration       = cs[i].duration;
+        s->nb_frames      = cs[i].nb_frames;
+    }
+    ic->start_time = start_time;
+    ic->duration   = duration;
+    ic->bit_rate   = bit_rate;
+    ret = 0;
+
+end:
+    if (cs) {
+        for (i = 0; i < nb_streams; i++)
+            avcodec_parameters_free(&cs[i].par);
+        av_free(cs);
+    }
+    av_free(stored_key);
+    avio_closep(&pb);
+    return ret;
+}
+
+int probe_cache_find_stream_info(AVFormatContext *ic, const char *filename, int flags)
+{
+    struct stat st;
+    char *key = NULL, *path = NULL;
+    int ret;
+
+    if ((flags & PROBE_CACHE_STORE) && !stat(filename, &st) &&
+        (key = realpath(filename, NULL)) && (path = probe_cache_path(key))) {
+        ret = probe_cache_load(ic, path, key, &st);
+        if (ret >= 0) {
+            av_log(ic, AV_LOG_VERBOSE, "probe cache hit for %s\n", filename);
+            ret = 1;
+            goto end;
+        }
+        if (ret != AVERROR(ENOENT))
+            av_log(ic, AV_LOG_WARNING, "ignoring unusable probe cache entry %s\n", path);
+    }
+
+    if (flags & PROBE_CACHE_FAST) {
+        ic->probesize = PROBE_FAST_SIZE;
+        ic->max_analyze_duration = PROBE_FAST_DURATION;
+    }
+    if ((ret = avformat_find_stream_info(ic, NULL)) < 0)
+        goto end;
+    ret = 0;
+
+    if (path) {
+        if (probe_cache_complete(ic))
+            probe_cache_store(ic, path, key, &st);
+        else
+            av_log(ic, AV_LOG_VERBOSE, "incomplete stream parameters for %s, not cached\n", filename);
+    }
+
+end:
+    free(key); /* from realpath() */
+    av_free(path);
+    return ret;
+}
@@ -0,0 +1,29 @@
+#ifndef COMMON_PROBE_CACHE_H
+#define COMMON_PROBE_CACHE_H
+
+#include <libavformat/avformat.h>
+
+/*
+ * Stream probing for fast start, a drop-in for avformat_find_stream_info().
+ *
+ * PROBE_CACHE_FAST bounds how much is read while probing. PROBE_CACHE_STORE
+ * looks the input up in a cache of earlier probe results, keyed by its
+ * absolute path, size and mtime, and skips probing altogether on a hit;
+ * on a miss, complete results are written back for the next open. The
+ * cache lives in $XDG_CACHE_HOME/probe_cache (~/.cache/probe_cache).
+ */
+
+#define PROBE_CACHE_FAST  1
+#define PROBE_CACHE_STORE 2
+
+#define PROBE_FAST_SIZE     (256 * 1024)      ///< probesize in fast mode, bytes
+#define PROBE_FAST_DURATION (AV_TIME_BASE / 2) ///< max_analyze_duration in fast mode
+
+/*
+ * Fill in the stream parameters of ic, opened from filename. Returns 1 if
+ * they came from the cache, 0 if the input was probed, or a negative
+ * AVERROR.
+ */
+int probe_cache_find_stream_info(AVFormatContext *ic, const char *filename, int flags);
+
+#endif /* COMMON_PROBE_CACHE_H */